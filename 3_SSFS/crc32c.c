@@ -0,0 +1,159 @@
+/**
+ * ECSE-427: Assignment 3
+ * Simple Shadow File System
+ *
+ * CRC-32C (Castagnoli) checksums, as used by iSCSI and ext4. On x86 processors with SSE4.2, the crc32 instruction
+ * checksums 8 bytes at a time, on three interleaved streams to hide its latency. The CRCs of the streams are then
+ * combined, since a CRC is linear: the CRC of a stream followed by another is the CRC of the first, shifted over the
+ * length of the second, xor the CRC of the second. Elsewhere, a table-driven implementation (slicing by 8) is used.
+ */
+
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#endif
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u // Castagnoli polynomial, bit-reversed
+#define CRC32C_STRIPE 336 // Length of each of the three interleaved streams (1008 bytes of a 1024-byte block)
+
+unsigned int crc32c_table[8][256]; // Byte-wise CRC of each byte value, followed by 0 to 7 zero bytes
+unsigned int crc32c_shift_table[4][256]; // Shift of each byte of a CRC over CRC32C_STRIPE zero bytes
+int crc32c_mode = 0; // 1 if the processor has SSE4.2, 0 otherwise
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT; // Fills the tables and checks the processor, once per process
+
+/**
+ * Fills the tables of the table-driven implementation, and checks whether the processor has SSE4.2.
+ */
+void crc32c_init() {
+    for (unsigned int n = 0; n < 256; n++) {
+        unsigned int crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (unsigned int n = 0; n < 256; n++)
+            crc32c_table[t][n] = (crc32c_table[t - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][n] & 0xFF];
+    }
+    unsigned int shifted_bits[32]; // Shift of each bit of a CRC, from which the shift of any byte follows
+    for (int bit = 0; bit < 32; bit++) {
+        unsigned int crc = 1u << bit;
+        for (int k = 0; k < CRC32C_STRIPE; k++)
+            crc = (crc >> 8) ^ crc32c_table[0][crc & 0xFF];
+        shifted_bits[bit] = crc;
+    }
+    for (int t = 0; t < 4; t++) {
+        for (unsigned int n = 0; n < 256; n++) {
+            crc32c_shift_table[t][n] = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (n & (1u << bit))
+                    crc32c_shift_table[t][n] ^= shifted_bits[t * 8 + bit];
+            }
+        }
+    }
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    crc32c_mode = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#endif
+}
+
+/**
+ * Shifts a CRC over CRC32C_STRIPE zero bytes.
+ *
+ * @param crc  the CRC (inverted)
+ * @return     the CRC after the zero bytes (inverted)
+ */
+unsigned int crc32c_shift(unsigned int crc) {
+    return crc32c_shift_table[0][crc & 0xFF] ^ crc32c_shift_table[1][(crc >> 8) & 0xFF] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xFF] ^ crc32c_shift_table[3][crc >> 24];
+}
+
+/**
+ * Updates a CRC with the table-driven implementation, 8 bytes at a time.
+ *
+ * @param crc     the CRC so far (inverted)
+ * @param p       the bytes
+ * @param length  the number of bytes
+ * @return        the updated CRC (inverted)
+ */
+unsigned int crc32c_software(unsigned int crc, const unsigned char *p, size_t length) {
+    for (; length >= 8; p += 8, length -= 8) {
+        unsigned int low = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24);
+        unsigned int high = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int) p[7] << 24;
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+              crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^
+              crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+    }
+    for (; length > 0; length--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#ifdef CRC32C_X86
+/**
+ * Updates a CRC with the SSE4.2 crc32 instruction, 8 bytes at a time (4 on 32-bit processors). On 64-bit processors,
+ * three streams of CRC32C_STRIPE bytes are checksummed at once, since the instruction can start every cycle but takes
+ * three cycles to complete.
+ *
+ * @param crc     the CRC so far (inverted)
+ * @param p       the bytes
+ * @param length  the number of bytes
+ * @return        the updated CRC (inverted)
+ */
+__attribute__((target("sse4.2")))
+unsigned int crc32c_hardware(unsigned int crc, const unsigned char *p, size_t length) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; length >= 3 * CRC32C_STRIPE; p += 3 * CRC32C_STRIPE, length -= 3 * CRC32C_STRIPE) {
+        uint64_t crcs[3] = {crc64, 0, 0};
+        for (int i = 0; i < CRC32C_STRIPE; i += 8) {
+            uint64_t words[3];
+            memcpy(&words[0], p + i, 8);
+            memcpy(&words[1], p + CRC32C_STRIPE + i, 8);
+            memcpy(&words[2], p + 2 * CRC32C_STRIPE + i, 8);
+            crcs[0] = _mm_crc32_u64(crcs[0], words[0]);
+            crcs[1] = _mm_crc32_u64(crcs[1], words[1]);
+            crcs[2] = _mm_crc32_u64(crcs[2], words[2]);
+        }
+        crc64 = crc32c_shift(crc32c_shift((unsigned int) crcs[0]) ^ (unsigned int) crcs[1]) ^ (unsigned int) crcs[2];
+    }
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8); // Unaligned load
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (unsigned int) crc64;
+#endif
+    for (; length >= 4; p += 4, length -= 4) {
+        unsigned int word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; length > 0; length--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+/**
+ * Computes the CRC-32C of a buffer.
+ *
+ * @param data    the bytes to checksum
+ * @param length  the number of bytes
+ * @return        the CRC
+ */
+unsigned int crc32c(const void *data, size_t length) {
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef CRC32C_X86
+    if (crc32c_mode == 1)
+        return ~crc32c_hardware(~0u, data, length);
+#endif
+    return ~crc32c_software(~0u, data, length);
+}
@@ -0,0 +1,10 @@
+/**
+ * ECSE-427: Assignment 3
+ * Simple Shadow File System
+ *
+ * CRC-32C (Castagnoli) checksums.
+ */
+
+#include <stddef.h>
+
+unsigned int crc32c(const void *data, size_t length);
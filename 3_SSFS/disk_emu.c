@@ -3,23 +3,244 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+/*One backing image of a disk*/
+typedef struct _replica_t
+{
+    FILE* fp;
+    pthread_mutex_t lock; /*Serializes seeks and transfers on fp, so disks and replicas work in parallel*/
+    int queue_length; /*Number of transfers waiting for or holding the lock*/
+    int failed; /*Set when the replica misses a write: it is stale, and left out until it is rebuilt*/
+    double p; /*Probability that a block transfer fails*/
+    unsigned int seed; /*State of the random draws of failures*/
+} replica_t;
+
+/*A set of emulated disks, each with its replicas. Each volume of a process has its own*/
+struct _emulator_t
+{
+    replica_t replicas[MAX_DISKS][MAX_REPLICAS]; /*Backing images of each disk*/
+    pthread_mutex_t queue_lock; /*Guards the queue lengths while a replica is chosen*/
+    int num_disks;
+    double L, p;
+    int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+};
+
+emulator_t default_emulator;
+__thread emulator_t *current = &default_emulator; /*Emulator of the calling thread*/
+pthread_once_t default_emulator_once = PTHREAD_ONCE_INIT;
+
+/*One transfer on a replica, run by its own thread when a write goes to both replicas*/
+typedef struct _transfer_t
+{
+    emulator_t *emu;
+    int disk, replica, write, start_address, nblocks, failures;
+    void *buffer;
+    char *failed_blocks;
+} transfer_t;
+
+/*-------------------------------------------------------------------*/
+/*Copies every block of a replica of a disk to another of its replicas*/
+/*-------------------------------------------------------------------*/
+void copy_replica(emulator_t *emu, int disk, int from, int to)
+{
+    int i;
+    void* block = (void*) malloc(emu->BLOCK_SIZE);
+
+    /*Locks the replicas in a fixed order, whichever way the copy goes*/
+    pthread_mutex_lock(&emu->replicas[disk][0].lock);
+    pthread_mutex_lock(&emu->replicas[disk][1].lock);
+    fseek(emu->replicas[disk][from].fp, 0, SEEK_SET);
+    fseek(emu->replicas[disk][to].fp, 0, SEEK_SET);
+    for (i = 0; i < emu->MAX_BLOCK; i++)
+    {
+        fread(block, emu->BLOCK_SIZE, 1, emu->replicas[disk][from].fp);
+        fwrite(block, emu->BLOCK_SIZE, 1, emu->replicas[disk][to].fp);
+    }
+    fflush(emu->replicas[disk][to].fp);
+    emu->replicas[disk][to].failed = 0;
+    pthread_mutex_unlock(&emu->replicas[disk][1].lock);
+    pthread_mutex_unlock(&emu->replicas[disk][0].lock);
+    free(block);
+}
+
+/*----------------------------------------------------------------------*/
+/*Rebuilds the stale replica of a mirrored disk from its healthy replica.*/
+/*Returns 1 if a replica was rebuilt, 0 if none was stale, -1 if both are*/
+/*----------------------------------------------------------------------*/
+int rebuild_mirror(int disk)
+{
+    emulator_t *emu = current;
+    int i;
+    for (i = 0; i < MAX_REPLICAS; i++)
+    {
+        if (emu->replicas[disk][i].fp == NULL || !emu->replicas[disk][i].failed)
+            continue;
+        if (emu->replicas[disk][1 - i].fp == NULL || emu->replicas[disk][1 - i].failed)
+            return -1;
+        copy_replica(emu, disk, 1 - i, i);
+        return 1;
+    }
+    return 0;
+}
 
 /*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
+/*Close the disk files filled when you don't need them anymore*/
 /*----------------------------------------------------------*/
 int close_disk()
 {
-    if(NULL != fp)
+    emulator_t *emu = current;
+    int i, j;
+    for (i = 0; i < emu->num_disks; i++)
     {
-        fclose(fp);
+        /*Nothing on the images records which replica is stale, so it is rebuilt now*/
+        rebuild_mirror(i);
+        for (j = 0; j < MAX_REPLICAS; j++)
+        {
+            if(NULL != emu->replicas[i][j].fp)
+            {
+                fclose(emu->replicas[i][j].fp);
+                emu->replicas[i][j].fp = NULL;
+            }
+        }
     }
+    emu->num_disks = 0;
+    return 0;
+}
+
+/*-------------------------------------------*/
+/*Initializes the locks of an emulator        */
+/*-------------------------------------------*/
+void init_emulator(emulator_t *emu)
+{
+    int i, j;
+    for (i = 0; i < MAX_DISKS; i++)
+        for (j = 0; j < MAX_REPLICAS; j++)
+            pthread_mutex_init(&emu->replicas[i][j].lock, NULL);
+    pthread_mutex_init(&emu->queue_lock, NULL);
+}
+
+void init_default_emulator()
+{
+    init_emulator(&default_emulator);
+}
+
+/*-------------------------------------------------------------*/
+/*Creates an emulator with no disk, for a volume of its own     */
+/*-------------------------------------------------------------*/
+emulator_t *new_emulator()
+{
+    emulator_t *emu = calloc(1, sizeof(emulator_t));
+    init_emulator(emu);
+    return emu;
+}
+
+/*-------------------------------------------------------------*/
+/*Frees an emulator, once its disks are closed                  */
+/*-------------------------------------------------------------*/
+void free_emulator(emulator_t *emu)
+{
+    int i, j;
+    for (i = 0; i < MAX_DISKS; i++)
+        for (j = 0; j < MAX_REPLICAS; j++)
+            pthread_mutex_destroy(&emu->replicas[i][j].lock);
+    pthread_mutex_destroy(&emu->queue_lock);
+    free(emu);
+}
+
+/*-------------------------------------------------------------*/
+/*Makes the calling thread work on an emulator (the default one */
+/*if NULL), and returns the emulator it worked on until now     */
+/*-------------------------------------------------------------*/
+emulator_t *use_emulator(emulator_t *emu)
+{
+    emulator_t *previous = current;
+    current = emu != NULL ? emu : &default_emulator;
+    return previous;
+}
+
+/*-----------------------------------------------------------*/
+/*Opens a backing image as a replica of a disk, filling it   */
+/*with 0's if fresh. Returns the image, or NULL on failure.  */
+/*-----------------------------------------------------------*/
+FILE* open_replica(emulator_t *emu, int disk, int replica, char *filename, int fresh)
+{
+    int i, j;
+    FILE *image;
+
+    pthread_once(&default_emulator_once, init_default_emulator);
+    image = fopen (filename, fresh ? "w+b" : "r+b");
+    if (image == NULL)
+    {
+        printf("Could not open %s\n\n", filename);
+        return NULL;
+    }
+    if (fresh)
+    {
+        /*Fills the file with 0's to its given size*/
+        for (i = 0; i < emu->MAX_BLOCK; i++)
+        {
+            for (j = 0; j < emu->BLOCK_SIZE; j++)
+            {
+                fputc(0, image);
+            }
+        }
+    }
+    emu->replicas[disk][replica].fp = image;
+    emu->replicas[disk][replica].queue_length = 0;
+    emu->replicas[disk][replica].failed = 0;
+    emu->replicas[disk][replica].p = emu->p;
+    emu->replicas[disk][replica].seed = (unsigned int) time(0) + disk * MAX_REPLICAS + replica;
+    return image;
+}
+
+/*-----------------------------------------------------------------------*/
+/*Opens a backing image as the next disk, filling it with 0's if fresh.  */
+/*Returns the number of the disk, or -1 on failure.                      */
+/*-----------------------------------------------------------------------*/
+int attach_disk(char *filename, int fresh)
+{
+    emulator_t *emu = current;
+    if (emu->num_disks == MAX_DISKS)
+    {
+        printf("Too many disks to attach %s\n\n", filename);
+        return -1;
+    }
+    if (open_replica(emu, emu->num_disks, 0, filename, fresh) == NULL)
+        return -1;
+    return emu->num_disks++;
+}
+
+/*-----------------------------------------------------------------------*/
+/*Opens a backing image as the mirror of a disk (RAID-1). A fresh mirror */
+/*starts as a copy of the disk. Returns 0, or -1 on failure.             */
+/*-----------------------------------------------------------------------*/
+int attach_mirror(int disk, char *filename, int fresh)
+{
+    emulator_t *emu = current;
+    if (disk < 0 || disk >= emu->num_disks || emu->replicas[disk][1].fp != NULL)
+    {
+        printf("Could not attach %s as a mirror of disk %d\n\n", filename, disk);
+        return -1;
+    }
+    if (open_replica(emu, disk, 1, filename, fresh) == NULL)
+        return -1;
+    if (fresh)
+        copy_replica(emu, disk, 0, 1);
+    return 0;
+}
+
+/*----------------------------------------------------------------*/
+/*Sets the probability that a block transfer on a replica fails   */
+/*----------------------------------------------------------------*/
+int set_failure_rate(int disk, int replica, double rate)
+{
+    emulator_t *emu = current;
+    if (disk < 0 || disk >= emu->num_disks || replica < 0 || replica >= MAX_REPLICAS)
+        return -1;
+    emu->replicas[disk][replica].p = rate;
     return 0;
 }
 
@@ -28,37 +249,26 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-    
+    emulator_t *emu = current;
     /*Set up latency at 0.02 second*/
-    L = 00000.f;
+    emu->L = 00000.f;
     /*Set up failure at 10%*/
-    p = -1.f;
+    emu->p = -1.f;
     /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    emu->MAX_RETRY = 3;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    emu->BLOCK_SIZE = block_size;
+    emu->MAX_BLOCK = num_blocks;
     
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
-
-    if (fp == NULL)
+    /*Creates a new file, as disk 0*/
+    emu->num_disks = 0;
+    if (attach_disk(filename, 1) < 0)
     {
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
-    {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
-    }
     return 0;
 }
 /*----------------------------*/
@@ -66,115 +276,247 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
+    emulator_t *emu = current;
     /*Set up latency at 0.02 second*/
-    L = 00000.f;
+    emu->L = 00000.f;
     /*Set up failure at 10%*/
-    p = -1.f;
+    emu->p = -1.f;
     /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    emu->MAX_RETRY = 3;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
+    emu->BLOCK_SIZE = block_size;
+    emu->MAX_BLOCK = num_blocks;
     
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    /*Opens a file, as disk 0*/
+    emu->num_disks = 0;
+    if (attach_disk(filename, 0) < 0)
+        return -1;
+    return 0;
+}
 
-    if (fp == NULL)
+/*-----------------------------------------------------------------------*/
+/*Transfers a series of blocks between a replica and the buffer. Each    */
+/*block is retried up to MAX_RETRY times when a simulated failure occurs.*/
+/*Blocks that still fail are flagged. Returns the number of failures.    */
+/*-----------------------------------------------------------------------*/
+int transfer_blocks(emulator_t *emu, int disk, int replica, int write, int start_address, int nblocks, void *buffer,
+                    char *failed_blocks)
+{
+    int i, attempt, e, positioned;
+    double r;
+    replica_t *rep = &emu->replicas[disk][replica];
+    e = 0;
+    positioned = 0;
+
+    pthread_mutex_lock(&rep->lock);
+
+    /*For every block requested*/
+    for (i = 0; i < nblocks; ++i)
     {
-        printf("Could not open %s\n\n", filename);
-        return -1;
+        /*Pause until the latency duration is elapsed*/
+        if (write)
+            usleep(emu->L);
+
+        /*Simulates the failures of the transfer*/
+        for (attempt = 0; attempt <= emu->MAX_RETRY; attempt++)
+        {
+            r = (double) rand_r(&rep->seed) / RAND_MAX;
+            if (r >= rep->p)
+                break;
+        }
+        if (attempt > emu->MAX_RETRY)
+        {
+            e++;
+            failed_blocks[i] = 1;
+            positioned = 0;
+            continue;
+        }
+
+        /*Goto the block on the disk, unless the previous block was just transferred*/
+        if (!positioned)
+            fseek(rep->fp, (start_address + i) * emu->BLOCK_SIZE, SEEK_SET);
+        positioned = 1;
+        /*Transfers straight between the image and the buffer*/
+        if (write)
+        {
+            fwrite(buffer+(i*emu->BLOCK_SIZE), emu->BLOCK_SIZE, 1, rep->fp);
+        }
+        else
+        {
+            fread(buffer+(i*emu->BLOCK_SIZE), emu->BLOCK_SIZE, 1, rep->fp);
+        }
     }
-    return 0;
+
+    /*The blocks written reach the image once per transfer, rather than once per block*/
+    if (write)
+        fflush(rep->fp);
+
+    pthread_mutex_unlock(&rep->lock);
+    return e;
+}
+
+/*------------------------------------------------------*/
+/*Runs a transfer on a replica, from its own thread     */
+/*------------------------------------------------------*/
+void *run_transfer(void *arg)
+{
+    transfer_t *t = arg;
+    t->failures = transfer_blocks(t->emu, t->disk, t->replica, t->write, t->start_address, t->nblocks, t->buffer,
+                                  t->failed_blocks);
+    return NULL;
+}
+
+/*--------------------------------------------------------*/
+/*Whether a replica of a disk is attached and up to date  */
+/*--------------------------------------------------------*/
+int healthy(emulator_t *emu, int disk, int replica)
+{
+    return emu->replicas[disk][replica].fp != NULL && !emu->replicas[disk][replica].failed;
 }
 
 /*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
+/*Reads a series of blocks from a disk into the buffer. On a mirrored*/
+/*disk, the replica with the shortest queue serves the read, and the */
+/*other replica serves the blocks that fail on it.                   */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int read_disk_blocks(int disk, int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
-    e = 0;
-    s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    emulator_t *emu = current;
+    int i, e, replica;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > emu->MAX_BLOCK || disk < 0 || disk >= emu->num_disks)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    if (!healthy(emu, disk, 0) && !healthy(emu, disk, 1))
     {
-        /*Pause until the latency duration is elapsed*/
-        // usleep(L);
+        printf("no replica of disk %d to read from\n", disk);
+        return -1;
+    }
+    if (nblocks == 0)
+    {
+        return 0;
+    }
 
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
+    /*Picks the replica with the shortest queue*/
+    pthread_mutex_lock(&emu->queue_lock);
+    replica = healthy(emu, disk, 0) ? 0 : 1;
+    if (healthy(emu, disk, 0) && healthy(emu, disk, 1) &&
+        emu->replicas[disk][1].queue_length < emu->replicas[disk][0].queue_length)
+        replica = 1;
+    emu->replicas[disk][replica].queue_length++;
+    pthread_mutex_unlock(&emu->queue_lock);
 
-       for (j = 0; j < BLOCK_SIZE; j++)
+    char failed_blocks[nblocks];
+    memset(failed_blocks, 0, nblocks);
+    e = transfer_blocks(emu, disk, replica, 0, start_address, nblocks, buffer, failed_blocks);
+    pthread_mutex_lock(&emu->queue_lock);
+    emu->replicas[disk][replica].queue_length--;
+    pthread_mutex_unlock(&emu->queue_lock);
+
+    /*Fails over to the other replica*/
+    if (e > 0 && healthy(emu, disk, 1 - replica))
+    {
+        e = 0;
+        for (i = 0; i < nblocks; i++)
         {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+            if (failed_blocks[i])
+            {
+                failed_blocks[i] = 0;
+                e += transfer_blocks(emu, disk, 1 - replica, 0, start_address + i, 1, buffer+(i*emu->BLOCK_SIZE),
+                                     &failed_blocks[i]);
+            }
         }
     }
 
-    free(blockRead);
-
-
     /*If no failure return the number of blocks read, else return the negative number of failures*/
     if (e == 0)
-        return s;
+        return nblocks;
     else
-        return e;
+        return -e;
 }
 
 /*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
+/*Writes a series of blocks to a disk from the buffer. On a mirrored*/
+/*disk, both replicas are written in parallel. A replica that misses*/
+/*a block is left out of the mirror, since it is now stale.         */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int write_disk_blocks(int disk, int start_address, int nblocks, void *buffer)
 {
-    int i, e, s;
-    e = 0;
-    s = 0;
-
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    emulator_t *emu = current;
+    int i, e, mirrored, first;
+    transfer_t transfers[MAX_REPLICAS];
+    pthread_t thread;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > emu->MAX_BLOCK || disk < 0 || disk >= emu->num_disks ||
+        !(healthy(emu, disk, 0) || healthy(emu, disk, 1)))
     {
         printf("out of bound error\n");
         return -1;
     }
-
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
-    /*For every block requested*/        
-    for (i = 0; i < nblocks; ++i)
+    if (nblocks == 0)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        return 0;
+    }
 
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    char failed_blocks[MAX_REPLICAS][nblocks];
+    memset(failed_blocks, 0, sizeof(failed_blocks));
+    for (i = 0; i < MAX_REPLICAS; i++)
+    {
+        transfers[i] = (transfer_t) {emu, disk, i, 1, start_address, nblocks, 0, buffer, failed_blocks[i]};
+    }
+    mirrored = healthy(emu, disk, 0) && healthy(emu, disk, 1);
+    first = healthy(emu, disk, 0) ? 0 : 1;
+    if (mirrored)
+    {
+        pthread_create(&thread, NULL, run_transfer, &transfers[1]);
+        run_transfer(&transfers[0]);
+        pthread_join(thread, NULL);
+    }
+    else
+    {
+        run_transfer(&transfers[first]);
+    }
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+    /*Blocks are only lost if every replica written missed them*/
+    e = 0;
+    for (i = 0; i < nblocks; i++)
+    {
+        if (transfers[first].failed_blocks[i] && (!mirrored || transfers[1].failed_blocks[i]))
+            e++;
+    }
+    for (i = 0; i < MAX_REPLICAS; i++)
+    {
+        if (mirrored && transfers[i].failures > 0 && transfers[1 - i].failures == 0)
+        {
+            printf("disk %d: replica %d missed a write, and is left out of the mirror\n", disk, i);
+            emu->replicas[disk][i].failed = 1;
+        }
     }
-    free(blockWrite);
 
     /*If no failure return the number of blocks written, else return the negative number of failures*/
     if (e == 0)
-        return s;
+        return nblocks;
     else
-        return e;
+        return -e;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from disk 0 into the buffer               */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return read_disk_blocks(0, start_address, nblocks, buffer);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to disk 0 from the buffer               */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return write_disk_blocks(0, start_address, nblocks, buffer);
 }
@@ -1,5 +1,19 @@
+#define MAX_DISKS 8 /*Most disks managed at once*/
+#define MAX_REPLICAS 2 /*Backing images of a disk: the disk itself, and its mirror*/
+
+typedef struct _emulator_t emulator_t; /*A set of emulated disks*/
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int attach_disk(char *filename, int fresh);
+int read_disk_blocks(int disk, int start_address, int nblocks, void *buffer);
+int write_disk_blocks(int disk, int start_address, int nblocks, void *buffer);
+int attach_mirror(int disk, char *filename, int fresh);
+int rebuild_mirror(int disk);
+int set_failure_rate(int disk, int replica, double rate);
 int close_disk();
+emulator_t *new_emulator();
+void free_emulator(emulator_t *emu);
+emulator_t *use_emulator(emulator_t *emu);
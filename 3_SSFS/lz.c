@@ -0,0 +1,174 @@
+/**
+ * ECSE-427: Assignment 3
+ * Simple Shadow File System
+ *
+ * LZ77 block codec, in the LZ4 block format: a sequence is a token (literal length and match length, 4 bits each),
+ * the literals, then the 2-byte offset of the match. Lengths of 15 or more continue in extra bytes. The last sequence
+ * only has literals. The compressor is greedy, with a hash table of the last position of each 4-byte sequence.
+ */
+
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4 // Shortest match encoded
+#define LZ_MAX_OFFSET 65535 // Farthest match encoded
+#define LZ_HASH_BITS 12 // Size of the compressor's hash table (in bits)
+#define LZ_LAST_LITERALS 5 // The last bytes are always literals
+#define LZ_MATCH_LIMIT 12 // No match starts in the last bytes
+
+/**
+ * Hashes the 4 bytes at a position.
+ *
+ * @param p  the position
+ * @return   the hash, in [0, 2^LZ_HASH_BITS)
+ */
+unsigned int lz_hash(const unsigned char *p) {
+    unsigned int v = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Writes the extra bytes of a length.
+ *
+ * @param out     where to write
+ * @param length  the length, minus the 15 held by the token
+ * @return        the position after the bytes written
+ */
+unsigned char *lz_write_length(unsigned char *out, int length) {
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = (unsigned char) length;
+    return out;
+}
+
+/**
+ * Writes a sequence: literals, then a match (if any).
+ *
+ * @param out           where to write
+ * @param end           the end of the output buffer
+ * @param literals      the literals
+ * @param num_literals  the number of literals
+ * @param offset        the distance back to the match
+ * @param match_length  the length of the match, or 0 for the last sequence
+ * @return              the position after the sequence, or NULL if it does not fit
+ */
+unsigned char *lz_write_sequence(unsigned char *out, unsigned char *end, const unsigned char *literals,
+                                 int num_literals, int offset, int match_length) {
+    int extra = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+    if (end - out < 1 + num_literals / 255 + 1 + num_literals + 2 + extra / 255 + 1)
+        return NULL; // Error: no room (the bound is not tight)
+    unsigned char *token = out++;
+    *token = (unsigned char) ((num_literals < 15 ? num_literals : 15) << 4);
+    if (num_literals >= 15)
+        out = lz_write_length(out, num_literals - 15);
+    memcpy(out, literals, (size_t) num_literals);
+    out += num_literals;
+    if (match_length == 0)
+        return out;
+    *out++ = (unsigned char) (offset & 0xFF);
+    *out++ = (unsigned char) (offset >> 8);
+    *token |= (unsigned char) (extra < 15 ? extra : 15);
+    if (extra >= 15)
+        out = lz_write_length(out, extra - 15);
+    return out;
+}
+
+/**
+ * Compresses a buffer.
+ *
+ * @param source    the data to compress
+ * @param size      the size of the data
+ * @param dest      the buffer for the compressed data
+ * @param capacity  the size of the buffer
+ * @return          the size of the compressed data, or 0 if it does not fit in the buffer
+ */
+int lz_compress(const void *source, int size, void *dest, int capacity) {
+    const unsigned char *src = source;
+    unsigned char *out = dest;
+    unsigned char *end = out + capacity;
+    int table[1 << LZ_HASH_BITS]; // Last position of each hash
+    for (int i = 0; i < 1 << LZ_HASH_BITS; i++)
+        table[i] = -1;
+    int anchor = 0; // Start of the pending literals
+    for (int i = 0; i < size - LZ_MATCH_LIMIT;) {
+        unsigned int h = lz_hash(src + i);
+        int candidate = table[h];
+        table[h] = i;
+        if (candidate < 0 || i - candidate > LZ_MAX_OFFSET || memcmp(src + candidate, src + i, LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        int length = LZ_MIN_MATCH;
+        while (i + length < size - LZ_LAST_LITERALS && src[candidate + length] == src[i + length])
+            length++;
+        out = lz_write_sequence(out, end, src + anchor, i - anchor, i - candidate, length);
+        if (out == NULL)
+            return 0; // Error: does not fit
+        i += length;
+        anchor = i;
+    }
+    out = lz_write_sequence(out, end, src + anchor, size - anchor, 0, 0);
+    return out == NULL ? 0 : (int) (out - (unsigned char *) dest);
+}
+
+/**
+ * Reads the extra bytes of a length.
+ *
+ * @param in      the position of the bytes, moved past them
+ * @param end     the end of the compressed data
+ * @param length  the length held by the token, increased by the extra bytes
+ * @return        0 on success, -1 if the data ends in the middle of the length
+ */
+int lz_read_length(const unsigned char **in, const unsigned char *end, int *length) {
+    int byte;
+    do {
+        if (*in >= end)
+            return -1;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+ * Decompresses a buffer. Corrupted data is detected rather than read or written out of bounds.
+ *
+ * @param source    the compressed data
+ * @param size      the size of the compressed data
+ * @param dest      the buffer for the data
+ * @param capacity  the size of the buffer
+ * @return          the size of the data, or -1 if the compressed data is corrupted or does not fit in the buffer
+ */
+int lz_decompress(const void *source, int size, void *dest, int capacity) {
+    const unsigned char *in = source;
+    const unsigned char *in_end = in + size;
+    unsigned char *out = dest;
+    unsigned char *out_end = out + capacity;
+    while (in < in_end) {
+        int token = *in++;
+        int num_literals = token >> 4;
+        if (num_literals == 15 && lz_read_length(&in, in_end, &num_literals) < 0)
+            return -1; // Error: truncated
+        if (num_literals > in_end - in || num_literals > out_end - out)
+            return -1; // Error: literals out of bounds
+        memcpy(out, in, (size_t) num_literals);
+        in += num_literals;
+        out += num_literals;
+        if (in == in_end)
+            break; // The last sequence has no match
+        if (in_end - in < 2)
+            return -1; // Error: truncated
+        int offset = in[0] | in[1] << 8;
+        in += 2;
+        int length = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && lz_read_length(&in, in_end, &length) < 0)
+            return -1; // Error: truncated
+        if (offset == 0 || offset > out - (unsigned char *) dest || length > out_end - out)
+            return -1; // Error: match out of bounds
+        for (int i = 0; i < length; i++)
+            out[i] = out[i - offset]; // Byte by byte, since the match may overlap the output
+        out += length;
+    }
+    return (int) (out - (unsigned char *) dest);
+}
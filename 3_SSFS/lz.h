@@ -0,0 +1,9 @@
+/**
+ * ECSE-427: Assignment 3
+ * Simple Shadow File System
+ *
+ * LZ77 block codec, in the LZ4 block format.
+ */
+
+int lz_compress(const void *source, int size, void *dest, int capacity);
+int lz_decompress(const void *source, int size, void *dest, int capacity);
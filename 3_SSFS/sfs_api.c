@@ -8,34 +8,91 @@
 
 #include "sfs_api.h"
 #include "disk_emu.h"
+#include "lz.h"
+#include "crc32c.h"
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define MAGIC 260639512 // student id
+#define JOURNAL_MAGIC 0x4A524E4C // "JRNL", marks a transaction header
+#define JOURNAL_COMMIT_MAGIC 0x434D4954 // "CMIT", marks a transaction commit record
 #define BLOCK_SIZE 1024
 #define NUM_DATA_BLOCKS 1024 // Not including super, FBM, WM
 #define NUM_FILES 200 // Number of file i-nodes. Not including super. Set upper bound.
-#define NUM_INODES_PER_BLOCK 15
-#define NUM_DIRECTORY_ENTRIES_PER_BLOCK 60
+#define NUM_INODES_PER_BLOCK 16 // 64-byte inodes
+#define NUM_INODE_BLOCKS ((NUM_FILES + NUM_INODES_PER_BLOCK - 1) / NUM_INODES_PER_BLOCK)
 #define NUM_DIRECT_POINTERS 14
+#define MAX_INLINE_SIZE (NUM_DIRECT_POINTERS * (int) sizeof(int)) // Largest file stored in its inode
+#define INLINE_DATA (-2) // Indirect pointer of a file stored in its inode, in place of its direct pointers
+#define DIRECTORY (-3) // Indirect pointer of a directory, which never needs a single indirect block
 #define NUM_INDIRECT_POINTERS_PER_BLOCK 256
 #define NUM_SHADOWS 4
-#define MAX_FILENAME_LENGTH 10
-#define DIRECTORY_ENTRY_LENGTH 16
-#define NUM_ROOT_DIRECTORY_BLOCKS 4
+#define MAX_FILENAME_LENGTH 60 // Longest name of a file or directory in a path, plus the terminating null
+#define MAX_PATH_LENGTH 256 // Longest directory path kept in the path cache
+#define NUM_DENTRIES 512 // Entries of the lookup cache
+#define NUM_DIRECTORY_BUCKETS NUM_DIRECT_POINTERS // Hash buckets (blocks) of a directory, reached by direct pointers
+#define NUM_ENTRIES_PER_BUCKET 16 // 64-byte directory entries
+#define ROOT_INODE 0 // Inode of the root directory
+#define NUM_JOURNAL_BLOCKS 32 // Size of the metadata journal region
+#define JOURNAL_MAX_TX_BLOCKS 24 // Max block images in one transaction (not including header & commit record)
+#define JOURNAL_MAX_OP_BLOCKS 10 // Max metadata blocks a single operation can dirty (including checksum blocks)
+#define JOURNAL_GROUP_SIZE 32 // Number of operations batched into one journal commit
+#define NUM_WRITE_BUFFER_BLOCKS 64 // Max dirty blocks buffered per file before they are flushed
+#define FLUSH_INTERVAL_MS 100 // Period of the background flusher of a mounted volume
+#define DIRTY_EXPIRE_MS 500 // Age of buffered data that the background flusher writes back
+#define DIRTY_BACKGROUND_RATIO 50 // Percent of a write buffer that can be dirty before the flusher writes it back
+#define DIRTY_RATIO 10 // Percent of the data area that can be dirty in all write buffers before all are written back
+#define MAX_FILE_BLOCKS (NUM_DIRECT_POINTERS + NUM_INDIRECT_POINTERS_PER_BLOCK)
+#define CLUSTER_BLOCKS 4 // Blocks compressed together in a compressed file
+#define COMPRESSED (-16) // Pointers at or below this are the slots of a compressed cluster beyond its data
+#define MAX_EXTRA_REFS 255 // Most references to a data block beyond the first
+#define NUM_DEDUP_BUCKETS 256 // Hash buckets of the deduplication index
+#define READ_AHEAD_INITIAL_BLOCKS 4 // Read-ahead window of a newly opened file
+#define READ_AHEAD_MAX_BLOCKS 32 // Largest read-ahead window (and size of each read-ahead cache)
+#define NUM_FSCK_THREADS 4 // Number of threads scanning the inode table in ssfs_fsck
+#define SLAB_CAPACITY 16 // Most free buffers a slab keeps for reuse
+#define DEFAULT_STRIPE_WIDTH 4 // Consecutive data blocks kept on one disk before moving on to the next
+#define STRIPE_RUN_BLOCKS 64 // Longest run of blocks moved to or from one disk of a striped transfer at once
 #define SUPER_INDEX 0
+#define SUMMARY_INDEX 1
+#define INODE_TABLE_INDEX 2
+#define JOURNAL_INDEX (INODE_TABLE_INDEX + NUM_INODE_BLOCKS)
+#define REFCOUNT_INDEX (JOURNAL_INDEX + NUM_JOURNAL_BLOCKS)
+#define CHECKSUM_INDEX (REFCOUNT_INDEX + 1)
+#define NUM_CRCS_PER_BLOCK 256 // 4-byte CRCs
+#define NUM_CHECKSUM_BLOCKS (NUM_DATA_BLOCKS / NUM_CRCS_PER_BLOCK)
+#define FIRST_DATA_INDEX (CHECKSUM_INDEX + NUM_CHECKSUM_BLOCKS)
 #define FBM_INDEX 1022
 #define WM_INDEX 1023
+#define NUM_GROUPS 4 // Allocation groups the data area is split into
+#define GROUP_BLOCKS ((FBM_INDEX - FIRST_DATA_INDEX) / NUM_GROUPS) // Data blocks of each allocation group
+#define SEGMENT_BLOCKS 32 // Data blocks of each segment of the log, in log-structured mode
+#define NUM_SEGMENTS ((FBM_INDEX - FIRST_DATA_INDEX + SEGMENT_BLOCKS - 1) / SEGMENT_BLOCKS)
+#define CLEAN_MIN_FREE_SEGMENTS 4 // Free segments below which the background flusher runs the segment cleaner
+#define CLEAN_BUDGET_BLOCKS 32 // Most blocks the background flusher moves each time it runs the segment cleaner
+
+/**
+ * Block type. From the program's point of view, the disk emulator is just an array of blocks.
+ */
+typedef struct _block_t {
+    unsigned char bytes[BLOCK_SIZE]; // use char since 1 char = 1 byte
+} block_t;
 
 /**
  * Simple version of the UNIX inodes, with only single indirect.
  */
 typedef struct _inode_t { // total size of inode = 64 bytes
-    int size; // can have negative size (init to -1). Represents size of file, in bytes (can mod for number of blocks...)
-    int direct[NUM_DIRECT_POINTERS]; // init to -1
-    int indirect; // init to -1. Only used for large files
+    signed int size : 31; // can have negative size (init to -1). Represents size of file, in bytes
+    unsigned int compressed : 1; // Whether the file's clusters are compressed when written
+    union {
+        int direct[NUM_DIRECT_POINTERS]; // init to -1
+        char data[MAX_INLINE_SIZE]; // Contents of a tiny file, when indirect is INLINE_DATA
+    };
+    int indirect; // init to -1. Only used for large files, or INLINE_DATA for tiny files, or DIRECTORY
 } inode_t;
 
 /**
@@ -49,14 +106,23 @@ typedef struct _superblock_t {
     inode_t root;
     inode_t shadow[NUM_SHADOWS];
     int last_shadow;
+    int journal_sequence; // Sequence number of the first transaction in the journal region
+    int num_disks; // Number of disk images the data blocks are striped across (1 or less for a single disk)
+    int stripe_width; // Consecutive data blocks kept on one disk before moving on to the next
+    int mirrored; // Whether each disk image has a mirror image (RAID-1)
+    int log_structured; // Whether data blocks are appended at the head of the log rather than overwritten in place
 } super_block_t;
 
 /**
- * Block type. From the program's point of view, the disk emulator is just an array of blocks.
+ * Mount summary, kept in its own block and journaled like the rest of the metadata. It lets a mount serve requests
+ * without reading the inode table, directories or FBM: their blocks are only loaded when first accessed. The free
+ * block count is saved along with the FBM, so that both are always in the same transaction.
  */
-typedef struct _block_t {
-    unsigned char bytes[BLOCK_SIZE]; // use char since 1 char = 1 byte
-} block_t;
+typedef struct _summary_t {
+    int num_files; // Number of files and directories, not including the root directory
+    int inode_high_water; // One past the last used inode
+    int num_free_blocks; // Number of blocks marked free in the FBM
+} summary_t;
 
 /**
  * Open File Descriptor (OFD) table. Contains the read and write pointers for each file. Each file is identified by its
@@ -69,28 +135,62 @@ typedef struct _ofd_table_t {
 } ofd_table_t;
 
 /**
- * Single directory entry, which is simply the file name.
+ * Directory entry, linking a name to an inode. Each file is identified by the index of its inode, which is the same
+ * for the OFD table and inode table.
  */
-typedef struct _directory_entry_t {
+typedef struct _directory_entry_t { // total size of entry = 64 bytes
+    int inode; // 0 if the entry was never used (the root is in no directory), -1 if it was removed
     char filename[MAX_FILENAME_LENGTH];
 } directory_entry_t;
 
 /**
- * Root directory which contains all the directory entries for each file. Each file is identified by its index, which
- * is the same for the OFD table, root directory, and inode table. This root directory resides on the disk, but will
- * also be cached in memory.
+ * Hash bucket of a directory, which is one block of the directory's data. An entry goes in the bucket its name hashes
+ * to, or in the following buckets if that one is full (linear probing). Buckets that were never needed are holes.
+ * Buckets are metadata, so they are journaled.
+ */
+typedef union _directory_bucket_t {
+    directory_entry_t entries[NUM_ENTRIES_PER_BUCKET];
+    block_t block;
+} directory_bucket_t;
+
+/**
+ * Cache of the directory that the last resolved path led to, so that opening several files of the same directory
+ * only walks the path once.
+ */
+typedef struct _path_cache_t {
+    char path[MAX_PATH_LENGTH]; // Path of the directory
+    int inode; // Index of the directory inode, or -1 if nothing is cached
+} path_cache_t;
+
+/**
+ * Entry of the lookup cache, mapping a name in a directory to its inode. Negative entries remember that the name does
+ * not exist, along with the free slot where it would be created.
  */
-typedef struct _root_directory_t { // A block of directory entries (root directory)
-    directory_entry_t directory_entries[NUM_FILES];
-} root_directory_t;
+typedef struct _dentry_t {
+    int dir; // Index of the directory inode, or -1 if the entry is unused
+    int inode; // Index of the inode of the name, or -1 if the name does not exist
+    int slot; // Slot of the name in the directory, or the free slot for it (-1 if the directory is full)
+    char name[MAX_FILENAME_LENGTH];
+} dentry_t;
 
 /**
- * Structure containing all the inodes. This will be present on the disk, but will also be cached in memory.
+ * Structure containing all the inodes. This will be present on the disk, but will also be cached in memory. The block
+ * view pads the inodes to a whole number of blocks.
  */
-typedef struct _inode_table_t {
+typedef union _inode_table_t {
     inode_t inodes[NUM_FILES];
+    block_t blocks[NUM_INODE_BLOCKS];
 } inode_table_t;
 
+/**
+ * Checksum area, holding the CRC-32C of every block. It is journaled like the rest of the metadata, so that the CRC of
+ * a block always matches its committed contents.
+ */
+typedef union _checksums_t {
+    unsigned int crcs[NUM_DATA_BLOCKS];
+    block_t blocks[NUM_CHECKSUM_BLOCKS];
+} checksums_t;
+
 /**
  * A block holding only pointers to other data blocks. This is used for large files, where the direct pointers alone of
  * the inode are not enough to store the entire file. Each file can have a maximum of one indirect block.
@@ -100,510 +200,4420 @@ typedef struct _indirect_block_t {
 } indirect_block_t;
 
 /**
- * In-memory caches of all the important structures (super block, fbm block, wm block, OFD table, root directory, and
- * inode table).
+ * Header of a journal transaction. A transaction is laid out sequentially in the journal region as the header, the
+ * block images in the order of block_numbers, and a commit record (a header with the commit magic). A transaction is
+ * only replayed if its commit record matches the header.
  */
-super_block_t super; // Cache of the super block
-block_t fbm; // Cache of the FBM block, which keeps track of unused data blocks
-block_t wm; // Cache of the WM block, which keeps track of writeable data blocks
-ofd_table_t ofd_table; // Open File Descriptor table (cache of read and write pointers for each file)
-root_directory_t root_directory; // Cache of all file names
-inode_table_t inode_table; // Cache of all inodes
+typedef struct _journal_header_t {
+    int magic;
+    int sequence;
+    int num_blocks;
+    unsigned long checksum; // Checksum of the block images
+    int block_numbers[JOURNAL_MAX_TX_BLOCKS]; // Home addresses of the block images
+} journal_header_t;
 
 /**
- * Writes a single block to the disk emulator.
- *
- * @param start_address  the address to start writing data to (in number of blocks)
- * @param data           the data to write
+ * In-memory state of the metadata journal. Metadata updates are staged as block images in the open transaction, which
+ * is appended to the journal region once enough operations have been grouped together. Committed images are kept in
+ * memory until they are checkpointed (written to their home address), which happens when the journal region is full.
  */
-void write_single_block(int start_address, void *data) {
-    void *buf = calloc(1, BLOCK_SIZE); // Allocate a blank block
-    memcpy(buf, data, BLOCK_SIZE);
-    write_blocks(start_address, 1, buf);
-    free(buf);
-}
+typedef struct _journal_t {
+    int head; // Next free block of the journal region
+    int sequence; // Sequence number of the open transaction
+    int num_ops; // Number of operations grouped in the open transaction
+    int num_batches; // Number of open batches: while one is open, operations are only committed when it closes
+    int num_pending; // Number of block images in the open transaction
+    int pending_blocks[JOURNAL_MAX_TX_BLOCKS];
+    block_t pending[JOURNAL_MAX_TX_BLOCKS];
+    int num_logged; // Number of committed block images not yet checkpointed
+    int logged_blocks[NUM_JOURNAL_BLOCKS];
+    block_t logged[NUM_JOURNAL_BLOCKS];
+} journal_t;
+
+/**
+ * Write buffer of a file (delayed allocation). Written data is kept in memory, and blocks are only assigned to it on
+ * the disk when the buffer is flushed, so that the blocks of a whole stream of writes can be allocated as one
+ * contiguous run. The blocks needed by the buffered data are reserved up front, so that a flush never runs out of space.
+ */
+typedef struct _write_buffer_t {
+    int size; // Size of the file, including the buffered data
+    int reserved; // Number of free blocks reserved for the flush
+    int num_blocks; // Number of buffered blocks
+    long dirtied; // Time the buffer was taken (in ms), from which the age of its data is counted
+    int block_indices[NUM_WRITE_BUFFER_BLOCKS]; // Index in the file of each buffered block
+    block_t blocks[NUM_WRITE_BUFFER_BLOCKS];
+} write_buffer_t;
+
+/**
+ * Page of the block cache: the blocks cached by a file's read-ahead. A page can be pinned by zero-copy reads, which
+ * hand out pointers into it: a pinned page is never refilled or freed, and a read-ahead that needs to refill it moves
+ * on to a new page instead. The page is freed once it is neither cached nor pinned.
+ */
+typedef struct _cache_page_t {
+    int pins; // Number of zero-copy reads pointing into the page
+    int cached; // Whether the page is the cache of a read-ahead
+    struct _cache_page_t *next_pinned; // Next pinned page of the volume
+    block_t blocks[READ_AHEAD_MAX_BLOCKS];
+} cache_page_t;
+
+/**
+ * Read-ahead state of an open file. Sequential reads (starting where the previous read ended) double the window, other
+ * reads halve it. On a cache miss, the window's worth of blocks following the missed block are read into the cache.
+ */
+typedef struct _read_ahead_t {
+    int next_pointer; // Read pointer at the end of the previous read
+    int window; // Number of blocks to read on a miss
+    int first_block; // Index in the file of the first cached block
+    int num_blocks; // Number of cached blocks
+    cache_page_t *page; // Page holding the cached blocks, or NULL until the first miss
+} read_ahead_t;
+
+/**
+ * Progress of the online defragmenter, kept between calls to ssfs_defrag. The file being defragmented is moved, block
+ * by block, into a run of free blocks starting at target.
+ */
+typedef struct _defrag_t {
+    int file; // Index of the file being defragmented
+    int target; // Address of the run the file is moved to, or -1 if no run has been chosen yet
+    int next_block; // Index of the next block of the file to move
+} defrag_t;
+
+/**
+ * Background flusher of a volume mounted with ssfs_mount. Its thread serves the volume between the calls made on it:
+ * it wakes up every FLUSH_INTERVAL_MS, or as soon as a write leaves too much data buffered, and writes back the write
+ * buffers that are due, then commits the journal. In log-structured mode, it also runs the segment cleaner when the
+ * log is running out of free segments.
+ */
+typedef struct _flusher_t {
+    pthread_t thread;
+    pthread_cond_t wake; // Signaled (under the volume's lock) when there is data to write back, or when stopping
+    int running; // Whether the thread was started
+    int stopping; // Whether the thread must stop
+    int stalled_head; // Head of the log when the last clean moved no block, or -1
+    int stalled_free_blocks; // Free blocks when the last clean moved no block
+} flusher_t;
+
+/**
+ * Index of the contents of data blocks, so that a block identical to one already on the disk is stored once. Blocks
+ * are chained in hash buckets by the checksum of their contents. Only the blocks written since the file system was
+ * mounted are indexed.
+ */
+typedef struct _dedup_index_t {
+    int heads[NUM_DEDUP_BUCKETS]; // First block of each bucket, or -1
+    int next[BLOCK_SIZE]; // Next block in the bucket of each block, or -1
+    unsigned long hashes[BLOCK_SIZE]; // Checksum of the contents of each indexed block
+    unsigned char indexed[BLOCK_SIZE]; // Whether each block is indexed
+} dedup_index_t;
+
+/**
+ * Share of a striped transfer that goes to one disk, carried out by its own thread when several disks are involved.
+ */
+typedef struct _stripe_io_t {
+    ssfs_t *volume; // Volume of the transfer
+    int disk; // Disk of this share
+    int write; // Whether the blocks are written (or read)
+    int start_address; // Logical address of the first block of the whole transfer
+    int num_blocks; // Number of blocks of the whole transfer
+    block_t *buffer; // Buffer of the whole transfer
+} stripe_io_t;
+
+/**
+ * Volume and disk emulator a thread was serving before it started serving another volume.
+ */
+typedef struct _volume_context_t {
+    ssfs_t *volume;
+    emulator_t *emulator;
+} volume_context_t;
+
+/**
+ * Slab of free buffers of one size. Buffers are taken from the slab and given back to it instead of the heap, so that
+ * once the slab is warm the data path does no heap allocation. The buffers are plain heap buffers, so one that is
+ * freed rather than given back is not lost. The worker threads of a volume share its slabs, hence the lock.
+ */
+typedef struct _slab_t {
+    pthread_mutex_t lock;
+    int num_free; // Number of free buffers
+    void *buffers[SLAB_CAPACITY]; // Free buffers
+} slab_t;
+
+/**
+ * A mounted volume: in-memory caches of all the important structures (super block, fbm block, wm block, OFD table, and
+ * inode table), and the rest of the state of the file system. A process can serve several volumes at once.
+ */
+struct _ssfs_t {
+    super_block_t super; // Cache of the super block
+    block_t fbm; // Cache of the FBM block, which keeps track of unused data blocks
+    block_t wm; // Cache of the WM block, which keeps track of writeable data blocks
+    block_t refcounts; // Cache of the reference count block: number of references to each data block beyond the first
+    checksums_t checksums; // Cache of the checksum area
+    ofd_table_t ofd_table; // Open File Descriptor table (cache of read and write pointers for each file)
+    inode_table_t inode_table; // Cache of all inodes
+    summary_t summary; // Cache of the mount summary
+    unsigned char inode_blocks_loaded[NUM_INODE_BLOCKS]; // Whether each inode table block is cached
+    int bitmaps_loaded; // Whether the FBM, WM, reference counts and checksums are cached
+    journal_t journal; // Metadata journal
+    defrag_t defrag; // Progress of the online defragmenter
+    int log_head; // Address the next data blocks are appended at in log-structured mode, or 0 until one is chosen
+    write_buffer_t *write_buffers[NUM_FILES]; // Write buffer of each file, or NULL if the file has no buffered data
+    int reserved_blocks; // Number of free blocks reserved by all the write buffers
+    int prealloc_ends[NUM_FILES]; // Bound on the blocks each file has preallocated past its end (one past the last),
+                                  // MAX_FILE_BLOCKS until known since it is not kept on the disk
+    flusher_t flusher; // Background flusher of the write buffers (only for volumes mounted with ssfs_mount)
+    read_ahead_t read_aheads[NUM_FILES]; // Read-ahead state of each file
+    cache_page_t *pinned_pages; // Pages pinned by zero-copy reads
+    int mounted; // Whether a file system is currently mounted
+    path_cache_t path_cache; // Directory of the last resolved path
+    dentry_t dentries[NUM_DENTRIES]; // Lookup cache, direct-mapped by directory and name
+    dedup_index_t dedup_index; // Index of the contents of data blocks
+    slab_t block_slab; // Free block buffers (blocks read from the disk, indirect blocks, directory buckets)
+    slab_t write_buffer_slab; // Free write buffers
+    slab_t page_slab; // Free cache pages
+    emulator_t *emulator; // Disks of the volume
+    pthread_mutex_t lock; // Serializes the calls on the volume
+};
+
+ssfs_t default_volume = { // Volume of the calls that take no volume (mkssfs, ssfs_fopen, ...)
+    .block_slab = {.lock = PTHREAD_MUTEX_INITIALIZER},
+    .write_buffer_slab = {.lock = PTHREAD_MUTEX_INITIALIZER},
+    .page_slab = {.lock = PTHREAD_MUTEX_INITIALIZER},
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+__thread ssfs_t *fs = &default_volume; // Volume served by the calling thread
+ssfs_options_t default_options = {0, 1, DEFAULT_STRIPE_WIDTH, 0}; // Layout of the next fresh default volume
 
 /**
- * Reads a single data block from the disk emulator and places the data in a calloc'd buffer. It is up to the user to
- * free the buffer.
+ * Takes a buffer from a slab, or from the heap if the slab has no free buffer.
  *
- * @param   start_address the address to start reading from (in number of blocks)
- * @return  a pointer to the buffer with read data
+ * @param slab  the slab
+ * @param size  the size of the buffers of the slab
+ * @return      the buffer (to be given back with slab_put), or NULL if there is no memory for a new one
  */
-void *read_single_block(int start_address) {
-    void *buf = calloc(1, BLOCK_SIZE); // Allocate a blank block
-    read_blocks(start_address, 1, buf);
-    return buf;
+void *slab_get(slab_t *slab, size_t size) {
+    pthread_mutex_lock(&slab->lock);
+    void *buffer = slab->num_free > 0 ? slab->buffers[--slab->num_free] : NULL;
+    pthread_mutex_unlock(&slab->lock);
+    return buffer != NULL ? buffer : malloc(size);
 }
 
 /**
- * Saves the FBM to the disk emulator.
+ * Gives a buffer back to its slab, or to the heap if the slab is full.
+ *
+ * @param slab    the slab
+ * @param buffer  the buffer
  */
-void save_fbm() {
-    write_single_block(NUM_DATA_BLOCKS - 2, &fbm);
+void slab_put(slab_t *slab, void *buffer) {
+    pthread_mutex_lock(&slab->lock);
+    if (slab->num_free < SLAB_CAPACITY) {
+        slab->buffers[slab->num_free++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&slab->lock);
+    free(buffer);
 }
 
 /**
- * Saves the WM to the disk emulator.
+ * Frees every free buffer of a slab.
+ *
+ * @param slab  the slab
  */
-void save_wm() {
-    write_single_block(NUM_DATA_BLOCKS - 1, &wm);
+void slab_drain(slab_t *slab) {
+    pthread_mutex_lock(&slab->lock);
+    while (slab->num_free > 0)
+        free(slab->buffers[--slab->num_free]);
+    pthread_mutex_unlock(&slab->lock);
 }
 
 /**
- * Saves the root directory the disk emulator.
+ * Takes a block buffer from the volume's slab.
+ *
+ * @param zeroed  whether the buffer must be filled with zeros
+ * @return        the buffer (to be given back with put_block_buffer), or NULL if there is no memory
  */
-void save_root_directory() {
-    write_blocks(15, 4, &root_directory);
+void *get_block_buffer(int zeroed) {
+    void *buffer = slab_get(&fs->block_slab, BLOCK_SIZE);
+    if (buffer != NULL && zeroed)
+        memset(buffer, 0, BLOCK_SIZE);
+    return buffer;
 }
 
 /**
- * Saves the root directory to the emulator.
+ * Gives a block buffer back to the volume's slab.
+ *
+ * @param buffer  the buffer
  */
-void save_inode_table() {
-    void *buf = calloc(1, BLOCK_SIZE * NUM_DIRECT_POINTERS);
-    memcpy(buf, &inode_table, BLOCK_SIZE * NUM_DIRECT_POINTERS);
-    write_blocks(1, NUM_DIRECT_POINTERS, buf);
-    free(buf);
+void put_block_buffer(void *buffer) {
+    slab_put(&fs->block_slab, buffer);
 }
 
 /**
- * Finds a free data block in the disk emulator.
+ * Gets the time of a monotonic clock.
  *
- * @return  the address on the free block (in number of blocks)
+ * @return  the time (in ms)
  */
-int get_free_block() {
-    for (int i = 0; i < BLOCK_SIZE; i++) {
-        if (fbm.bytes[i] != 0) {  // Only need to use the LSB here
-            fbm.bytes[i] = 0;
-            save_fbm();
-            return i;
-        }
-    }
-    return -1;
+long now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
 }
 
 /**
- * Initializes the inode table and saves it to the disk emulator.
+ * Takes an empty write buffer from the volume's slab.
+ *
+ * @param size      the size of the file, including the buffered data
+ * @param reserved  the number of free blocks already reserved for the flush
+ * @return          the write buffer (to be given back with put_write_buffer), or NULL if there is no memory
  */
-void init_inode_table() {
-    for (int i = 0; i < NUM_FILES; i++) {
-        inode_table.inodes[i].size = -1;
-        inode_table.inodes[i].indirect = -1;
-        for (int j = 0; j < NUM_DIRECT_POINTERS; j++) {
-            inode_table.inodes[i].direct[j] = -1;
-        }
-    }
-    save_inode_table();
+write_buffer_t *get_write_buffer(int size, int reserved) {
+    write_buffer_t *buffer = slab_get(&fs->write_buffer_slab, sizeof(write_buffer_t));
+    if (buffer == NULL)
+        return NULL; // Error: no memory
+    buffer->size = size;
+    buffer->reserved = reserved;
+    buffer->num_blocks = 0; // The blocks are filled as they are buffered
+    buffer->dirtied = now_ms();
+    return buffer;
 }
 
 /**
- * Initializes the FBM and WM, and saves them to the disk emulator.
+ * Gives a write buffer back to the volume's slab.
+ *
+ * @param buffer  the write buffer
  */
-void init_fbm_and_wm() {
-    for (int i = 0; i < BLOCK_SIZE; i++) {
-        fbm.bytes[i] = 1;
-        wm.bytes[i] = 1;
-    }
-    fbm.bytes[BLOCK_SIZE - 1] = 0;
-    fbm.bytes[BLOCK_SIZE - 2] = 0;
-    wm.bytes[BLOCK_SIZE - 1] = 0; // TODO: Change this for shadowing...
-    wm.bytes[BLOCK_SIZE - 2] = 0;
-    save_fbm();
-    save_wm();
+void put_write_buffer(write_buffer_t *buffer) {
+    slab_put(&fs->write_buffer_slab, buffer);
 }
 
 /**
- * Initializes the super block, and saves it to the disk emulator.
+ * Takes an unpinned cache page from the volume's slab. Its blocks are not cleared.
+ *
+ * @param cached  whether the page is the cache of a read-ahead
+ * @return        the page (to be given back with put_page), or NULL if there is no memory
  */
-void init_super() { // populate root j-node // TODO: update super for shadowing section...
-    super.magic = MAGIC;
-    super.block_size = BLOCK_SIZE;
-    super.num_blocks = NUM_DATA_BLOCKS + 3;
-    super.num_inodes = 14;
-    super.last_shadow = -1;
-    inode_t root;
-    root.size = -1; // Q: Is the size of root = sum of all bytes or the number of i-nodes? (Probably sum of all bytes)
-    root.indirect = -1;
-    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
-        root.direct[i] = get_free_block(); // find free blocks for every direct pointer (should be 1...14)
-    }
-    super.root = root;
-    write_single_block(SUPER_INDEX, &super);
+cache_page_t *get_page(int cached) {
+    cache_page_t *page = slab_get(&fs->page_slab, sizeof(cache_page_t));
+    if (page == NULL)
+        return NULL; // Error: no memory
+    page->pins = 0;
+    page->cached = cached;
+    page->next_pinned = NULL;
+    return page;
 }
 
 /**
- * Initializes the root directory and saves it to the disk emulator.
+ * Gives a cache page back to the volume's slab.
+ *
+ * @param page  the page
  */
-void init_root_directory() {
-    for (int i = 0; i < NUM_FILES; i++) {
-        root_directory.directory_entries[i].filename[0] = '\0';
-    }
-    for (int j = 0; j < NUM_ROOT_DIRECTORY_BLOCKS; j++) {
-        get_free_block(); // should be (15...18)
-    }
-    save_root_directory();
+void put_page(cache_page_t *page) {
+    slab_put(&fs->page_slab, page);
 }
 
 /**
- * Initializes the open file descriptor table.
+ * Maps a logical block address to its disk and its address on that disk, following the striping of the mounted file
+ * system.
+ *
+ * @param address  the logical address of the block
+ * @param disk     where to store the disk of the block
+ * @return         the address of the block on its disk
  */
-void init_ofd() {
-    for (int i = 0; i < NUM_FILES; i++) {
-        ofd_table.read_pointers[i] = -1;
-        ofd_table.write_pointers[i] = -1;
-    }
+int map_block(int address, int *disk) {
+    *disk = 0;
+    if (fs->super.num_disks <= 1 || address < FIRST_DATA_INDEX || address >= FBM_INDEX)
+        return address;
+    int offset = address - FIRST_DATA_INDEX;
+    int unit = offset / fs->super.stripe_width;
+    *disk = unit % fs->super.num_disks;
+    return FIRST_DATA_INDEX + (unit / fs->super.num_disks) * fs->super.stripe_width + offset % fs->super.stripe_width;
 }
 
 /**
- * Formats the virtual disk and creates the SSFS file system on top of the disk.
+ * Carries out the share of a striped transfer that goes to one disk. Blocks that follow each other on the disk are
+ * transferred together (up to STRIPE_RUN_BLOCKS at a time), through a bounce buffer since they are not next to each
+ * other in the transfer's buffer.
  *
- * @param fresh  a flag to signal if the file system should be created from scratch. If false, the file
- *               system is opened from the disk.
+ * @param arg  the share of the transfer (a stripe_io_t)
+ * @return     NULL
  */
-void mkssfs(int fresh) {
-    char *disk_name = "seanstappas";
-    if (fresh) { // Create new copy
-        init_fresh_disk(disk_name, BLOCK_SIZE, NUM_DATA_BLOCKS + 3); // +3 for super, fbm, wm
-        init_fbm_and_wm();
-        init_super();
-        init_root_directory();
-        init_inode_table();
-    } else { // Access old copy
-        init_disk(disk_name, BLOCK_SIZE, NUM_DATA_BLOCKS + 3);
-        read_blocks(SUPER_INDEX, 1, &super);
-        read_blocks(1, NUM_DIRECT_POINTERS, &inode_table);
-        read_blocks(15, 4, &root_directory);
-        read_blocks(FBM_INDEX, 1, &fbm);
-        read_blocks(WM_INDEX, 1, &wm);
+void *stripe_io(void *arg) {
+    stripe_io_t *io = arg;
+    fs = io->volume;
+    use_emulator(fs->emulator);
+    block_t bounce[STRIPE_RUN_BLOCKS];
+    int indices[STRIPE_RUN_BLOCKS]; // Index in the transfer's buffer of each block of the current run
+    int run_start = -1;
+    int run_length = 0;
+    for (int i = 0; i <= io->num_blocks; i++) {
+        int disk = -1;
+        int physical = i < io->num_blocks ? map_block(io->start_address + i, &disk) : -1;
+        if (disk != io->disk)
+            continue;
+        if (run_length > 0 && (physical != run_start + run_length || run_length == STRIPE_RUN_BLOCKS)) { // Run ends
+            if (io->write) {
+                write_disk_blocks(io->disk, run_start, run_length, bounce);
+            } else {
+                read_disk_blocks(io->disk, run_start, run_length, bounce);
+                for (int j = 0; j < run_length; j++)
+                    io->buffer[indices[j]] = bounce[j];
+            }
+            run_length = 0;
+        }
+        if (run_length == 0)
+            run_start = physical;
+        indices[run_length] = i;
+        if (io->write)
+            bounce[run_length] = io->buffer[i];
+        run_length++;
     }
-    init_ofd();
+    if (run_length > 0) { // Last run
+        if (io->write) {
+            write_disk_blocks(io->disk, run_start, run_length, bounce);
+        } else {
+            read_disk_blocks(io->disk, run_start, run_length, bounce);
+            for (int j = 0; j < run_length; j++)
+                io->buffer[indices[j]] = bounce[j];
+        }
+    }
+    return NULL;
 }
 
 /**
- * Opens the given file. If the file does not exist, a new file with size 0 is created. If it
- * exists, read pointer is at the beginning of the file, and write pointer at the end (append
- * mode).
+ * Transfers blocks between a buffer and the disks, at their striped addresses. Each disk involved gets its own thread,
+ * so that the disks are driven in parallel.
  *
- * @param name  the name of the file to be opened
- * @return      an integer corresponding to the index of the entry for the opened file in the file
- *              descriptor table, or -1 on failure
+ * @param write          whether the blocks are written (or read)
+ * @param start_address  the logical address of the first block
+ * @param num_blocks     the number of blocks
+ * @param buffer         the buffer to write from or read into
  */
-int ssfs_fopen(char *name) {
-    if (strlen(name) < 1 || strlen(name) > MAX_FILENAME_LENGTH - 1)
-        return -1; // Error: invalid name
-
-    for (int i = 0; i < NUM_FILES; i++) {
-        if (strcmp(root_directory.directory_entries[i].filename, name) == 0) { // Root directory match found
-            int size = inode_table.inodes[i].size;
-            ofd_table.write_pointers[i] = size; // Update read & write pointers
-            ofd_table.read_pointers[i] = 0;
-            return i; // Success: returns index of existing file
-        }
+void striped_io(int write, int start_address, int num_blocks, void *buffer) {
+    if (fs->super.num_disks <= 1) { // No striping: everything is on the first disk
+        if (write)
+            write_blocks(start_address, num_blocks, buffer);
+        else
+            read_blocks(start_address, num_blocks, buffer);
+        return;
     }
-
-    // File doesn't exist
-    for (int j = 0; j < NUM_FILES; j++) {
-        if (root_directory.directory_entries[j].filename[0] == '\0') { // Free slot in the root directory
-            inode_table.inodes[j].size = 0;
-            save_inode_table();
-            ofd_table.write_pointers[j] = 0;
-            ofd_table.read_pointers[j] = 0;
-            strncpy(root_directory.directory_entries[j].filename, name,
-                    MAX_FILENAME_LENGTH); // Place the name in the root directory
-            save_root_directory();
-            return j; // Success: returns index of new file
+    stripe_io_t ios[MAX_DISKS];
+    int involved[MAX_DISKS] = {0};
+    int num_involved = 0;
+    for (int i = 0; i < num_blocks && num_involved < fs->super.num_disks; i++) {
+        int disk;
+        map_block(start_address + i, &disk);
+        if (!involved[disk]) {
+            involved[disk] = 1;
+            num_involved++;
         }
     }
-
-    return -1; // Error: no space for new file
+    pthread_t threads[MAX_DISKS];
+    for (int d = 0; d < fs->super.num_disks; d++) {
+        if (!involved[d])
+            continue;
+        ios[d] = (stripe_io_t) {fs, d, write, start_address, num_blocks, buffer};
+        if (num_involved == 1)
+            stripe_io(&ios[d]); // A single disk needs no thread
+        else
+            pthread_create(&threads[d], NULL, stripe_io, &ios[d]);
+    }
+    for (int d = 0; d < fs->super.num_disks && num_involved > 1; d++) {
+        if (involved[d])
+            pthread_join(threads[d], NULL);
+    }
 }
 
 /**
- * Closes the given file. The corresponding entry is removed from the open file descriptor table.
+ * Writes blocks to the disks, at their striped addresses.
  *
- * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
- * @return        0 on success, -1 on failure
+ * @param start_address  the logical address of the first block
+ * @param num_blocks     the number of blocks
+ * @param data           the data to write
  */
-int ssfs_fclose(int fileID) {
-    if (fileID < 0 || fileID >= NUM_FILES || ofd_table.read_pointers[fileID] < 0 ||
-        ofd_table.write_pointers[fileID] < 0)
-        return -1; // Error: invalid fileID
-
-    ofd_table.read_pointers[fileID] = -1; // Reset read & write pointers
-    ofd_table.write_pointers[fileID] = -1;
-
-    return 0; // Success
+void striped_write_blocks(int start_address, int num_blocks, void *data) {
+    striped_io(1, start_address, num_blocks, data);
 }
 
 /**
- * Moves the read pointer to the given location in the file.
+ * Reads blocks from the disks, at their striped addresses.
  *
- * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
- * @param loc     the location to move the read pointer to
- * @return        0 on success, -1 on failure
+ * @param start_address  the logical address of the first block
+ * @param num_blocks     the number of blocks
+ * @param data           the buffer to read into
  */
-int ssfs_frseek(int fileID, int loc) {
-    if (fileID < 0 || fileID >= NUM_FILES || ofd_table.read_pointers[fileID] < 0 ||
-        ofd_table.write_pointers[fileID] < 0 || loc < 0 || loc > inode_table.inodes[fileID].size) // Error checking
-        return -1; // Error: invalid fileID or loc
-
-    ofd_table.read_pointers[fileID] = loc; // Update read pointer
-
-    return 0; // Success
+void striped_read_blocks(int start_address, int num_blocks, void *data) {
+    striped_io(0, start_address, num_blocks, data);
 }
 
 /**
- * Moves the write pointer to the given location in the file.
+ * Writes a single block to the disk emulator.
  *
- * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
- * @param loc     the location to move the write pointer to
- * @return        0 on success, -1 on failure
+ * @param start_address  the address to start writing data to (in number of blocks)
+ * @param data           the data to write
  */
-int ssfs_fwseek(int fileID, int loc) {
-    if (fileID < 0 || fileID >= NUM_FILES || ofd_table.read_pointers[fileID] < 0 ||
-        ofd_table.write_pointers[fileID] < 0 || loc < 0 || loc > inode_table.inodes[fileID].size)
-        return -1; // Error: invalid fileID or loc
-
-    ofd_table.write_pointers[fileID] = loc; // Update write pointer
+void write_single_block(int start_address, void *data) {
+    striped_write_blocks(start_address, 1, data);
+}
 
-    return 0; // Success
+/**
+ * Reads a single data block from the disk emulator and places the data in a block buffer of the volume's slab. It is
+ * up to the user to give the buffer back with put_block_buffer.
+ *
+ * @param   start_address the address to start reading from (in number of blocks)
+ * @return  a pointer to the buffer with read data, or NULL if there is no memory for the buffer
+ */
+void *read_single_block(int start_address) {
+    void *buf = get_block_buffer(0);
+    if (buf != NULL)
+        striped_read_blocks(start_address, 1, buf);
+    return buf;
 }
 
 /**
- * Writes characters into a file on the disk, starting from the write pointer of the file. It is up to the user to
- * properly initialize and provide the data buffer.
+ * Computes a checksum of the given bytes (djb2).
  *
- * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
- * @param buf     the characters to be written into the file
- * @param length  the number of bytes to be written
- * @return        the number of bytes written, or -1 on failure (if reached maximum capacity)
+ * @param data    the bytes to checksum
+ * @param length  the number of bytes
+ * @return        the checksum
  */
-int ssfs_fwrite(int fileID, char *buf, int length) {
-    if (fileID < 0 || fileID >= NUM_FILES || ofd_table.read_pointers[fileID] < 0 ||
-        ofd_table.write_pointers[fileID] < 0 || length < 0)
-        return -1; // Error: invalid fileID or length
+unsigned long checksum(void *data, size_t length) {
+    unsigned char *bytes = data;
+    unsigned long hash = 5381;
+    for (size_t i = 0; i < length; i++)
+        hash = ((hash << 5) + hash) + bytes[i]; // hash * 33 + c
+    return hash;
+}
 
-    int write_pointer = ofd_table.write_pointers[fileID];
-    inode_t inode = inode_table.inodes[fileID]; // Find inode associated with current file
-    int size = inode.size;
-    int new_size = write_pointer + length; // New size of file after write is complete
-    if (new_size < size) {
-        new_size = size;
+/**
+ * Finds the image of the given block in a list of journal block images.
+ *
+ * @param block_numbers  the home addresses of the images
+ * @param num_images     the number of images in the list
+ * @param block_num      the home address to look for
+ * @return               the index of the image, or -1 if the block is not in the list
+ */
+int journal_find(int *block_numbers, int num_images, int block_num) {
+    for (int i = 0; i < num_images; i++) {
+        if (block_numbers[i] == block_num)
+            return i;
     }
-    int num_blocks = new_size / BLOCK_SIZE; // Number of blocks the file will take up
-    if (new_size % BLOCK_SIZE != 0)
-        num_blocks++;
-
-    char *buf1 = calloc(1, (size_t) (num_blocks * BLOCK_SIZE)); // Buffer to hold the entire read file
-    int old_read_pointer = ofd_table.read_pointers[fileID];
-    ssfs_frseek(fileID, 0);
-    ssfs_fread(fileID, buf1, size); // TODO: Make this more efficient (only read what is necessary)
-    ssfs_frseek(fileID, old_read_pointer); // Reset read pointer
+    return -1;
+}
 
-    memcpy(buf1 + write_pointer, buf, length);
+/**
+ * Saves the super block directly to its home address on the disk emulator.
+ */
+void save_super() {
+    block_t block;
+    memset(&block, 0, BLOCK_SIZE);
+    memcpy(&block, &fs->super, sizeof(super_block_t));
+    write_single_block(SUPER_INDEX, &block);
+}
 
-    indirect_block_t *indirect = NULL; // Cached indirect block
-    for (int i = 0; i < num_blocks; i++) {
-        int block_num;
-        if (i < NUM_DIRECT_POINTERS) { // Direct blocks
-            block_num = inode.direct[i];
-            if (block_num < 0) { // Uninitialized direct block
-                block_num = get_free_block();
-                inode_table.inodes[fileID].direct[i] = block_num;
-            }
-        } else { // Indirect blocks
-            if (inode.indirect < 0) { // Uninitialized single indirect block
-                indirect_block_t indirect_block;
-                int indirect_block_index = get_free_block();
-                inode.indirect = indirect_block_index;
-                inode_table.inodes[fileID].indirect = indirect_block_index;
-                block_num = get_free_block();
-                for (int j = 0; j < NUM_INDIRECT_POINTERS_PER_BLOCK; j++) {
-                    indirect_block.inode_indices[j] = -1;
-                }
-                indirect_block.inode_indices[0] = block_num;
-                write_single_block(indirect_block_index, &indirect_block); // Save single indirect block to emulator
-            } else { // Single indirect block is already initialized
-                if (indirect == NULL)
-                    indirect = (indirect_block_t *) read_single_block(inode.indirect); // Cache single indirect block
-                int indirect_index = i - NUM_DIRECT_POINTERS;
-                if (indirect_index >= NUM_INDIRECT_POINTERS_PER_BLOCK) {
-                    free(buf1);
-                    if (indirect != NULL)
-                        free(indirect);
-                    return -1; // Error: reached maximum number of indirect blocks
-                }
-                block_num = indirect->inode_indices[indirect_index];
-                if (block_num < 0) { // Uninitialized indirect block
-                    block_num = get_free_block();
-                    indirect->inode_indices[indirect_index] = block_num;
-                    write_single_block(inode.indirect, indirect);
-                }
-            }
-        }
-        if (block_num < 0 || block_num >= NUM_DATA_BLOCKS) {
-            free(buf1);
-            if (indirect != NULL)
-                free(indirect);
-            return -1; // Error: no free block (reached maximum capacity)
+/**
+ * Writes every committed block image to its home address, and empties the journal region. Images are written in
+ * order of address, so that contiguous images go out in a single write.
+ */
+void journal_checkpoint() {
+    for (int i = 1; i < fs->journal.num_logged; i++) { // Insertion sort by home address
+        for (int j = i; j > 0 && fs->journal.logged_blocks[j - 1] > fs->journal.logged_blocks[j]; j--) {
+            int block_num = fs->journal.logged_blocks[j];
+            fs->journal.logged_blocks[j] = fs->journal.logged_blocks[j - 1];
+            fs->journal.logged_blocks[j - 1] = block_num;
+            block_t image = fs->journal.logged[j];
+            fs->journal.logged[j] = fs->journal.logged[j - 1];
+            fs->journal.logged[j - 1] = image;
         }
-        write_blocks(block_num, 1, buf1 + (i * BLOCK_SIZE));
     }
-    free(buf1);
-    if (indirect != NULL)
-        free(indirect);
-
-    inode_table.inodes[fileID].size = new_size; // Update the inode's size
-    ofd_table.write_pointers[fileID] = new_size; // Move the write pointer to the end of the file
-    save_inode_table();
-
-    return length; // Success: returns the number of bytes written
+    int i = 0;
+    while (i < fs->journal.num_logged) {
+        int run = 1; // Number of images with consecutive addresses
+        while (i + run < fs->journal.num_logged &&
+               fs->journal.logged_blocks[i + run] == fs->journal.logged_blocks[i] + run)
+            run++;
+        striped_write_blocks(fs->journal.logged_blocks[i], run, &fs->journal.logged[i]);
+        i += run;
+    }
+    fs->journal.num_logged = 0;
+    fs->journal.head = JOURNAL_INDEX;
+    fs->super.journal_sequence = fs->journal.sequence; // Older transactions in the journal region are now stale
+    save_super();
 }
 
 /**
- * Read characters from a file on disk to a buffer, starting from the read pointer of the current file.
- *
- * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
- * @param buf     a buffer to store the read bytes in (already allocated)
- * @param length  the number of bytes to be read
- * @return        the number of bytes read
+ * Commits the open transaction by appending it to the journal region in a single sequential write. The journal is
+ * checkpointed first if the transaction does not fit.
  */
-int ssfs_fread(int fileID, char *buf, int length) {
-    if (fileID < 0 || fileID >= NUM_FILES || ofd_table.read_pointers[fileID] < 0 ||
-        ofd_table.write_pointers[fileID] < 0 || length < 0)
-        return -1; // Error: invalid fileID or length
-
-    int read_pointer = ofd_table.read_pointers[fileID];
-    inode_t inode = inode_table.inodes[fileID]; // Find inode associated with current file
-    int size = inode.size;
-    if (size == 0)
-        return 0; // Success: no bytes to read
+void journal_commit() {
+    fs->journal.num_ops = 0;
+    int num_blocks = fs->journal.num_pending;
+    if (num_blocks == 0)
+        return; // Nothing to commit
+    if (fs->journal.head + num_blocks + 2 > JOURNAL_INDEX + NUM_JOURNAL_BLOCKS)
+        journal_checkpoint();
 
-    int num_blocks = size / BLOCK_SIZE; // Number of blocks needed to hold file
-    if (size % BLOCK_SIZE != 0)
-        num_blocks++;
+    block_t buf[JOURNAL_MAX_TX_BLOCKS + 2]; // Header, block images and commit record
+    memset(&buf[0], 0, BLOCK_SIZE);
+    memset(&buf[num_blocks + 1], 0, BLOCK_SIZE);
+    journal_header_t *header = (journal_header_t *) &buf[0];
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = fs->journal.sequence;
+    header->num_blocks = num_blocks;
+    header->checksum = checksum(fs->journal.pending, (size_t) num_blocks * BLOCK_SIZE);
+    memcpy(header->block_numbers, fs->journal.pending_blocks, num_blocks * sizeof(int));
+    memcpy(&buf[1], fs->journal.pending, (size_t) num_blocks * BLOCK_SIZE);
+    memcpy(&buf[num_blocks + 1], header, sizeof(journal_header_t));
+    ((journal_header_t *) &buf[num_blocks + 1])->magic = JOURNAL_COMMIT_MAGIC;
+    striped_write_blocks(fs->journal.head, num_blocks + 2, buf);
 
-    int bytes_to_read = length; // Number of bytes to read
-    if (read_pointer + length > size) {
-        bytes_to_read = size - read_pointer;
-        if (bytes_to_read <= 0)
-            return 0; // Success: no bytes to read
-    }
-    char *buf1 = calloc(1, BLOCK_SIZE); // Buffer to hold each block read
-    char *buf2 = calloc(1, (size_t) (num_blocks * BLOCK_SIZE)); // Buffer to hold the entire file
-    indirect_block_t *indirect = NULL;
-    for (int i = 0; i < num_blocks; i++) {
-        int block_num;
-        if (i < NUM_DIRECT_POINTERS) // Direct blocks
-            block_num = inode.direct[i];
-        else { // Indirect blocks
-            if (indirect == NULL)
-                indirect = (indirect_block_t *) read_single_block(inode.indirect); // Cache single indirect block
-            int indirect_index = i - NUM_DIRECT_POINTERS;
-            if (indirect_index >= NUM_INDIRECT_POINTERS_PER_BLOCK) {
-                free(buf1);
-                free(buf2);
-                if (indirect != NULL)
-                    free(indirect);
-                return -1; // Error: reached maximum size of single indirect block
-            }
-            block_num = indirect->inode_indices[indirect_index];
-        }
-        if (block_num < 0) {
-            free(buf1);
-            free(buf2);
-            if (indirect != NULL)
-                free(indirect);
-            return -1; // Error: invalid block number (tried to read from uninitialized block)
+    fs->journal.head += num_blocks + 2;
+    fs->journal.sequence++;
+    for (int i = 0; i < num_blocks; i++) { // Committed images stay cached until the next checkpoint
+        int index = journal_find(fs->journal.logged_blocks, fs->journal.num_logged, fs->journal.pending_blocks[i]);
+        if (index < 0) {
+            index = fs->journal.num_logged++;
+            fs->journal.logged_blocks[index] = fs->journal.pending_blocks[i];
         }
-        memset(buf1, 0, BLOCK_SIZE); // Clear first buffer
-        read_blocks(block_num, 1, buf1); // Place data block in first buffer
-        memcpy(buf2 + (i * BLOCK_SIZE), buf1, BLOCK_SIZE); // Place data block in big buffer
+        fs->journal.logged[index] = fs->journal.pending[i];
     }
+    fs->journal.num_pending = 0;
+}
 
-    free(buf1);
-    memcpy(buf, buf2 + read_pointer, bytes_to_read); // Copy needed data into final buffer (starting from read pointer)
+/**
+ * Starts a metadata operation. The open transaction is committed first if it might not have room for the operation,
+ * so that an operation never spans two transactions.
+ */
+void journal_begin() {
+    if (fs->journal.num_pending + JOURNAL_MAX_OP_BLOCKS > JOURNAL_MAX_TX_BLOCKS)
+        journal_commit();
+}
 
-    free(buf2);
-    if (indirect != NULL)
-        free(indirect);
+/**
+ * Ends a metadata operation. Operations are grouped, and the open transaction is only committed once
+ * JOURNAL_GROUP_SIZE operations have been batched together, or once the open batches are closed.
+ */
+void journal_end() {
+    fs->journal.num_ops++;
+    if (fs->journal.num_ops >= JOURNAL_GROUP_SIZE && fs->journal.num_batches == 0)
+        journal_commit();
+}
 
-    ofd_table.read_pointers[fileID] = read_pointer + bytes_to_read; // Move read pointer up
+/**
+ * Stages a block image in the open transaction. Staging the same block again overwrites its image.
+ *
+ * @param block_num  the home address of the block
+ * @param data       the block contents
+ */
+void journal_stage(int block_num, void *data) {
+    int index = journal_find(fs->journal.pending_blocks, fs->journal.num_pending, block_num);
+    if (index < 0) {
+        index = fs->journal.num_pending++;
+        fs->journal.pending_blocks[index] = block_num;
+    }
+    memcpy(&fs->journal.pending[index], data, BLOCK_SIZE);
+}
 
-    return bytes_to_read; // Success: returns the number of bytes read
+/**
+ * Loads the FBM, WM, reference counts and checksums on first access.
+ */
+void load_bitmaps() {
+    if (!fs->bitmaps_loaded) {
+        striped_read_blocks(FBM_INDEX, 1, &fs->fbm);
+        striped_read_blocks(WM_INDEX, 1, &fs->wm);
+        striped_read_blocks(REFCOUNT_INDEX, 1, &fs->refcounts);
+        striped_read_blocks(CHECKSUM_INDEX, NUM_CHECKSUM_BLOCKS, &fs->checksums);
+        fs->bitmaps_loaded = 1;
+    }
 }
 
 /**
- * Removes a file from the filesystem. The file is removed from the directory entry, the i-node
- * entry is released, and the data blocks used by the file are released. Set all blocks used by file to free in the FBM
- * and remove the associated inode from the inode table.
+ * Checks whether a block has a checksum. The super block and the journal region are written outside of transactions
+ * (the journal checksums its own transactions), and the checksum area cannot hold its own checksums.
  *
- * @param file  the file name
- * @return      0 on success, -1 on failure
+ * @param block_num  the address of the block (in number of blocks)
+ * @return           1 if the block has a checksum, 0 otherwise
  */
-int ssfs_remove(char *file) {
-    for (int i = 0; i < NUM_FILES; i++) {
-        if (strcmp(root_directory.directory_entries[i].filename, file) == 0) { // Found file in root directory
-            root_directory.directory_entries[i].filename[0] = '\0'; // Clear filename
-            save_root_directory();
-            ofd_table.read_pointers[i] = -1; // Clear read & write pointers
-            ofd_table.write_pointers[i] = -1;
-            inode_t inode = inode_table.inodes[i];
-            for (int j = 0; j < NUM_DIRECT_POINTERS; j++) {
-                int block_number = inode.direct[j];
-                if (block_number != -1) {
-                    fbm.bytes[block_number] = 1; // Free the direct blocks
-                }
-                inode_table.inodes[i].direct[j] = -1;
-            }
-            inode_table.inodes[i].size = -1;
-            if (inode.indirect != -1) {
-                indirect_block_t *indirect = (indirect_block_t *) read_single_block(inode.indirect);
-                for (int j = 0; j < NUM_INDIRECT_POINTERS_PER_BLOCK; j++) {
-                    int block_num = indirect->inode_indices[j];
-                    if (block_num != -1) {
-                        fbm.bytes[block_num] = 1; // Free the indirect blocks
-                    }
-                }
-                free(indirect);
-                inode_table.inodes[i].indirect = -1;
-            }
-            save_fbm();
-            save_inode_table();
-            return 0; // Success: file removed
-        }
-    }
+int checksummed(int block_num) {
+    return block_num != SUPER_INDEX && (block_num < JOURNAL_INDEX || block_num >= JOURNAL_INDEX + NUM_JOURNAL_BLOCKS) &&
+           (block_num < CHECKSUM_INDEX || block_num >= CHECKSUM_INDEX + NUM_CHECKSUM_BLOCKS);
+}
 
-    return -1; // Error: file not found in root directory (invalid file name)
+/**
+ * Records the checksum of the new contents of a block, and stages its checksum block in the open transaction.
+ *
+ * @param block_num  the address of the block (in number of blocks)
+ * @param data       the block contents
+ */
+void stamp_block(int block_num, void *data) {
+    load_bitmaps();
+    fs->checksums.crcs[block_num] = crc32c(data, BLOCK_SIZE);
+    journal_stage(CHECKSUM_INDEX + block_num / NUM_CRCS_PER_BLOCK,
+                  &fs->checksums.blocks[block_num / NUM_CRCS_PER_BLOCK]);
 }
 
 /**
- * Creates a shadow of the file system. The newly added blocks become read-only.
+ * Stages a metadata block image in the open transaction, along with its checksum. Staging the same block again
+ * overwrites its image.
  *
- * @return  the index of the shadow root that holds the previous commit on success, -1 on failure
+ * @param block_num  the home address of the block
+ * @param data       the block contents
  */
-int ssfs_commit() {
-    int last_shadow = super.last_shadow;
-    if (last_shadow == -1) // Uninitialized last shadow
-        return -1;
-    write_single_block(NUM_DATA_BLOCKS - 1, &fbm); // Copy the FBM into the WM
-    int next_shadow = (last_shadow + 1) % NUM_SHADOWS;
-    super.shadow[next_shadow].size = 0;
-    super.last_shadow = next_shadow;
-    write_single_block(0, &super); // Save super
-    return last_shadow;
+void journal_write(int block_num, void *data) {
+    journal_stage(block_num, data);
+    if (checksummed(block_num))
+        stamp_block(block_num, data);
 }
 
 /**
- * Restores the file system to a previous shadow (state).
+ * Writes data blocks to the disk emulator, and stages their new checksums. This must be done within a metadata
+ * operation.
  *
- * @param cnum  The commit number to restore to.
- * @return      0 on success, -1 on failure
+ * @param start_address  the address of the first block (in number of blocks)
+ * @param num_blocks     the number of blocks
+ * @param data           the data to write
  */
-int ssfs_restore(int cnum) {
+void write_data_blocks(int start_address, int num_blocks, void *data) {
+    striped_write_blocks(start_address, num_blocks, data);
+    for (int i = 0; i < num_blocks; i++)
+        stamp_block(start_address + i, (block_t *) data + i);
+}
+
+/**
+ * Reads data blocks from the disk emulator, and verifies their checksums up to the first block that fails, which is
+ * reported on stdout.
+ *
+ * @param start_address  the address of the first block (in number of blocks)
+ * @param num_blocks     the number of blocks
+ * @param data           the buffer to read into
+ * @return               the number of blocks before the first one that fails its checksum (num_blocks if none fails)
+ */
+int read_data_blocks(int start_address, int num_blocks, void *data) {
+    striped_read_blocks(start_address, num_blocks, data);
+    load_bitmaps();
+    for (int i = 0; i < num_blocks; i++) {
+        if (crc32c((block_t *) data + i, BLOCK_SIZE) != fs->checksums.crcs[start_address + i]) {
+            printf("ssfs: block %d fails its checksum\n", start_address + i);
+            return i;
+        }
+    }
+    return num_blocks;
+}
+
+/**
+ * Removes a block from the journal, since it is being freed and may be reused for file data. If the block has already
+ * been committed, the journal is checkpointed so that the stale image can never be replayed over new data.
+ *
+ * @param block_num  the home address of the block
+ */
+void journal_revoke(int block_num) {
+    int index = journal_find(fs->journal.pending_blocks, fs->journal.num_pending, block_num);
+    if (index >= 0) {
+        fs->journal.num_pending--;
+        fs->journal.pending_blocks[index] = fs->journal.pending_blocks[fs->journal.num_pending];
+        fs->journal.pending[index] = fs->journal.pending[fs->journal.num_pending];
+    }
+    if (journal_find(fs->journal.logged_blocks, fs->journal.num_logged, block_num) >= 0)
+        journal_checkpoint();
+}
+
+/**
+ * Replays every committed transaction of the journal region onto the home addresses of its blocks. Replay stops at the
+ * first transaction that is stale, torn or missing its commit record.
+ */
+void journal_replay() {
+    int head = JOURNAL_INDEX;
+    int sequence = fs->super.journal_sequence;
+    block_t buf[JOURNAL_MAX_TX_BLOCKS + 2];
+    while (head + 2 <= JOURNAL_INDEX + NUM_JOURNAL_BLOCKS) {
+        journal_header_t header;
+        striped_read_blocks(head, 1, &buf[0]);
+        memcpy(&header, &buf[0], sizeof(journal_header_t));
+        int num_blocks = header.num_blocks;
+        if (header.magic != JOURNAL_MAGIC || header.sequence != sequence || num_blocks <= 0 ||
+            num_blocks > JOURNAL_MAX_TX_BLOCKS || head + num_blocks + 2 > JOURNAL_INDEX + NUM_JOURNAL_BLOCKS)
+            break; // Stale or invalid header: end of the journal
+        striped_read_blocks(head + 1, num_blocks + 1, &buf[1]);
+        journal_header_t *commit = (journal_header_t *) &buf[num_blocks + 1];
+        if (commit->magic != JOURNAL_COMMIT_MAGIC || commit->sequence != sequence ||
+            commit->checksum != header.checksum || checksum(&buf[1], (size_t) num_blocks * BLOCK_SIZE) != header.checksum)
+            break; // Torn transaction: never committed
+        for (int i = 0; i < num_blocks; i++)
+            striped_write_blocks(header.block_numbers[i], 1, &buf[i + 1]);
+        head += num_blocks + 2;
+        sequence++;
+    }
+
+    fs->journal.head = JOURNAL_INDEX;
+    fs->journal.sequence = sequence;
+    fs->journal.num_ops = 0;
+    fs->journal.num_pending = 0;
+    fs->journal.num_logged = 0;
+    if (sequence != fs->super.journal_sequence) { // Replayed transactions are now at home
+        fs->super.journal_sequence = sequence;
+        save_super();
+    }
+}
+
+
+/**
+ * Reads a metadata block, looking in the journal first since its home address may be stale.
+ *
+ * @param start_address  the home address of the block
+ * @return               a pointer to a block buffer with the block (to be given back with put_block_buffer), or NULL
+ *                       if there is no memory for the buffer
+ */
+void *read_metadata_block(int start_address) {
+    int index = journal_find(fs->journal.pending_blocks, fs->journal.num_pending, start_address);
+    if (index >= 0) {
+        void *buf = get_block_buffer(0);
+        if (buf != NULL)
+            memcpy(buf, &fs->journal.pending[index], BLOCK_SIZE);
+        return buf;
+    }
+    index = journal_find(fs->journal.logged_blocks, fs->journal.num_logged, start_address);
+    if (index >= 0) {
+        void *buf = get_block_buffer(0);
+        if (buf != NULL)
+            memcpy(buf, &fs->journal.logged[index], BLOCK_SIZE);
+        return buf;
+    }
+    return read_single_block(start_address);
+}
+
+/**
+ * Stages the blocks of an in-memory metadata region (padded to whole blocks) that overlap the given byte range.
+ *
+ * @param start_address  the home address of the region (in number of blocks)
+ * @param region         the in-memory copy of the region
+ * @param offset         the offset of the modified bytes in the region
+ * @param length         the number of modified bytes
+ */
+void save_region(int start_address, void *region, size_t offset, size_t length) {
+    for (size_t i = offset / BLOCK_SIZE; i <= (offset + length - 1) / BLOCK_SIZE; i++)
+        journal_write(start_address + (int) i, (char *) region + i * BLOCK_SIZE);
+}
+
+/**
+ * Loads the blocks of an in-memory metadata region (padded to whole blocks) that overlap the given byte range, if they
+ * are not cached yet. Blocks modified during this mount are always cached, so a block that is not cached has no image
+ * in the journal and can be read from its home address.
+ *
+ * @param start_address  the home address of the region (in number of blocks)
+ * @param region         the in-memory copy of the region
+ * @param loaded         the flags telling which blocks of the region are cached
+ * @param offset         the offset of the accessed bytes in the region
+ * @param length         the number of accessed bytes
+ */
+void load_region(int start_address, void *region, unsigned char *loaded, size_t offset, size_t length) {
+    for (size_t i = offset / BLOCK_SIZE; i <= (offset + length - 1) / BLOCK_SIZE; i++) {
+        if (!loaded[i]) {
+            striped_read_blocks(start_address + (int) i, 1, (char *) region + i * BLOCK_SIZE);
+            loaded[i] = 1;
+        }
+    }
+}
+
+/**
+ * Gets an inode, loading its inode table block on first access.
+ *
+ * @param index  the index of the inode
+ * @return       a pointer to the cached inode
+ */
+inode_t *get_inode(int index) {
+    load_region(INODE_TABLE_INDEX, &fs->inode_table, fs->inode_blocks_loaded, index * sizeof(inode_t), sizeof(inode_t));
+    return &fs->inode_table.inodes[index];
+}
+
+/**
+ * Saves the mount summary to the journal.
+ */
+void save_summary() {
+    block_t block;
+    memset(&block, 0, BLOCK_SIZE);
+    memcpy(&block, &fs->summary, sizeof(summary_t));
+    journal_write(SUMMARY_INDEX, &block);
+}
+
+/**
+ * Saves the FBM to the journal, along with the summary that counts its free blocks.
+ */
+void save_fbm() {
+    journal_write(FBM_INDEX, &fs->fbm);
+    save_summary();
+}
+
+/**
+ * Saves the WM to the journal.
+ */
+void save_wm() {
+    journal_write(WM_INDEX, &fs->wm);
+}
+
+/**
+ * Saves the reference counts to the journal.
+ */
+void save_refcounts() {
+    journal_write(REFCOUNT_INDEX, &fs->refcounts);
+}
+
+/**
+ * Saves an inode to the journal.
+ *
+ * @param index  the index of the inode
+ */
+void save_inode(int index) {
+    save_region(INODE_TABLE_INDEX, &fs->inode_table, index * sizeof(inode_t), sizeof(inode_t));
+}
+
+/**
+ * Removes a block from the deduplication index.
+ *
+ * @param block_num  the address of the block (in number of blocks)
+ */
+void dedup_remove(int block_num) {
+    if (!fs->dedup_index.indexed[block_num])
+        return;
+    int *link = &fs->dedup_index.heads[fs->dedup_index.hashes[block_num] % NUM_DEDUP_BUCKETS];
+    while (*link != block_num)
+        link = &fs->dedup_index.next[*link];
+    *link = fs->dedup_index.next[block_num];
+    fs->dedup_index.indexed[block_num] = 0;
+}
+
+/**
+ * Adds a block to the deduplication index, replacing its previous contents.
+ *
+ * @param block_num  the address of the block (in number of blocks)
+ * @param hash       the checksum of the block's contents
+ */
+void dedup_insert(int block_num, unsigned long hash) {
+    dedup_remove(block_num);
+    int *head = &fs->dedup_index.heads[hash % NUM_DEDUP_BUCKETS];
+    fs->dedup_index.next[block_num] = *head;
+    fs->dedup_index.hashes[block_num] = hash;
+    fs->dedup_index.indexed[block_num] = 1;
+    *head = block_num;
+}
+
+/**
+ * Finds a block on the disk with the given contents, which can take another reference.
+ *
+ * @param block  the contents to look for
+ * @param hash   the checksum of the contents
+ * @return       the address of the block, or -1 if there is none
+ */
+int dedup_find(block_t *block, unsigned long hash) {
+    load_bitmaps();
+    for (int b = fs->dedup_index.heads[hash % NUM_DEDUP_BUCKETS]; b >= 0; b = fs->dedup_index.next[b]) {
+        if (fs->dedup_index.hashes[b] != hash || fs->refcounts.bytes[b] >= MAX_EXTRA_REFS)
+            continue;
+        block_t *contents = read_single_block(b); // Rule out checksum collisions
+        if (contents == NULL)
+            return -1; // No memory to compare the contents: the block is written rather than shared
+        int same = memcmp(contents, block, BLOCK_SIZE) == 0;
+        put_block_buffer(contents);
+        if (same)
+            return b;
+    }
+    return -1;
+}
+
+/**
+ * Empties the deduplication index.
+ */
+void reset_dedup_index() {
+    for (int i = 0; i < NUM_DEDUP_BUCKETS; i++)
+        fs->dedup_index.heads[i] = -1;
+    memset(fs->dedup_index.indexed, 0, sizeof(fs->dedup_index.indexed));
+}
+
+/**
+ * Gets the first block of the allocation group of a file. The data area is split into NUM_GROUPS groups of
+ * consecutive blocks, each with its slice of the FBM, and the inodes are dealt out to the groups in turn. The blocks
+ * of a file (and the buckets of a directory) are allocated in its group first, so that files written at the same
+ * time do not interleave their blocks, and a file is laid out near its own earlier blocks.
+ *
+ * @param index  the index of the inode of the file
+ * @return       the address of the first block of the file's group
+ */
+int home_block(int index) {
+    return FIRST_DATA_INDEX + (index % NUM_GROUPS) * GROUP_BLOCKS;
+}
+
+/**
+ * Finds a free data block in the disk emulator, at or after the given address if possible.
+ *
+ * @param hint  the preferred address of the block (for instance, the first block of a file's allocation group)
+ * @return      the address on the free block (in number of blocks)
+ */
+int get_free_block(int hint) {
+    load_bitmaps();
+    for (int k = 0; k < BLOCK_SIZE; k++) {
+        int i = (hint + k) % BLOCK_SIZE; // Wraps around to the start of the disk
+        if (fs->fbm.bytes[i] != 0) {  // Only need to use the LSB here
+            fs->fbm.bytes[i] = 0;
+            fs->summary.num_free_blocks--;
+            save_fbm();
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Releases a block in the FBM.
+ *
+ * @param block_num  the address of the block (in number of blocks)
+ */
+void free_block(int block_num) {
+    load_bitmaps();
+    if (fs->fbm.bytes[block_num] == 0)
+        fs->summary.num_free_blocks++;
+    fs->fbm.bytes[block_num] = 1;
+    dedup_remove(block_num);
+    journal_revoke(block_num);
+}
+
+/**
+ * Drops a reference to a data block, which is freed with its last reference. The reference counts are saved, but not
+ * the FBM.
+ *
+ * @param block_num  the address of the block (in number of blocks)
+ * @return           1 if the block was freed, 0 if it still has references
+ */
+int release_block(int block_num) {
+    load_bitmaps();
+    if (fs->refcounts.bytes[block_num] == 0) {
+        free_block(block_num);
+        return 1;
+    }
+    fs->refcounts.bytes[block_num]--;
+    save_refcounts();
+    return 0;
+}
+
+/**
+ * Finds the first run of free blocks of the given length at or after the given address, or else from the start of the
+ * data area.
+ *
+ * @param length  the number of blocks in the run
+ * @param hint    the address to start looking from
+ * @return        the address of the first block of the run, or -1 if there is none
+ */
+int find_free_run(int length, int hint) {
+    load_bitmaps();
+    for (int start = hint > FIRST_DATA_INDEX ? hint : FIRST_DATA_INDEX;; start = FIRST_DATA_INDEX) {
+        int run = 0;
+        for (int i = start; i < FBM_INDEX; i++) {
+            run = fs->fbm.bytes[i] != 0 ? run + 1 : 0;
+            if (run == length)
+                return i - length + 1;
+        }
+        if (start == FIRST_DATA_INDEX)
+            return -1;
+    }
+}
+
+/**
+ * Allocates a run of consecutive free blocks, preferably at the given address. The FBM is not saved.
+ *
+ * @param length  the number of blocks in the run
+ * @param hint    the preferred address of the run (for instance, right after the last block of a file), or the
+ *                address to look for a run from
+ * @return        the address of the first block of the run, or -1 if there is no such run
+ */
+int allocate_run(int length, int hint) {
+    load_bitmaps();
+    int start = hint;
+    for (int i = hint; start >= 0 && i < hint + length; i++) {
+        if (i < FIRST_DATA_INDEX || i >= FBM_INDEX || fs->fbm.bytes[i] == 0)
+            start = -1; // The run does not fit at the hint
+    }
+    if (start < 0)
+        start = find_free_run(length, hint);
+    for (int i = 0; start >= 0 && i < length; i++)
+        fs->fbm.bytes[start + i] = 0;
+    if (start >= 0)
+        fs->summary.num_free_blocks -= length;
+    return start;
+}
+
+/**
+ * Gets the first block of a segment. In log-structured mode, the data area is split into segments of SEGMENT_BLOCKS
+ * consecutive blocks (the last one shorter), which the log fills one after the other and the cleaner empties.
+ *
+ * @param segment  the index of the segment
+ * @return         the address of the first block of the segment
+ */
+int segment_start(int segment) {
+    return FIRST_DATA_INDEX + segment * SEGMENT_BLOCKS;
+}
+
+/**
+ * Counts the blocks in use in a segment.
+ *
+ * @param segment  the index of the segment
+ * @return         the number of blocks of the segment that are not free
+ */
+int count_segment_blocks(int segment) {
+    load_bitmaps();
+    int count = 0;
+    for (int i = segment_start(segment); i < segment_start(segment + 1) && i < FBM_INDEX; i++)
+        count += fs->fbm.bytes[i] == 0;
+    return count;
+}
+
+/**
+ * Counts the segments the log can fill without cleaning.
+ *
+ * @return  the number of segments with no block in use
+ */
+int count_free_segments() {
+    int count = 0;
+    for (int s = 0; s < NUM_SEGMENTS; s++)
+        count += count_segment_blocks(s) == 0;
+    return count;
+}
+
+/**
+ * Gets the head of the log, where the data blocks are appended in log-structured mode. Once the head reaches the end
+ * of the data area (or at the first write after mounting), the log moves on to the emptiest segment.
+ *
+ * @return  the address to append the next blocks at
+ */
+int log_head() {
+    if (fs->log_head < FIRST_DATA_INDEX || fs->log_head >= FBM_INDEX) {
+        int emptiest = 0;
+        for (int s = 1; s < NUM_SEGMENTS; s++) {
+            if (count_segment_blocks(s) < count_segment_blocks(emptiest))
+                emptiest = s;
+        }
+        fs->log_head = segment_start(emptiest);
+    }
+    return fs->log_head;
+}
+
+/**
+ * Counts the free blocks by scanning the FBM.
+ *
+ * @return  the number of free blocks
+ */
+int scan_free_blocks() {
+    load_bitmaps();
+    int count = 0;
+    for (int i = 0; i < BLOCK_SIZE; i++)
+        count += fs->fbm.bytes[i] != 0;
+    return count;
+}
+
+/**
+ * Counts the free blocks, from the count kept in the summary. Neither the FBM nor any other block is read.
+ *
+ * @return  the number of free blocks
+ */
+int count_free_blocks() {
+    return fs->summary.num_free_blocks;
+}
+
+/**
+ * Looks a name up in a directory, following the name's probe sequence until an entry that was never used. Only the
+ * buckets on the probe sequence are read, and holes are not read at all.
+ *
+ * @param dir   the index of the directory inode
+ * @param name  the name to look up
+ * @param slot  set to the slot of the entry (bucket * NUM_ENTRIES_PER_BUCKET + entry) if found, and otherwise to the
+ *              first free slot of the probe sequence, or -1 if the directory is full
+ * @return      the index of the inode of the entry, -1 if it does not exist, or -2 if there is no memory to read the
+ *              directory
+ */
+int directory_probe(int dir, char *name, int *slot) {
+    inode_t *inode = get_inode(dir);
+    int first = (int) (checksum(name, strlen(name)) % NUM_DIRECTORY_BUCKETS); // Bucket the name hashes to
+    *slot = -1;
+    for (int k = 0; k < NUM_DIRECTORY_BUCKETS; k++) {
+        int b = (first + k) % NUM_DIRECTORY_BUCKETS;
+        if (inode->direct[b] < 0) { // A hole was never used
+            if (*slot < 0)
+                *slot = b * NUM_ENTRIES_PER_BUCKET;
+            return -1;
+        }
+        directory_bucket_t *bucket = (directory_bucket_t *) read_metadata_block(inode->direct[b]);
+        if (bucket == NULL)
+            return -2; // Error: no memory for the bucket
+        for (int e = 0; e < NUM_ENTRIES_PER_BUCKET; e++) {
+            directory_entry_t *entry = &bucket->entries[e];
+            if (entry->inode > 0 && strncmp(entry->filename, name, MAX_FILENAME_LENGTH) == 0) {
+                int found = entry->inode;
+                *slot = b * NUM_ENTRIES_PER_BUCKET + e;
+                put_block_buffer(bucket);
+                return found;
+            }
+            if (entry->inode <= 0 && *slot < 0)
+                *slot = b * NUM_ENTRIES_PER_BUCKET + e;
+            if (entry->inode == 0) { // The end of the probe sequence
+                put_block_buffer(bucket);
+                return -1;
+            }
+        }
+        put_block_buffer(bucket);
+    }
+    return -1;
+}
+
+/**
+ * Gets the lookup cache entry that a name in a directory maps to.
+ *
+ * @param dir   the index of the directory inode
+ * @param name  the name
+ * @return      the cache entry (which may hold another name)
+ */
+dentry_t *get_dentry(int dir, char *name) {
+    return &fs->dentries[(checksum(name, strlen(name)) + (unsigned long) dir * 31) % NUM_DENTRIES];
+}
+
+/**
+ * Caches the result of a lookup, replacing whatever name the cache entry held.
+ *
+ * @param dir    the index of the directory inode
+ * @param name   the name
+ * @param inode  the index of the inode of the name, or -1 if it does not exist
+ * @param slot   the slot of the name, or the free slot for it
+ */
+void cache_dentry(int dir, char *name, int inode, int slot) {
+    dentry_t *dentry = get_dentry(dir, name);
+    dentry->dir = dir;
+    dentry->inode = inode;
+    dentry->slot = slot;
+    strncpy(dentry->name, name, MAX_FILENAME_LENGTH - 1);
+    dentry->name[MAX_FILENAME_LENGTH - 1] = '\0';
+}
+
+/**
+ * Drops cached lookups of a directory.
+ *
+ * @param dir            the index of the directory inode, or -1 for every directory
+ * @param negative_only  whether to only drop the names that do not exist
+ */
+void invalidate_dentries(int dir, int negative_only) {
+    for (int i = 0; i < NUM_DENTRIES; i++) {
+        if ((dir < 0 || fs->dentries[i].dir == dir) && (!negative_only || fs->dentries[i].inode < 0))
+            fs->dentries[i].dir = -1;
+    }
+}
+
+/**
+ * Looks a name up in a directory, through the lookup cache. A hit does not read the directory at all.
+ *
+ * @param dir   the index of the directory inode
+ * @param name  the name to look up
+ * @param slot  set as by directory_probe
+ * @return      as directory_probe
+ */
+int lookup_name(int dir, char *name, int *slot) {
+    dentry_t *dentry = get_dentry(dir, name);
+    if (dentry->dir == dir && strncmp(dentry->name, name, MAX_FILENAME_LENGTH) == 0) {
+        *slot = dentry->slot;
+        return dentry->inode; // Hit, positive or negative
+    }
+    int inode = directory_probe(dir, name, slot);
+    if (inode >= -1)
+        cache_dentry(dir, name, inode, *slot);
+    return inode;
+}
+
+/**
+ * Sets an entry of a directory, allocating its bucket if the bucket is a hole. The caller must make sure that a free
+ * block is available in that case. The lookup cache is kept up to date: other names cached as missing may have been
+ * waiting for the slot taken by a new entry, so they are dropped.
+ *
+ * @param dir    the index of the directory inode
+ * @param slot   the slot of the entry (from directory_probe)
+ * @param name   the name of the entry, or NULL to remove the entry
+ * @param index  the index of the inode of the entry
+ * @return       0 on success, or -1 if the bucket is a hole and there is no free block for it, or if there is no
+ *               memory for the bucket (nothing is changed then)
+ */
+int set_directory_entry(int dir, int slot, char *name, int index) {
+    inode_t *inode = get_inode(dir);
+    int b = slot / NUM_ENTRIES_PER_BUCKET;
+    directory_bucket_t *bucket = inode->direct[b] < 0 ? get_block_buffer(1) : read_metadata_block(inode->direct[b]);
+    if (bucket == NULL)
+        return -1; // Error: no memory for the bucket
+    if (inode->direct[b] < 0) {
+        int block_num = get_free_block(home_block(dir));
+        if (block_num < 0) {
+            put_block_buffer(bucket);
+            return -1; // Error: no free block for the bucket
+        }
+        inode->direct[b] = block_num;
+        save_inode(dir);
+    }
+    directory_entry_t *entry = &bucket->entries[slot % NUM_ENTRIES_PER_BUCKET];
+    if (name != NULL) {
+        invalidate_dentries(dir, 1);
+        cache_dentry(dir, name, index, slot);
+    } else if (entry->inode > 0) {
+        entry->filename[MAX_FILENAME_LENGTH - 1] = '\0';
+        cache_dentry(dir, entry->filename, -1, slot); // The name can be created again in its own slot
+    }
+    memset(entry, 0, sizeof(directory_entry_t));
+    if (name != NULL) {
+        entry->inode = index;
+        strncpy(entry->filename, name, MAX_FILENAME_LENGTH - 1);
+    } else {
+        entry->inode = -1; // Removed, so that lookups keep probing past it
+    }
+    journal_write(inode->direct[b], bucket);
+    put_block_buffer(bucket);
+    return 0;
+}
+
+/**
+ * Splits a path into its parent directory and its last component, walking the directories of the path from the root.
+ * Components are separated by '/', and empty components are ignored. The directory found is cached, so that the next
+ * path in the same directory does not walk it again.
+ *
+ * @param path  the path
+ * @param name  set to the last component of the path (room for MAX_FILENAME_LENGTH characters)
+ * @return      the index of the parent directory inode, or -1 if the path is invalid or a directory on it is missing
+ */
+int resolve_parent(char *path, char *name) {
+    int end = (int) strlen(path);
+    while (end > 0 && path[end - 1] == '/')
+        end--; // Trailing slashes
+    int start = end;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+    if (end - start < 1 || end - start > MAX_FILENAME_LENGTH - 1)
+        return -1; // Error: invalid name
+    memcpy(name, path + start, end - start);
+    name[end - start] = '\0';
+    if (fs->path_cache.inode >= 0 && (int) strlen(fs->path_cache.path) == start &&
+        strncmp(fs->path_cache.path, path, start) == 0)
+        return fs->path_cache.inode; // Same directory as the last path
+
+    int dir = ROOT_INODE;
+    char component[MAX_FILENAME_LENGTH];
+    for (int i = 0; i < start;) {
+        if (path[i] == '/') {
+            i++;
+            continue;
+        }
+        int length = 0;
+        while (i + length < start && path[i + length] != '/')
+            length++;
+        if (length > MAX_FILENAME_LENGTH - 1)
+            return -1; // Error: invalid directory name
+        memcpy(component, path + i, length);
+        component[length] = '\0';
+        int slot;
+        dir = lookup_name(dir, component, &slot);
+        if (dir < 0 || get_inode(dir)->indirect != DIRECTORY)
+            return -1; // Error: missing directory, or a file in the middle of the path
+        i += length;
+    }
+    if (start < MAX_PATH_LENGTH) {
+        memcpy(fs->path_cache.path, path, start);
+        fs->path_cache.path[start] = '\0';
+        fs->path_cache.inode = dir;
+    }
+    return dir;
+}
+
+/**
+ * Finds a file or directory.
+ *
+ * @param path  the path of the file
+ * @return      the index of the file, or -1 if it does not exist
+ */
+int find_file(char *path) {
+    char name[MAX_FILENAME_LENGTH];
+    int slot;
+    int dir = resolve_parent(path, name);
+    return dir < 0 ? -1 : lookup_name(dir, name, &slot);
+}
+
+/**
+ * Finds an unused inode. While no inode below the high water mark is free, no inode needs to be read.
+ *
+ * @return  the index of the inode, or -1 if every inode is used
+ */
+int find_free_inode() {
+    if (fs->summary.num_files + 1 == fs->summary.inode_high_water) // Every inode below the high water mark is used
+        return fs->summary.inode_high_water < NUM_FILES ? fs->summary.inode_high_water : -1;
+    for (int i = ROOT_INODE + 1; i < NUM_FILES; i++) {
+        if (get_inode(i)->size < 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Creates a file or directory: a new inode is linked into the parent directory. This is a single metadata operation.
+ *
+ * @param dir        the index of the parent directory inode
+ * @param name       the name of the new entry
+ * @param slot       the free slot of the parent directory (from directory_probe)
+ * @param directory  whether to create a directory
+ * @return           the index of the new inode, or -1 if there is no free inode, slot, block or memory
+ */
+int create_file(int dir, char *name, int slot, int directory) {
+    int index = find_free_inode();
+    if (index < 0 || slot < 0 ||
+        (get_inode(dir)->direct[slot / NUM_ENTRIES_PER_BUCKET] < 0 && count_free_blocks() - fs->reserved_blocks < 1))
+        return -1; // Error: no space for a new file
+    journal_begin();
+    if (set_directory_entry(dir, slot, name, index) < 0) {
+        journal_end();
+        return -1; // Error: no free block or no memory for the directory bucket
+    }
+    inode_t *inode = get_inode(index);
+    inode->size = directory ? NUM_DIRECTORY_BUCKETS * BLOCK_SIZE : 0; // The buckets of a directory start as holes
+    inode->compressed = 0;
+    inode->indirect = directory ? DIRECTORY : -1;
+    save_inode(index);
+    fs->prealloc_ends[index] = 0;
+    fs->summary.num_files++;
+    if (index >= fs->summary.inode_high_water)
+        fs->summary.inode_high_water = index + 1;
+    save_summary();
+    journal_end();
+    return index;
+}
+
+/**
+ * Releases an inode, whose blocks must already be freed, and updates the mount summary. This must be called within a
+ * metadata operation.
+ *
+ * @param index  the index of the inode
+ */
+void release_inode(int index) {
+    inode_t *inode = get_inode(index);
+    inode->size = -1;
+    inode->compressed = 0;
+    inode->indirect = -1;
+    for (int j = 0; j < NUM_DIRECT_POINTERS; j++)
+        inode->direct[j] = -1;
+    save_inode(index);
+    invalidate_dentries(index, 0); // The inode may come back as another directory
+    fs->summary.num_files--;
+    while (fs->summary.inode_high_water > ROOT_INODE + 1 && get_inode(fs->summary.inode_high_water - 1)->size < 0)
+        fs->summary.inode_high_water--; // Lower the high water mark past trailing free inodes
+    save_summary();
+}
+
+
+/**
+ * Loads the cache of a file's indirect block, unless it is loaded already or only direct pointers are needed. A file
+ * without an indirect block gets an empty one, which set_block_address allocates on the disk once a pointer is set.
+ * The cache is loaded before any change, so that running out of memory never leaves an operation half done.
+ *
+ * @param inode     the inode of the file
+ * @param last      the index of the last block of the file that the caller needs
+ * @param indirect  cache of the file's indirect block (initially NULL, to be freed by the user)
+ * @return          0 on success, or -1 if there is no memory for the cache
+ */
+int load_indirect(inode_t *inode, int last, indirect_block_t **indirect) {
+    if (last < NUM_DIRECT_POINTERS || *indirect != NULL)
+        return 0; // Nothing to load
+    if (inode->indirect >= 0) {
+        *indirect = (indirect_block_t *) read_metadata_block(inode->indirect);
+    } else {
+        *indirect = get_block_buffer(0);
+        for (int j = 0; *indirect != NULL && j < NUM_INDIRECT_POINTERS_PER_BLOCK; j++)
+            (*indirect)->inode_indices[j] = -1;
+    }
+    return *indirect != NULL ? 0 : -1;
+}
+
+/**
+ * Gets the address of a block of a file.
+ *
+ * @param inode     the inode of the file
+ * @param i         the index of the block in the file
+ * @param indirect  cache of the file's indirect block, loaded with load_indirect if i is past the direct pointers
+ * @return          the address of the block, or -1 if it has none
+ */
+int get_block_address(inode_t *inode, int i, indirect_block_t **indirect) {
+    if (inode->indirect == INLINE_DATA)
+        return -1; // Stored in the inode
+    if (i < NUM_DIRECT_POINTERS)
+        return inode->direct[i];
+    if (inode->indirect < 0)
+        return -1;
+    return (*indirect)->inode_indices[i - NUM_DIRECT_POINTERS];
+}
+
+/**
+ * Checks whether a file has any data block (or preallocated block) on the disk.
+ *
+ * @param inode  the inode of the file
+ * @return       1 if the file has a block, 0 otherwise
+ */
+int has_blocks(inode_t *inode) {
+    if (inode->indirect != -1)
+        return inode->indirect != INLINE_DATA;
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) {
+        if (inode->direct[i] != -1)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Clears the inline data of a file stored in its inode, leaving a file without blocks. The caller must keep the data.
+ *
+ * @param inode  the inode of the file
+ */
+void clear_inline_data(inode_t *inode) {
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++)
+        inode->direct[i] = -1;
+    inode->indirect = -1;
+}
+
+/**
+ * Gets the size of a file, including the data still in its write buffer.
+ *
+ * @param index  the index of the file
+ * @return       the size of the file in bytes
+ */
+int get_file_size(int index) {
+    if (fs->write_buffers[index] != NULL)
+        return fs->write_buffers[index]->size;
+    return get_inode(index)->size;
+}
+
+/**
+ * Points a block of a file to an address, allocating the single indirect block if needed (except to clear a pointer).
+ * Neither the inode nor the indirect block is saved.
+ *
+ * @param inode             the inode of the file
+ * @param i                 the index of the block in the file
+ * @param address           the new address of the block
+ * @param indirect          cache of the file's indirect block, loaded with load_indirect if i is past the direct
+ *                          pointers
+ * @param indirect_changed  set to 1 if the indirect block changed
+ */
+void set_block_address(inode_t *inode, int i, int address, indirect_block_t **indirect, int *indirect_changed) {
+    if (i < NUM_DIRECT_POINTERS) {
+        inode->direct[i] = address;
+        return;
+    }
+    if (inode->indirect < 0) {
+        if (address == -1)
+            return; // Already a hole
+        inode->indirect = get_free_block(address >= 0 ? address : 0); // Near the data it points to (the cache is empty)
+    }
+    (*indirect)->inode_indices[i - NUM_DIRECT_POINTERS] = address;
+    *indirect_changed = 1;
+}
+
+/**
+ * Reads the data of a cluster of a compressed file. A compressed cluster is decompressed, and the blocks of a cluster
+ * stored as is are read directly. Holes, and corrupted compressed data, read as zeros.
+ *
+ * @param inode     the inode of the file
+ * @param c         the index of the cluster in the file
+ * @param blocks    the array to fill, with room for CLUSTER_BLOCKS blocks
+ * @param indirect  cache of the file's indirect block (initially NULL, to be freed by the user)
+ * @return          1 if a block of the cluster fails its checksum (the cluster then reads as zeros), 0 otherwise, or
+ *                  -1 if there is no memory for the indirect block (nothing is read then)
+ */
+int read_cluster(inode_t *inode, int c, block_t *blocks, indirect_block_t **indirect) {
+    if (load_indirect(inode, c * CLUSTER_BLOCKS + CLUSTER_BLOCKS - 1, indirect) < 0)
+        return -1; // Error: no memory for the indirect block
+    int addresses[CLUSTER_BLOCKS];
+    int length = 0; // Length of the compressed data, or 0 if the cluster is stored as is
+    int num_stored = 0; // Number of blocks up to the last one on the disk
+    for (int j = 0; j < CLUSTER_BLOCKS; j++) {
+        int i = c * CLUSTER_BLOCKS + j;
+        addresses[j] = i < MAX_FILE_BLOCKS ? get_block_address(inode, i, indirect) : -1;
+        if (addresses[j] <= COMPRESSED)
+            length = COMPRESSED - addresses[j];
+        else if (addresses[j] >= 0)
+            num_stored = j + 1;
+    }
+    memset(blocks, 0, CLUSTER_BLOCKS * BLOCK_SIZE);
+    block_t compressed[CLUSTER_BLOCKS]; // Compressed data, when the cluster is compressed
+    block_t *stored = blocks;
+    if (length > 0) {
+        memset(compressed, 0, sizeof(compressed));
+        stored = compressed;
+    }
+    int corrupted = 0;
+    for (int j = 0; j < num_stored;) {
+        if (addresses[j] < 0) { // Hole
+            j++;
+            continue;
+        }
+        int run = 1; // Number of blocks with consecutive addresses
+        while (j + run < num_stored && addresses[j + run] == addresses[j] + run)
+            run++;
+        if (read_data_blocks(addresses[j], run, &stored[j]) < run) {
+            corrupted = 1;
+            break;
+        }
+        j += run;
+    }
+    if (length > 0) {
+        if (corrupted || length > num_stored * BLOCK_SIZE ||
+            lz_decompress(stored, length, blocks, CLUSTER_BLOCKS * BLOCK_SIZE) < 0)
+            memset(blocks, 0, CLUSTER_BLOCKS * BLOCK_SIZE);
+    } else if (corrupted) {
+        memset(blocks, 0, CLUSTER_BLOCKS * BLOCK_SIZE);
+    }
+    return corrupted;
+}
+
+/**
+ * Writes the data of a cluster of a compressed file into new blocks, then frees the blocks it had, so that a crash
+ * never leaves the cluster half overwritten. The data is stored compressed if that saves at least one block: the
+ * first blocks of the cluster then hold the compressed data, and the pointers of the others hold COMPRESSED minus the
+ * length of the compressed data. Otherwise, the blocks are stored as is. The FBM is not saved.
+ *
+ * @param inode             the inode of the file
+ * @param c                 the index of the cluster in the file
+ * @param blocks            the data of the cluster
+ * @param num_blocks        the number of blocks of the cluster within the file
+ * @param hint              the preferred address of the new blocks
+ * @param indirect          cache of the file's indirect block, loaded with load_indirect
+ * @param indirect_changed  set to 1 if the indirect block changed
+ * @return                  the address right after the new blocks, to lay out the next cluster
+ */
+int write_cluster(inode_t *inode, int c, block_t *blocks, int num_blocks, int hint, indirect_block_t **indirect,
+                  int *indirect_changed) {
+    int old[CLUSTER_BLOCKS];
+    for (int j = 0; j < CLUSTER_BLOCKS; j++) {
+        int i = c * CLUSTER_BLOCKS + j;
+        old[j] = i < MAX_FILE_BLOCKS ? get_block_address(inode, i, indirect) : -1;
+    }
+    block_t compressed[CLUSTER_BLOCKS];
+    memset(compressed, 0, sizeof(compressed)); // The end of the last block is written as zeros
+    int length = lz_compress(blocks, num_blocks * BLOCK_SIZE, compressed, (num_blocks - 1) * BLOCK_SIZE);
+    int num_stored = length > 0 ? (length + BLOCK_SIZE - 1) / BLOCK_SIZE : num_blocks;
+    block_t *stored = length > 0 ? compressed : blocks;
+    int run = allocate_run(num_stored, hint);
+    if (run >= 0)
+        write_data_blocks(run, num_stored, stored);
+    int next = hint;
+    for (int j = 0; j < CLUSTER_BLOCKS && c * CLUSTER_BLOCKS + j < MAX_FILE_BLOCKS; j++) {
+        int address = -1;
+        if (j < num_stored) {
+            address = run >= 0 ? run + j : get_free_block(hint); // Reserved, so there is always a free block
+            if (run < 0)
+                write_data_blocks(address, 1, &stored[j]);
+            next = address + 1;
+        } else if (j < num_blocks) {
+            address = COMPRESSED - length;
+        }
+        set_block_address(inode, c * CLUSTER_BLOCKS + j, address, indirect, indirect_changed);
+    }
+    for (int j = 0; j < CLUSTER_BLOCKS; j++) {
+        if (old[j] >= 0)
+            free_block(old[j]);
+    }
+    return next;
+}
+
+/**
+ * Flushes the write buffer of a compressed file, within the metadata operation started by flush_file. Each cluster
+ * with buffered blocks is read back, merged with them, and written again as a whole, right after the previous one.
+ *
+ * @param index     the index of the file
+ * @param order     the buffered blocks, sorted by index in the file
+ * @param indirect  cache of the file's indirect block, loaded with load_indirect (freed here)
+ */
+void flush_clusters(int index, int *order, indirect_block_t *indirect) {
+    write_buffer_t *buffer = fs->write_buffers[index];
+    inode_t *inode = get_inode(index);
+    int indirect_changed = 0;
+    int num_file_blocks = (buffer->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int hint = 0;
+    for (int i = buffer->block_indices[order[0]] / CLUSTER_BLOCKS * CLUSTER_BLOCKS - 1; i >= 0 && hint == 0; i--) {
+        int address = get_block_address(inode, i, &indirect);
+        if (address >= 0)
+            hint = address + 1; // Right after the clusters before
+    }
+    if (hint == 0)
+        hint = home_block(index); // First cluster on the disk
+    if (fs->super.log_structured)
+        hint = log_head();
+    block_t cluster[CLUSTER_BLOCKS];
+    for (int i = 0; i < buffer->num_blocks;) {
+        int c = buffer->block_indices[order[i]] / CLUSTER_BLOCKS;
+        read_cluster(inode, c, cluster, &indirect);
+        for (; i < buffer->num_blocks && buffer->block_indices[order[i]] / CLUSTER_BLOCKS == c; i++)
+            cluster[buffer->block_indices[order[i]] % CLUSTER_BLOCKS] = buffer->blocks[order[i]];
+        int num_blocks = num_file_blocks - c * CLUSTER_BLOCKS;
+        hint = write_cluster(inode, c, cluster, num_blocks < CLUSTER_BLOCKS ? num_blocks : CLUSTER_BLOCKS, hint,
+                             &indirect, &indirect_changed);
+    }
+    if (fs->super.log_structured)
+        fs->log_head = hint;
+    if (indirect_changed)
+        journal_write(inode->indirect, indirect);
+    if (indirect != NULL)
+        put_block_buffer(indirect);
+    save_fbm();
+    inode->size = buffer->size;
+    save_inode(index);
+    journal_end();
+    fs->reserved_blocks -= buffer->reserved;
+    put_write_buffer(buffer);
+    fs->write_buffers[index] = NULL;
+}
+
+/**
+ * Flushes the write buffer of a file. All the blocks that the buffered data needs are allocated at once, as a single
+ * run right after the file's last block if possible, then the buffered blocks are written with one write per run of
+ * consecutive addresses. The inode, indirect block and FBM are each saved once. A tiny file without blocks is instead
+ * stored in its inode, with no data block I/O and no FBM update, and a compressed file is written by clusters.
+ *
+ * @param index  the index of the file
+ * @return       0 on success, or -1 if there is no memory for the file's indirect block (the buffer is kept then)
+ */
+int flush_file(int index) {
+    write_buffer_t *buffer = fs->write_buffers[index];
+    if (buffer == NULL)
+        return 0;
+    if (buffer->num_blocks == 0) {
+        put_write_buffer(buffer);
+        fs->write_buffers[index] = NULL;
+        return 0;
+    }
+    inode_t *inode = get_inode(index);
+    int inline_data = buffer->size <= MAX_INLINE_SIZE && !has_blocks(inode); // Only block 0 can be buffered
+    indirect_block_t *indirect = NULL;
+    if (!inline_data && load_indirect(inode, MAX_FILE_BLOCKS - 1, &indirect) < 0)
+        return -1; // Error: no memory for the indirect block
+    fs->read_aheads[index].num_blocks = 0; // The cache may hold the contents the buffered blocks replace
+    journal_begin();
+    if (inline_data) {
+        clear_inline_data(inode);
+        memcpy(inode->data, buffer->blocks[0].bytes, buffer->size);
+        inode->indirect = INLINE_DATA;
+        inode->size = buffer->size;
+        save_inode(index);
+        journal_end();
+        fs->reserved_blocks -= buffer->reserved;
+        put_write_buffer(buffer);
+        fs->write_buffers[index] = NULL;
+        return 0;
+    }
+    if (inode->indirect == INLINE_DATA)
+        clear_inline_data(inode); // The file outgrew its inode: its data is in the buffered block 0
+    int indirect_changed = 0;
+    int order[NUM_WRITE_BUFFER_BLOCKS]; // Buffered blocks sorted by index in the file
+    int addresses[NUM_WRITE_BUFFER_BLOCKS];
+    int num_new = 0; // Number of buffered blocks without an address
+    int num_released = 0; // Number of blocks freed when their buffered data is shared or copied
+    int last = -1; // Last address of the file, to extend it contiguously
+    for (int i = 0; i < buffer->num_blocks; i++) {
+        int j = i;
+        for (; j > 0 && buffer->block_indices[order[j - 1]] > buffer->block_indices[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    if (inode->compressed) {
+        flush_clusters(index, order, indirect);
+        return 0;
+    }
+    for (int i = 0; i < buffer->num_blocks; i++) {
+        int block_index = buffer->block_indices[order[i]];
+        if (block_index >= NUM_DIRECT_POINTERS && inode->indirect < 0) { // Uninitialized single indirect block
+            inode->indirect = get_free_block(fs->super.log_structured ? log_head() : home_block(index)); // Empty cache
+            indirect_changed = 1;
+        }
+        addresses[i] = get_block_address(inode, block_index, &indirect);
+    }
+    block_t staging[NUM_WRITE_BUFFER_BLOCKS]; // Buffered blocks in file order
+    unsigned long hashes[NUM_WRITE_BUFFER_BLOCKS]; // Checksum of each buffered block
+    int duplicates[NUM_WRITE_BUFFER_BLOCKS]; // Earlier buffered block with the same contents, or -1
+    int written[NUM_WRITE_BUFFER_BLOCKS]; // Whether each buffered block is written, rather than shared or unchanged
+    load_bitmaps();
+    for (int i = 0; i < buffer->num_blocks; i++) {
+        staging[i] = buffer->blocks[order[i]];
+        hashes[i] = checksum(&staging[i], BLOCK_SIZE);
+        duplicates[i] = -1;
+        written[i] = 0;
+        int shared = dedup_find(&staging[i], hashes[i]);
+        for (int j = 0; j < i && shared < 0 && duplicates[i] < 0; j++) {
+            int same = hashes[j] == hashes[i] && memcmp(&staging[j], &staging[i], BLOCK_SIZE) == 0;
+            if (written[j] && addresses[j] < 0 && same)
+                duplicates[i] = j; // Shares the new block of an identical buffered block
+        }
+        if (addresses[i] >= 0 && (shared >= 0 || duplicates[i] >= 0 || fs->refcounts.bytes[addresses[i]] > 0 ||
+                                  fs->super.log_structured)) {
+            num_released += release_block(addresses[i]); // Shares another block, or is copied on write or to the log
+            addresses[i] = -1;
+        }
+        if (shared >= 0) {
+            addresses[i] = shared;
+            fs->refcounts.bytes[shared]++;
+            save_refcounts();
+            set_block_address(inode, buffer->block_indices[order[i]], shared, &indirect, &indirect_changed);
+        } else if (duplicates[i] < 0) {
+            written[i] = 1;
+            if (addresses[i] >= 0)
+                dedup_remove(addresses[i]); // Overwritten in place
+            else
+                num_new++;
+        }
+    }
+    int num_file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int i = num_file_blocks - 1; i >= 0 && last < 0; i--)
+        last = get_block_address(inode, i, &indirect); // Skip trailing holes
+    int hint = last >= 0 ? last + 1 : home_block(index); // Where the file's blocks are, or its allocation group
+    if (fs->super.log_structured)
+        hint = log_head();
+    int run = num_new > 0 ? allocate_run(num_new, hint) : -1;
+    for (int i = 0; i < buffer->num_blocks; i++) {
+        if (!written[i] || addresses[i] >= 0)
+            continue;
+        addresses[i] = run >= 0 ? run++ : get_free_block(hint); // Reserved, so there is always a free block
+        set_block_address(inode, buffer->block_indices[order[i]], addresses[i], &indirect, &indirect_changed);
+        if (fs->super.log_structured)
+            fs->log_head = addresses[i] + 1;
+    }
+    for (int i = 0; i < buffer->num_blocks; i++) {
+        if (duplicates[i] < 0)
+            continue;
+        addresses[i] = addresses[duplicates[i]];
+        fs->refcounts.bytes[addresses[i]]++;
+        save_refcounts();
+        set_block_address(inode, buffer->block_indices[order[i]], addresses[i], &indirect, &indirect_changed);
+    }
+    for (int i = 0; i < buffer->num_blocks;) {
+        if (!written[i]) {
+            i++;
+            continue;
+        }
+        int length = 1; // Number of written blocks with consecutive addresses
+        while (i + length < buffer->num_blocks && written[i + length] && addresses[i + length] == addresses[i] + length)
+            length++;
+        write_data_blocks(addresses[i], length, &staging[i]);
+        for (int j = i; j < i + length; j++)
+            dedup_insert(addresses[j], hashes[j]);
+        i += length;
+    }
+    if (indirect_changed)
+        journal_write(inode->indirect, indirect);
+    if (indirect != NULL)
+        put_block_buffer(indirect);
+    if (num_new > 0 || num_released > 0)
+        save_fbm();
+    inode->size = buffer->size;
+    save_inode(index);
+    journal_end();
+    fs->reserved_blocks -= buffer->reserved;
+    put_write_buffer(buffer);
+    fs->write_buffers[index] = NULL;
+    return 0;
+}
+
+/**
+ * Flushes the write buffers of every file.
+ *
+ * @return  0 on success, or -1 if a buffer could not be flushed for lack of memory (the others are still flushed)
+ */
+int flush_all() {
+    int result = 0;
+    for (int i = 0; i < NUM_FILES; i++) {
+        if (flush_file(i) < 0)
+            result = -1;
+    }
+    return result;
+}
+
+/**
+ * Checks whether the write buffer of a file is due to be written back by the background flusher: its data is older
+ * than DIRTY_EXPIRE_MS, the buffer is more than DIRTY_BACKGROUND_RATIO percent full (so that writes rarely have to
+ * flush a full buffer themselves), or the write buffers of all files hold more than DIRTY_RATIO percent of the data
+ * area.
+ *
+ * @param index  the index of the file
+ * @param now    the current time (in ms)
+ * @return       1 if the buffer is due, 0 otherwise
+ */
+int write_back_due(int index, long now) {
+    write_buffer_t *buffer = fs->write_buffers[index];
+    if (buffer == NULL || buffer->num_blocks == 0)
+        return 0;
+    if (now - buffer->dirtied >= DIRTY_EXPIRE_MS ||
+        buffer->num_blocks * 100 >= DIRTY_BACKGROUND_RATIO * NUM_WRITE_BUFFER_BLOCKS)
+        return 1;
+    int num_dirty = 0;
+    for (int i = 0; i < NUM_FILES; i++)
+        num_dirty += fs->write_buffers[i] != NULL ? fs->write_buffers[i]->num_blocks : 0;
+    return num_dirty * 100 >= DIRTY_RATIO * (FBM_INDEX - FIRST_DATA_INDEX);
+}
+
+/**
+ * Writes back the write buffers that are due, then commits the journal unless a batch is open. The files are flushed
+ * in order of their first block on the disk (or of their allocation group), so that a write back sweeps across the
+ * disk once, and each flush writes its blocks in order of address.
+ */
+void write_back() {
+    long now = now_ms();
+    int order[NUM_FILES]; // Files due, sorted by position on the disk
+    int positions[NUM_FILES];
+    int num_due = 0;
+    for (int index = 0; index < NUM_FILES; index++) {
+        if (!write_back_due(index, now))
+            continue;
+        inode_t *inode = get_inode(index);
+        int position = inode->indirect != INLINE_DATA && inode->direct[0] >= 0 ? inode->direct[0] : home_block(index);
+        int j = num_due++;
+        for (; j > 0 && positions[j - 1] > position; j--) {
+            order[j] = order[j - 1];
+            positions[j] = positions[j - 1];
+        }
+        order[j] = index;
+        positions[j] = position;
+    }
+    for (int i = 0; i < num_due; i++)
+        flush_file(order[i]); // A buffer that cannot be flushed for lack of memory is kept for the next pass
+    if (fs->journal.num_batches == 0)
+        journal_commit();
+}
+
+/**
+ * Discards the write buffer of a file (when the file is removed).
+ *
+ * @param index  the index of the file
+ */
+void discard_write_buffer(int index) {
+    if (fs->write_buffers[index] != NULL) {
+        fs->reserved_blocks -= fs->write_buffers[index]->reserved;
+        put_write_buffer(fs->write_buffers[index]);
+        fs->write_buffers[index] = NULL;
+    }
+}
+
+/**
+ * Lists the addresses of the data blocks of a file, in file order.
+ *
+ * @param index   the index of the file
+ * @param blocks  the array to fill, with room for NUM_DIRECT_POINTERS + NUM_INDIRECT_POINTERS_PER_BLOCK addresses
+ * @return        the number of blocks of the file, or -1 if there is no memory for the indirect block
+ */
+int get_file_blocks(int index, int *blocks) {
+    inode_t *inode = get_inode(index);
+    int num_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    indirect_block_t *indirect = NULL;
+    if (load_indirect(inode, num_blocks - 1, &indirect) < 0)
+        return -1; // Error: no memory for the indirect block
+    for (int i = 0; i < num_blocks; i++)
+        blocks[i] = get_block_address(inode, i, &indirect);
+    if (indirect != NULL)
+        put_block_buffer(indirect);
+    return num_blocks;
+}
+
+/**
+ * Takes the page of a read-ahead out of its cache. The page is freed, unless zero-copy reads still point into it.
+ *
+ * @param read_ahead  the read-ahead
+ */
+void drop_page(read_ahead_t *read_ahead) {
+    cache_page_t *page = read_ahead->page;
+    if (page == NULL)
+        return;
+    page->cached = 0;
+    if (page->pins == 0)
+        put_page(page);
+    read_ahead->page = NULL;
+}
+
+/**
+ * Resets the read-ahead state of a file, and releases its cache.
+ *
+ * @param index  the index of the file
+ */
+void reset_read_ahead(int index) {
+    read_ahead_t *read_ahead = &fs->read_aheads[index];
+    drop_page(read_ahead);
+    read_ahead->num_blocks = 0;
+    read_ahead->next_pointer = 0;
+    read_ahead->window = READ_AHEAD_INITIAL_BLOCKS;
+}
+
+/**
+ * Adapts the read-ahead window of a file to a read: sequential reads (starting where the previous read ended) double
+ * it, other reads halve it.
+ *
+ * @param index         the index of the file
+ * @param read_pointer  the start of the read
+ * @return              the read-ahead state of the file
+ */
+read_ahead_t *adapt_read_ahead(int index, int read_pointer) {
+    read_ahead_t *read_ahead = &fs->read_aheads[index];
+    if (read_pointer == read_ahead->next_pointer) { // Sequential read: grow the read-ahead window
+        if (read_ahead->window * 2 <= READ_AHEAD_MAX_BLOCKS)
+            read_ahead->window *= 2;
+    } else if (read_ahead->window > 1) { // Random read: shrink it
+        read_ahead->window /= 2;
+    }
+    return read_ahead;
+}
+
+/**
+ * Gets a block of a file through its read-ahead cache. On a miss, the cache is refilled from the disk, starting at
+ * the block, with the larger of the read-ahead window and the number of blocks the current read still needs. Blocks
+ * with consecutive addresses are read with a single read, and holes are filled with zeros without reading the disk.
+ * The cache of a compressed file holds whole clusters. The cache stops before the first block (or cluster) that fails
+ * its checksum.
+ *
+ * @param index       the index of the file
+ * @param i           the index of the block in the file
+ * @param num_needed  the number of blocks the current read still needs (including this one)
+ * @param indirect    cache of the file's indirect block (initially NULL, to be freed by the user)
+ * @param corrupted   set to 1 if a block read fails its checksum, or if there is no memory for the cache
+ * @return            the cached block, or NULL if the block is past the blocks of the file on the disk
+ */
+block_t *read_ahead_block(int index, int i, int num_needed, indirect_block_t **indirect, int *corrupted) {
+    read_ahead_t *read_ahead = &fs->read_aheads[index];
+    if (i >= read_ahead->first_block && i < read_ahead->first_block + read_ahead->num_blocks)
+        return &read_ahead->page->blocks[i - read_ahead->first_block]; // Hit
+    if (read_ahead->page != NULL && read_ahead->page->pins > 0)
+        drop_page(read_ahead); // Pinned: the cache moves on to a new page
+    read_ahead->num_blocks = 0; // Until the cache is refilled
+    if (read_ahead->page == NULL && (read_ahead->page = get_page(1)) == NULL) {
+        *corrupted = 1;
+        return NULL; // Error: no memory for the cache
+    }
+    block_t *blocks = read_ahead->page->blocks;
+    inode_t *inode = get_inode(index);
+    int num_file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int count = read_ahead->window > num_needed ? read_ahead->window : num_needed;
+    if (count > READ_AHEAD_MAX_BLOCKS)
+        count = READ_AHEAD_MAX_BLOCKS;
+    if (count > num_file_blocks - i)
+        count = num_file_blocks - i;
+    if (inode->compressed) { // Whole clusters are read, and decompressed into the cache
+        int first = i - i % CLUSTER_BLOCKS;
+        count = count + (i - first) < READ_AHEAD_MAX_BLOCKS ? count + (i - first) : READ_AHEAD_MAX_BLOCKS;
+        block_t cluster[CLUSTER_BLOCKS];
+        for (int j = 0; j < count; j += CLUSTER_BLOCKS) {
+            if (read_cluster(inode, (first + j) / CLUSTER_BLOCKS, cluster, indirect)) {
+                count = j; // Only the clusters before this one are cached
+                *corrupted = j == 0;
+                break;
+            }
+            int length = count - j < CLUSTER_BLOCKS ? count - j : CLUSTER_BLOCKS;
+            memcpy(&blocks[j], cluster, (size_t) length * BLOCK_SIZE);
+        }
+        read_ahead->first_block = first;
+        read_ahead->num_blocks = count > 0 ? count : 0;
+        return count > i - first ? &blocks[i - first] : NULL;
+    }
+    if (load_indirect(inode, i + count - 1, indirect) < 0) {
+        *corrupted = 1;
+        return NULL; // Error: no memory for the indirect block
+    }
+    int addresses[READ_AHEAD_MAX_BLOCKS];
+    for (int j = 0; j < count; j++)
+        addresses[j] = get_block_address(inode, i + j, indirect);
+    read_ahead->first_block = i;
+    read_ahead->num_blocks = count > 0 ? count : 0;
+    for (int j = 0; j < count;) {
+        if (addresses[j] < 0) { // Hole
+            memset(&blocks[j], 0, BLOCK_SIZE);
+            j++;
+            continue;
+        }
+        int length = 1; // Number of blocks with consecutive addresses
+        while (j + length < count && addresses[j + length] == addresses[j] + length)
+            length++;
+        int good = read_data_blocks(addresses[j], length, &blocks[j]);
+        if (good < length) { // Only the blocks before this one are cached
+            read_ahead->num_blocks = j + good;
+            *corrupted = j + good == 0;
+            break;
+        }
+        j += length;
+    }
+    return count > 0 && !*corrupted ? &blocks[0] : NULL;
+}
+
+/**
+ * Points a block of a file to a new address. The file must already have an indirect block if needed.
+ *
+ * @param index      the index of the file
+ * @param i          the index of the block in the file
+ * @param block_num  the new address of the block
+ * @return           0 on success, or -1 if there is no memory for the indirect block (nothing is changed then)
+ */
+int set_file_block(int index, int i, int block_num) {
+    inode_t *inode = get_inode(index);
+    if (i < NUM_DIRECT_POINTERS) {
+        inode->direct[i] = block_num;
+        save_inode(index);
+    } else {
+        indirect_block_t *indirect = (indirect_block_t *) read_metadata_block(inode->indirect);
+        if (indirect == NULL)
+            return -1; // Error: no memory for the indirect block
+        indirect->inode_indices[i - NUM_DIRECT_POINTERS] = block_num;
+        journal_write(inode->indirect, indirect);
+        put_block_buffer(indirect);
+    }
+    return 0;
+}
+
+/**
+ * Counts the extents (runs of consecutive addresses) of a list of blocks. Holes are skipped, but a block after a hole
+ * only continues the extent if the hole was left free on the disk, as the defragmenter lays files out. The slots of a
+ * compressed cluster take no room on the disk.
+ *
+ * @param blocks      the block addresses, in file order (-1 for holes)
+ * @param num_blocks  the number of blocks
+ * @return            the number of extents
+ */
+int count_extents(int *blocks, int num_blocks) {
+    int extents = 0;
+    int next = -1; // Address that continues the current extent
+    for (int i = 0; i < num_blocks; i++) {
+        if (blocks[i] <= COMPRESSED)
+            continue;
+        if (blocks[i] < 0) {
+            if (next >= 0)
+                next++; // Hole left free
+            continue;
+        }
+        if (next < 0 || blocks[i] != next)
+            extents++;
+        next = blocks[i] + 1;
+    }
+    return extents;
+}
+
+/**
+ * Initializes the inode table and saves it to the disk emulator.
+ */
+void init_inode_table() {
+    memset(&fs->inode_table, 0, sizeof(inode_table_t));
+    for (int i = 0; i < NUM_FILES; i++) {
+        fs->inode_table.inodes[i].size = -1;
+        fs->inode_table.inodes[i].indirect = -1;
+        for (int j = 0; j < NUM_DIRECT_POINTERS; j++) {
+            fs->inode_table.inodes[i].direct[j] = -1;
+        }
+    }
+    fs->inode_table.inodes[ROOT_INODE].size = NUM_DIRECTORY_BUCKETS * BLOCK_SIZE; // Empty root directory
+    fs->inode_table.inodes[ROOT_INODE].indirect = DIRECTORY;
+    for (int j = 0; j < NUM_DIRECTORY_BUCKETS; j++)
+        fs->inode_table.inodes[ROOT_INODE].direct[j] = FIRST_DATA_INDEX + j; // Zeroed by the fresh disk
+    striped_write_blocks(INODE_TABLE_INDEX, NUM_INODE_BLOCKS, &fs->inode_table);
+    memset(fs->inode_blocks_loaded, 1, NUM_INODE_BLOCKS);
+}
+
+/**
+ * Initializes the FBM, WM and reference counts, and saves them to the disk emulator. The super block, inode table,
+ * journal region and reference count block, as well as the FBM and WM themselves, are never free. The buckets of the
+ * root directory are allocated up front, at the start of the data area, so that files in the root never allocate
+ * directory blocks.
+ */
+void init_fbm_and_wm() {
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        fs->fbm.bytes[i] = (unsigned char) (i >= FIRST_DATA_INDEX + NUM_DIRECTORY_BUCKETS);
+        fs->wm.bytes[i] = 1;
+    }
+    fs->fbm.bytes[FBM_INDEX] = 0;
+    fs->fbm.bytes[WM_INDEX] = 0;
+    fs->wm.bytes[WM_INDEX] = 0; // TODO: Change this for shadowing...
+    fs->wm.bytes[FBM_INDEX] = 0;
+    write_single_block(FBM_INDEX, &fs->fbm);
+    write_single_block(WM_INDEX, &fs->wm);
+    memset(&fs->refcounts, 0, BLOCK_SIZE);
+    write_single_block(REFCOUNT_INDEX, &fs->refcounts);
+    fs->bitmaps_loaded = 1;
+}
+
+/**
+ * Initializes the super block, and saves it to the disk emulator.
+ *
+ * @param options  the layout of the disk images
+ */
+void init_super(ssfs_options_t *options) { // populate root j-node // TODO: update super for shadowing section...
+    memset(&fs->super, 0, sizeof(super_block_t));
+    fs->super.magic = MAGIC;
+    fs->super.block_size = BLOCK_SIZE;
+    fs->super.num_blocks = NUM_DATA_BLOCKS + 3;
+    fs->super.num_inodes = NUM_INODE_BLOCKS;
+    fs->super.last_shadow = -1;
+    fs->super.journal_sequence = 1;
+    fs->super.num_disks = options->num_disks;
+    fs->super.stripe_width = options->stripe_width;
+    fs->super.mirrored = options->mirrored;
+    inode_t root;
+    memset(&root, 0, sizeof(inode_t));
+    root.size = -1; // Q: Is the size of root = sum of all bytes or the number of i-nodes? (Probably sum of all bytes)
+    root.indirect = -1;
+    for (int i = 0; i < NUM_DIRECT_POINTERS; i++) { // The j-node points to the inode table blocks
+        root.direct[i] = i < NUM_INODE_BLOCKS ? INODE_TABLE_INDEX + i : -1;
+    }
+    fs->super.root = root;
+    save_super();
+}
+
+/**
+ * Initializes the mount summary and saves it to the disk emulator.
+ */
+void init_summary() {
+    block_t block;
+    memset(&fs->summary, 0, sizeof(summary_t));
+    fs->summary.inode_high_water = ROOT_INODE + 1;
+    fs->summary.num_free_blocks = scan_free_blocks();
+    memset(&block, 0, BLOCK_SIZE);
+    memcpy(&block, &fs->summary, sizeof(summary_t));
+    write_single_block(SUMMARY_INDEX, &block);
+}
+
+/**
+ * Initializes the checksum area, and saves it to the disk emulator. Only the blocks in use can have been written by the
+ * other initializations: the free blocks of a fresh disk are zeros.
+ */
+void init_checksums() {
+    block_t block;
+    memset(&block, 0, BLOCK_SIZE);
+    unsigned int zeros = crc32c(&block, BLOCK_SIZE);
+    for (int i = 0; i < NUM_DATA_BLOCKS; i++) {
+        fs->checksums.crcs[i] = zeros;
+        if (checksummed(i) && fs->fbm.bytes[i] == 0) {
+            striped_read_blocks(i, 1, &block);
+            fs->checksums.crcs[i] = crc32c(&block, BLOCK_SIZE);
+        }
+    }
+    striped_write_blocks(CHECKSUM_INDEX, NUM_CHECKSUM_BLOCKS, &fs->checksums);
+}
+
+/**
+ * Attaches the disks holding the stripes of the data blocks, beyond the first disk, and the mirror of each disk if the
+ * file system is mirrored. Each disk is an image of the same size as the first, named after it with the number of the
+ * disk as a suffix. A mirror is named after its disk with a ".mirror" suffix.
+ *
+ * @param disk_name  the name of the first disk
+ * @param fresh      whether the disks are created from scratch (or opened)
+ */
+void attach_disks(char *disk_name, int fresh) {
+    char name[MAX_PATH_LENGTH];
+    for (int d = 1; d < fs->super.num_disks; d++) {
+        snprintf(name, sizeof(name), "%s.%d", disk_name, d);
+        attach_disk(name, fresh);
+    }
+    for (int d = 0; d < fs->super.num_disks && fs->super.mirrored; d++) {
+        if (d == 0)
+            snprintf(name, sizeof(name), "%s.mirror", disk_name);
+        else
+            snprintf(name, sizeof(name), "%s.%d.mirror", disk_name, d);
+        attach_mirror(d, name, fresh);
+    }
+}
+
+/**
+ * Initializes an empty journal.
+ */
+void init_journal() {
+    fs->journal.head = JOURNAL_INDEX;
+    fs->journal.sequence = fs->super.journal_sequence;
+    fs->journal.num_ops = 0;
+    fs->journal.num_pending = 0;
+    fs->journal.num_logged = 0;
+}
+
+/**
+ * Initializes the open file descriptor table.
+ */
+void init_ofd() {
+    for (int i = 0; i < NUM_FILES; i++) {
+        fs->ofd_table.read_pointers[i] = -1;
+        fs->ofd_table.write_pointers[i] = -1;
+        reset_read_ahead(i);
+    }
+}
+
+/**
+ * Commits any batched metadata of the default volume when the process exits, so that grouped operations are not lost
+ * on a clean exit.
+ */
+void journal_flush_at_exit() {
+    fs = &default_volume;
+    use_emulator(NULL);
+    if (fs->mounted) {
+        flush_all();
+        journal_commit();
+    }
+}
+
+/**
+ * Formats the disk of the volume served by the calling thread and creates the SSFS file system on top of it, or opens
+ * the file system already on it. A file system already mounted on the volume is flushed and closed first.
+ *
+ * @param disk_name  the name of the first disk image
+ * @param options    whether the file system is created from scratch, and the layout of its disk images if so
+ * @return           0 if successful, -1 if the disk images could not be created or opened, or if there is no memory
+ *                   to flush the file system already mounted
+ */
+int mount_volume(char *disk_name, ssfs_options_t *options) {
+    if (fs->mounted) { // Flush the previous file system before reopening the disk
+        if (flush_all() < 0)
+            return -1; // Error: no memory to flush the files (the previous file system stays mounted)
+        journal_commit();
+        close_disk();
+        fs->mounted = 0;
+    }
+    if (options->fresh) { // Create new copy
+        if (init_fresh_disk(disk_name, BLOCK_SIZE, NUM_DATA_BLOCKS + 3) < 0) // +3 for super, fbm, wm
+            return -1;
+        init_fbm_and_wm();
+        init_super(options);
+        attach_disks(disk_name, 1);
+        init_inode_table();
+        init_summary();
+        init_checksums();
+        init_journal();
+    } else { // Access old copy: only the super block and summary are read, the rest is loaded on demand
+        block_t block;
+        if (init_disk(disk_name, BLOCK_SIZE, NUM_DATA_BLOCKS + 3) < 0)
+            return -1;
+        read_blocks(SUPER_INDEX, 1, &block);
+        memcpy(&fs->super, &block, sizeof(super_block_t));
+        if (fs->super.num_disks > MAX_DISKS || fs->super.stripe_width < 1) // Not striped, or not an SSFS disk at all
+            fs->super.num_disks = 1;
+        if (fs->super.magic != MAGIC)
+            fs->super.mirrored = 0;
+        attach_disks(disk_name, 0);
+        journal_replay();
+        striped_read_blocks(SUMMARY_INDEX, 1, &block);
+        memcpy(&fs->summary, &block, sizeof(summary_t));
+        memset(fs->inode_blocks_loaded, 0, NUM_INODE_BLOCKS);
+        fs->bitmaps_loaded = 0;
+        if (fs->summary.num_free_blocks == 0) // A full disk, or a summary from before the count was kept
+            fs->summary.num_free_blocks = scan_free_blocks();
+    }
+    fs->journal.num_batches = 0;
+    fs->path_cache.inode = -1;
+    invalidate_dentries(-1, 0);
+    reset_dedup_index();
+    fs->defrag.file = 0;
+    fs->defrag.target = -1;
+    fs->defrag.next_block = 0;
+    fs->log_head = 0;
+    for (int i = 0; i < NUM_FILES; i++)
+        fs->prealloc_ends[i] = MAX_FILE_BLOCKS; // Until a truncate finds out
+    fs->mounted = 1;
+    init_ofd();
+    return 0;
+}
+
+/**
+ * Formats the virtual disk and creates the SSFS file system on top of the disk, as the default volume.
+ *
+ * @param fresh  a flag to signal if the file system should be created from scratch. If false, the file
+ *               system is opened from the disk, and committed journal transactions are replayed.
+ */
+void mkssfs(int fresh) {
+    if (!fs->mounted)
+        atexit(journal_flush_at_exit);
+    default_options.fresh = fresh;
+    mount_volume("seanstappas", &default_options);
+}
+
+/**
+ * Sets how the data blocks of the next freshly created default volume are striped across disk images. A file system
+ * that is reopened keeps the striping it was created with.
+ *
+ * @param num_disks     the number of disk images (1 for no striping)
+ * @param stripe_width  the number of consecutive data blocks kept on one disk before moving on to the next
+ * @return              0 if successful, -1 otherwise
+ */
+int ssfs_set_striping(int num_disks, int stripe_width) {
+    if (num_disks < 1 || num_disks > MAX_DISKS || stripe_width < 1)
+        return -1; // Error: Invalid striping
+    default_options.num_disks = num_disks;
+    default_options.stripe_width = stripe_width;
+    return 0; // Success: Striping set
+}
+
+/**
+ * Sets whether each disk image of the next freshly created default volume is mirrored by a second image (RAID-1).
+ * Writes go to both images, and reads go to the least busy one, or to the other one when a read fails. A file system
+ * that is reopened keeps the mirroring it was created with.
+ *
+ * @param enabled  whether disk images are mirrored
+ */
+void ssfs_set_mirroring(int enabled) {
+    default_options.mirrored = enabled != 0;
+}
+
+/**
+ * Opens the given file. If the file does not exist, a new file with size 0 is created in its
+ * directory, which must exist. If it exists, read pointer is at the beginning of the file, and
+ * write pointer at the end (append mode).
+ *
+ * @param name  the path of the file to be opened, with directories separated by '/'
+ * @return      an integer corresponding to the index of the entry for the opened file in the file
+ *              descriptor table, or -1 on failure
+ */
+int ssfs_fopen(char *name) {
+    char filename[MAX_FILENAME_LENGTH];
+    int slot;
+    int dir = resolve_parent(name, filename);
+    if (dir < 0)
+        return -1; // Error: invalid name, or missing directory
+
+    int i = lookup_name(dir, filename, &slot);
+    if (i < -1)
+        return -1; // Error: no memory to read the directory
+    if (i >= 0) { // Directory match found
+        if (get_inode(i)->indirect == DIRECTORY)
+            return -1; // Error: not a file
+        int size = get_file_size(i);
+        fs->ofd_table.write_pointers[i] = size; // Update read & write pointers
+        fs->ofd_table.read_pointers[i] = 0;
+        reset_read_ahead(i);
+        return i; // Success: returns index of existing file
+    }
+
+    // File doesn't exist
+    int j = create_file(dir, filename, slot, 0);
+    if (j < 0)
+        return -1; // Error: no space for new file
+    fs->ofd_table.write_pointers[j] = 0;
+    fs->ofd_table.read_pointers[j] = 0;
+    reset_read_ahead(j);
+    return j; // Success: returns index of new file
+}
+
+/**
+ * Closes the given file. The corresponding entry is removed from the open file descriptor table.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @return        0 on success, -1 on failure
+ */
+int ssfs_fclose(int fileID) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0)
+        return -1; // Error: invalid fileID
+
+    if (flush_file(fileID) < 0)
+        return -1; // Error: no memory to flush the file (it stays open)
+    fs->ofd_table.read_pointers[fileID] = -1; // Reset read & write pointers
+    fs->ofd_table.write_pointers[fileID] = -1;
+    reset_read_ahead(fileID);
+    if (fs->journal.num_batches == 0)
+        journal_commit(); // Make the file's metadata durable (an open batch does it when it closes)
+
+    return 0; // Success
+}
+
+/**
+ * Makes the data written to an open file durable, without closing it: the file's write buffer is flushed and the
+ * journal is committed, even within an open batch (which is then committed in several transactions). Writes do not
+ * wait for the disk otherwise: their data stays buffered until the file is closed, its buffer fills up, or the
+ * background flusher of a mounted volume writes it back.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @return        0 on success, -1 on failure
+ */
+int ssfs_fsync(int fileID) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0)
+        return -1; // Error: invalid fileID
+
+    if (flush_file(fileID) < 0)
+        return -1; // Error: no memory to flush the file
+    journal_commit();
+
+    return 0; // Success
+}
+
+/**
+ * Moves the read pointer to the given location in the file.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @param loc     the location to move the read pointer to
+ * @return        0 on success, -1 on failure
+ */
+int ssfs_frseek(int fileID, int loc) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0 || loc < 0 || loc > get_file_size(fileID)) // Error checking
+        return -1; // Error: invalid fileID or loc
+
+    fs->ofd_table.read_pointers[fileID] = loc; // Update read pointer
+
+    return 0; // Success
+}
+
+/**
+ * Moves the write pointer to the given location in the file. The location may be past the end of the file: writing
+ * there leaves a hole, which takes no blocks and reads as zeros.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @param loc     the location to move the write pointer to
+ * @return        0 on success, -1 on failure
+ */
+int ssfs_fwseek(int fileID, int loc) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0 || loc < 0 || loc > MAX_FILE_BLOCKS * BLOCK_SIZE)
+        return -1; // Error: invalid fileID or loc
+
+    fs->ofd_table.write_pointers[fileID] = loc; // Update write pointer
+
+    return 0; // Success
+}
+
+/**
+ * Writes characters into a file, starting from the write pointer of the file. It is up to the user to properly
+ * initialize and provide the data buffer. The data goes to the file's write buffer, and only reaches the disk when the
+ * buffer is flushed (when it is full, or when the file is closed).
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @param buf     the characters to be written into the file
+ * @param length  the number of bytes to be written
+ * @return        the number of bytes written (fewer than length if there is no memory to flush the write buffer), or
+ *                -1 on failure (if reached maximum capacity)
+ */
+int ssfs_fwrite(int fileID, char *buf, int length) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0 || length < 0)
+        return -1; // Error: invalid fileID or length
+    if (length == 0)
+        return 0; // Success: nothing to write
+
+    int write_pointer = fs->ofd_table.write_pointers[fileID];
+    int first_block = write_pointer / BLOCK_SIZE;
+    int last_block = (write_pointer + length - 1) / BLOCK_SIZE;
+    if (last_block >= MAX_FILE_BLOCKS)
+        return -1; // Error: reached maximum file size
+
+    inode_t *inode = get_inode(fileID);
+    int num_file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE; // Number of blocks on the disk
+    write_buffer_t *buffer = fs->write_buffers[fileID];
+    int needed = 0; // Number of new blocks to reserve
+    indirect_block_t *indirect = NULL;
+    if (load_indirect(inode, last_block, &indirect) < 0)
+        return -1; // Error: no memory for the indirect block
+    load_bitmaps();
+    for (int i = first_block; i <= last_block; i++) {
+        int address = get_block_address(inode, i, &indirect);
+        if (address >= 0)
+            dedup_remove(address); // About to change, so no other block may start sharing it until the flush
+        if ((address < 0 || fs->refcounts.bytes[address] > 0) &&
+            (buffer == NULL || journal_find(buffer->block_indices, buffer->num_blocks, i) < 0))
+            needed++; // In a hole, past the end of the file and not preallocated, or shared (copied on write)
+    }
+    if (inode->compressed) { // Each cluster written to is written again as a whole, into new blocks
+        needed = 0;
+        for (int c = first_block / CLUSTER_BLOCKS; c <= last_block / CLUSTER_BLOCKS; c++) {
+            int buffered = 0;
+            for (int j = 0; buffer != NULL && j < buffer->num_blocks; j++)
+                buffered |= buffer->block_indices[j] / CLUSTER_BLOCKS == c;
+            if (!buffered)
+                needed += CLUSTER_BLOCKS;
+        }
+    }
+    int indirect_reserved = 0; // Whether a buffered block already reserved the single indirect block
+    for (int j = 0; buffer != NULL && j < buffer->num_blocks; j++) {
+        if (buffer->block_indices[j] >= NUM_DIRECT_POINTERS)
+            indirect_reserved = 1;
+    }
+    if (last_block >= NUM_DIRECT_POINTERS && inode->indirect < 0 && !indirect_reserved)
+        needed++; // The single indirect block
+    if (inode->indirect == INLINE_DATA && first_block > 0 && buffer == NULL)
+        needed++; // Block 0, if the file outgrows its inode
+    if (buffer == NULL && needed <= count_free_blocks() - fs->reserved_blocks) {
+        buffer = get_write_buffer(inode->size, 0);
+        fs->write_buffers[fileID] = buffer;
+    }
+    if (buffer == NULL || needed > count_free_blocks() - fs->reserved_blocks) {
+        if (indirect != NULL)
+            put_block_buffer(indirect);
+        return -1; // Error: no free block (reached maximum capacity), or no memory for the write buffer
+    }
+
+    if (inode->indirect == INLINE_DATA && buffer->num_blocks == 0) { // Buffer the inline data as block 0
+        buffer->block_indices[buffer->num_blocks++] = 0;
+        memset(&buffer->blocks[0], 0, BLOCK_SIZE);
+        memcpy(buffer->blocks[0].bytes, inode->data, inode->size);
+    }
+    buffer->reserved += needed;
+    fs->reserved_blocks += needed;
+    read_ahead_t *read_ahead = &fs->read_aheads[fileID];
+    if (first_block < read_ahead->first_block + read_ahead->num_blocks && last_block >= read_ahead->first_block)
+        read_ahead->num_blocks = 0; // The cached blocks are stale
+    int written = 0;
+    for (int i = first_block; i <= last_block; i++) {
+        int slot = journal_find(buffer->block_indices, buffer->num_blocks, i);
+        int offset = i == first_block ? write_pointer % BLOCK_SIZE : 0; // Offset of the write in the block
+        int count = BLOCK_SIZE - offset < length - written ? BLOCK_SIZE - offset : length - written;
+        if (slot < 0) { // Start buffering the block
+            if (buffer->num_blocks == NUM_WRITE_BUFFER_BLOCKS) { // Make room by flushing the buffer
+                if (write_pointer + written > buffer->size)
+                    buffer->size = write_pointer + written; // The flushed part of the write is now in the file
+                int reserved = buffer->reserved;
+                buffer->reserved = 0; // The rest of the write keeps its reservation
+                write_buffer_t *next = get_write_buffer(buffer->size, reserved); // Before the flush, which is final
+                if (next == NULL || flush_file(fileID) < 0) {
+                    buffer->reserved = reserved;
+                    if (next != NULL)
+                        put_write_buffer(next);
+                    length = written; // Error: no memory to flush the buffer, so the write stops here
+                    break;
+                }
+                if (indirect != NULL) {
+                    put_block_buffer(indirect);
+                    indirect = NULL;
+                }
+                buffer = next;
+                fs->write_buffers[fileID] = buffer;
+                inode = get_inode(fileID);
+                num_file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+                if (load_indirect(inode, last_block, &indirect) < 0) {
+                    length = written; // Error: no memory for the indirect block, so the write stops here
+                    break;
+                }
+            }
+            block_t cluster[CLUSTER_BLOCKS];
+            if (inode->compressed && i < num_file_blocks && count < BLOCK_SIZE && // Partial write of a cluster's block
+                read_cluster(inode, i / CLUSTER_BLOCKS, cluster, &indirect) < 0) {
+                length = written; // Error: no memory for the indirect block, so the write stops here
+                break;
+            }
+            slot = buffer->num_blocks++;
+            buffer->block_indices[slot] = i;
+            int address = i < num_file_blocks ? get_block_address(inode, i, &indirect) : -1;
+            if (inode->compressed && i < num_file_blocks && count < BLOCK_SIZE) {
+                buffer->blocks[slot] = cluster[i % CLUSTER_BLOCKS];
+            } else if (address >= 0 && count < BLOCK_SIZE)
+                read_data_blocks(address, 1, &buffer->blocks[slot]); // Partial write of a block on the disk
+            else
+                memset(&buffer->blocks[slot], 0, BLOCK_SIZE);
+        }
+        memcpy(buffer->blocks[slot].bytes + offset, buf + written, count);
+        written += count;
+    }
+    if (indirect != NULL)
+        put_block_buffer(indirect);
+    if (written == 0)
+        return -1; // Error: no memory to write anything
+
+    if (write_pointer + length > buffer->size)
+        buffer->size = write_pointer + length; // Update the file's size
+    fs->ofd_table.write_pointers[fileID] = write_pointer + length; // Move the write pointer to the end of the write
+    if (fs->flusher.running && write_back_due(fileID, buffer->dirtied)) // Old data is left to the periodic wake-up
+        pthread_cond_signal(&fs->flusher.wake); // Too much data buffered: write it back before the buffer fills up
+
+    return length; // Success: returns the number of bytes written
+}
+
+/**
+ * Read characters from a file to a buffer, starting from the read pointer of the current file. Only the blocks
+ * overlapping the read are accessed. Blocks still in the file's write buffer are read from memory, and the others go
+ * through the file's read-ahead cache. Holes read as zeros, and tiny files are read from their inode.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @param buf     a buffer to store the read bytes in (already allocated)
+ * @param length  the number of bytes to be read
+ * @return        the number of bytes read, or -1 on failure (including a block that fails its checksum, and no memory
+ *                for the read-ahead cache)
+ */
+int ssfs_fread(int fileID, char *buf, int length) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0 || length < 0)
+        return -1; // Error: invalid fileID or length
+
+    int read_pointer = fs->ofd_table.read_pointers[fileID];
+    int size = get_file_size(fileID);
+    int bytes_to_read = length; // Number of bytes to read
+    if (read_pointer + length > size) {
+        bytes_to_read = size - read_pointer;
+        if (bytes_to_read <= 0)
+            return 0; // Success: no bytes to read
+    }
+    if (bytes_to_read == 0)
+        return 0; // Success: no bytes to read
+
+    inode_t *inode = get_inode(fileID);
+    if (inode->indirect == INLINE_DATA && fs->write_buffers[fileID] == NULL) { // Stored in the inode: no block to read
+        memcpy(buf, inode->data + read_pointer, bytes_to_read);
+        fs->ofd_table.read_pointers[fileID] = read_pointer + bytes_to_read;
+        return bytes_to_read;
+    }
+    read_ahead_t *read_ahead = adapt_read_ahead(fileID, read_pointer);
+    write_buffer_t *buffer = fs->write_buffers[fileID];
+    int last_block = (read_pointer + bytes_to_read - 1) / BLOCK_SIZE;
+    indirect_block_t *indirect = NULL;
+    int done = 0; // Number of bytes read so far
+    for (int i = read_pointer / BLOCK_SIZE; done < bytes_to_read; i++) {
+        int offset = i == read_pointer / BLOCK_SIZE ? read_pointer % BLOCK_SIZE : 0; // Offset of the read in the block
+        int count = BLOCK_SIZE - offset < bytes_to_read - done ? BLOCK_SIZE - offset : bytes_to_read - done;
+        int slot = buffer != NULL ? journal_find(buffer->block_indices, buffer->num_blocks, i) : -1;
+        if (slot >= 0) {
+            memcpy(buf + done, buffer->blocks[slot].bytes + offset, count); // Buffered block
+        } else {
+            if (i >= MAX_FILE_BLOCKS) {
+                if (indirect != NULL)
+                    put_block_buffer(indirect);
+                return -1; // Error: reached maximum size of single indirect block
+            }
+            int corrupted = 0;
+            block_t *block = read_ahead_block(fileID, i, last_block - i + 1, &indirect, &corrupted);
+            if (corrupted) {
+                if (indirect != NULL)
+                    put_block_buffer(indirect);
+                return -1; // Error: a block fails its checksum, or no memory for the cache
+            }
+            if (block == NULL)
+                memset(buf + done, 0, count); // Hole past the blocks on the disk, before buffered data
+            else
+                memcpy(buf + done, block->bytes + offset, count); // Copy needed data into final buffer
+        }
+        done += count;
+    }
+
+    if (indirect != NULL)
+        put_block_buffer(indirect);
+
+    fs->ofd_table.read_pointers[fileID] = read_pointer + bytes_to_read; // Move read pointer up
+    read_ahead->next_pointer = read_pointer + bytes_to_read;
+
+    return bytes_to_read; // Success: returns the number of bytes read
+}
+
+/**
+ * Pins a page of the block cache, so that a zero-copy read can point into it.
+ *
+ * @param page  the page
+ */
+void pin_page(cache_page_t *page) {
+    if (page->pins++ == 0) {
+        page->next_pinned = fs->pinned_pages;
+        fs->pinned_pages = page;
+    }
+}
+
+/**
+ * Reads from a file without copying its data: the data at the read pointer is left in a page of the block cache,
+ * which is pinned, and a pointer to it is returned. The page stays valid, and unchanged by later writes to the file,
+ * until it is released with ssfs_frelease. As much data as the page holds in one piece is returned, up to the given
+ * length: this can be less than a read would return, and the rest is obtained by calling this again. The read pointer
+ * moves past the returned data. Buffered writes of the file are flushed first, and a tiny file stored in its inode is
+ * copied to a page of its own.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @param length  the maximum number of bytes to read
+ * @param data    where to store the pointer to the data
+ * @return        the number of bytes at the pointer, 0 at the end of the file (nothing is pinned), or -1 on failure
+ *                (including a block that fails its checksum, and no memory for the page)
+ */
+int ssfs_fpin(int fileID, int length, const char **data) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0 || length < 0 || data == NULL)
+        return -1; // Error: invalid fileID or length
+
+    if (flush_file(fileID) < 0)
+        return -1; // Error: no memory to flush the file, whose data must be on the disk (or in the inode) to be cached
+    int read_pointer = fs->ofd_table.read_pointers[fileID];
+    int bytes_to_read = get_file_size(fileID) - read_pointer < length ? get_file_size(fileID) - read_pointer : length;
+    if (bytes_to_read <= 0)
+        return 0; // Success: no bytes to read
+
+    inode_t *inode = get_inode(fileID);
+    read_ahead_t *read_ahead = adapt_read_ahead(fileID, read_pointer);
+    int i = read_pointer / BLOCK_SIZE;
+    int offset = read_pointer % BLOCK_SIZE;
+    int corrupted = 0;
+    indirect_block_t *indirect = NULL;
+    block_t *block = inode->indirect == INLINE_DATA ? NULL :
+                     read_ahead_block(fileID, i, (read_pointer + bytes_to_read - 1) / BLOCK_SIZE - i + 1, &indirect,
+                                      &corrupted);
+    if (indirect != NULL)
+        put_block_buffer(indirect);
+    if (corrupted)
+        return -1; // Error: a block fails its checksum, or no memory for the cache
+    cache_page_t *page;
+    if (block != NULL) { // In the cache: up to the end of the cached blocks
+        page = read_ahead->page;
+        int cached = (read_ahead->first_block + read_ahead->num_blocks) * BLOCK_SIZE - read_pointer;
+        bytes_to_read = cached < bytes_to_read ? cached : bytes_to_read;
+    } else { // Stored in the inode, or a hole past the blocks on the disk: in a page of its own
+        page = get_page(0);
+        if (page == NULL)
+            return -1; // Error: no memory for the page
+        block = &page->blocks[0];
+        memset(block, 0, BLOCK_SIZE);
+        if (inode->indirect == INLINE_DATA)
+            memcpy(block->bytes, inode->data, inode->size);
+        bytes_to_read = BLOCK_SIZE - offset < bytes_to_read ? BLOCK_SIZE - offset : bytes_to_read;
+    }
+    pin_page(page);
+    *data = (const char *) block->bytes + offset;
+
+    fs->ofd_table.read_pointers[fileID] = read_pointer + bytes_to_read; // Move read pointer up
+    read_ahead->next_pointer = read_pointer + bytes_to_read;
+    return bytes_to_read; // Success: returns the number of bytes at the pointer
+}
+
+/**
+ * Releases data returned by ssfs_fpin, unpinning its page. The data must not be used afterwards.
+ *
+ * @param data  the pointer returned by ssfs_fpin
+ * @return      0 on success, -1 if the pointer is not into a pinned page
+ */
+int ssfs_frelease(const char *data) {
+    for (cache_page_t **link = &fs->pinned_pages; *link != NULL; link = &(*link)->next_pinned) {
+        cache_page_t *page = *link;
+        if (data < (const char *) page->blocks || data >= (const char *) (page->blocks + READ_AHEAD_MAX_BLOCKS))
+            continue;
+        if (--page->pins == 0) {
+            *link = page->next_pinned;
+            if (!page->cached)
+                put_page(page);
+        }
+        return 0; // Success
+    }
+    return -1; // Error: not pinned
+}
+
+/**
+ * Removes a file from the filesystem. The file is removed from its directory, the i-node
+ * entry is released, and the data blocks used by the file are released. Set all blocks used by file to free in the FBM
+ * and remove the associated inode from the inode table. Directories are removed with ssfs_rmdir.
+ *
+ * @param file  the path of the file
+ * @return      0 on success, -1 on failure
+ */
+int ssfs_remove(char *file) {
+    char name[MAX_FILENAME_LENGTH];
+    int slot;
+    int dir = resolve_parent(file, name);
+    int i = dir < 0 ? -1 : lookup_name(dir, name, &slot);
+    if (i < 0 || get_inode(i)->indirect == DIRECTORY)
+        return -1; // Error: file not found (invalid file name), or a directory
+
+    inode_t inode = *get_inode(i);
+    if (inode.indirect == INLINE_DATA)
+        clear_inline_data(&inode); // No block to free
+    indirect_block_t *indirect = NULL;
+    if (inode.indirect != -1 && load_indirect(&inode, MAX_FILE_BLOCKS - 1, &indirect) < 0)
+        return -1; // Error: no memory for the indirect block
+    journal_begin();
+    if (set_directory_entry(dir, slot, NULL, i) < 0) {
+        if (indirect != NULL)
+            put_block_buffer(indirect);
+        journal_end();
+        return -1; // Error: no memory for the directory bucket
+    }
+    discard_write_buffer(i);
+    reset_read_ahead(i);
+    fs->ofd_table.read_pointers[i] = -1; // Clear read & write pointers
+    fs->ofd_table.write_pointers[i] = -1;
+    for (int j = 0; j < NUM_DIRECT_POINTERS; j++) {
+        int block_number = inode.direct[j];
+        if (block_number >= 0) {
+            release_block(block_number); // Free the direct blocks
+        }
+    }
+    if (inode.indirect != -1) {
+        for (int j = 0; j < NUM_INDIRECT_POINTERS_PER_BLOCK; j++) {
+            int block_num = indirect->inode_indices[j];
+            if (block_num >= 0) {
+                release_block(block_num); // Free the indirect blocks
+            }
+        }
+        put_block_buffer(indirect);
+        free_block(inode.indirect); // Free the single indirect block itself
+    }
+    save_fbm();
+    release_inode(i);
+    journal_end();
+    return 0; // Success: file removed
+}
+
+/**
+ * Creates a directory. Its parent directory must exist.
+ *
+ * @param path  the path of the directory
+ * @return      0 on success, -1 on failure (if the path is invalid or already exists, or there is no space)
+ */
+int ssfs_mkdir(char *path) {
+    char name[MAX_FILENAME_LENGTH];
+    int slot;
+    int dir = resolve_parent(path, name);
+    if (dir < 0 || lookup_name(dir, name, &slot) != -1)
+        return -1; // Error: invalid path, already exists, or no memory to read the directory
+    return create_file(dir, name, slot, 1) < 0 ? -1 : 0;
+}
+
+/**
+ * Removes an empty directory, freeing its buckets.
+ *
+ * @param path  the path of the directory
+ * @return      0 on success, -1 on failure (if the directory does not exist or is not empty)
+ */
+int ssfs_rmdir(char *path) {
+    char name[MAX_FILENAME_LENGTH];
+    int slot;
+    int dir = resolve_parent(path, name);
+    int i = dir < 0 ? -1 : lookup_name(dir, name, &slot);
+    if (i < 0 || get_inode(i)->indirect != DIRECTORY)
+        return -1; // Error: directory not found
+    inode_t *inode = get_inode(i);
+    for (int b = 0; b < NUM_DIRECTORY_BUCKETS; b++) {
+        if (inode->direct[b] < 0)
+            continue;
+        directory_bucket_t *bucket = (directory_bucket_t *) read_metadata_block(inode->direct[b]);
+        if (bucket == NULL)
+            return -1; // Error: no memory for the bucket
+        for (int e = 0; e < NUM_ENTRIES_PER_BUCKET; e++) {
+            if (bucket->entries[e].inode > 0) {
+                put_block_buffer(bucket);
+                return -1; // Error: directory not empty
+            }
+        }
+        put_block_buffer(bucket);
+    }
+
+    journal_begin();
+    if (set_directory_entry(dir, slot, NULL, i) < 0) {
+        journal_end();
+        return -1; // Error: no memory for the bucket of the parent directory
+    }
+    for (int b = 0; b < NUM_DIRECTORY_BUCKETS; b++) {
+        if (inode->direct[b] >= 0)
+            free_block(inode->direct[b]);
+    }
+    save_fbm();
+    release_inode(i);
+    journal_end();
+    fs->path_cache.inode = -1; // The cached directory may be gone
+    return 0; // Success: directory removed
+}
+
+/**
+ * Finds a file or directory, including the root directory (a path without any component).
+ *
+ * @param path  the path
+ * @return      the index of the inode, or -1 if it does not exist
+ */
+int find_path(char *path) {
+    for (char *c = path; *c != '\0'; c++) {
+        if (*c != '/')
+            return find_file(path);
+    }
+    return ROOT_INODE;
+}
+
+/**
+ * Describes a file or directory from its cached inode.
+ *
+ * @param index  the index of the inode
+ * @param stat   the description to fill
+ */
+void fill_stat(int index, ssfs_stat_t *stat) {
+    inode_t *inode = get_inode(index);
+    stat->inode = index;
+    stat->directory = inode->indirect == DIRECTORY;
+    stat->size = stat->directory ? inode->size : get_file_size(index);
+    stat->compressed = inode->compressed;
+}
+
+/**
+ * Describes a file or directory. Its inode and its name are usually cached already, so this needs no disk I/O.
+ *
+ * @param path  the path of the file or directory ("/" for the root directory)
+ * @param stat  the description to fill
+ * @return      0 on success, -1 if the path does not exist
+ */
+int ssfs_stat(char *path, ssfs_stat_t *stat) {
+    int index = find_path(path);
+    if (index < 0)
+        return -1; // Error: not found
+    fill_stat(index, stat);
+    return 0; // Success
+}
+
+/**
+ * Describes the capacity of the file system, from the mount summary: neither the FBM nor the inode table is read.
+ *
+ * @param statfs  the description to fill
+ * @return        0
+ */
+int ssfs_statfs(ssfs_statfs_t *statfs) {
+    statfs->block_size = BLOCK_SIZE;
+    statfs->num_blocks = FBM_INDEX - FIRST_DATA_INDEX;
+    statfs->free_blocks = count_free_blocks() - fs->reserved_blocks;
+    statfs->num_files = NUM_FILES - 1;
+    statfs->free_files = NUM_FILES - 1 - fs->summary.num_files;
+    return 0; // Success
+}
+
+/**
+ * Lists the entries of a directory, resuming from a cursor. The cursor is the slot of the directory to start from (0
+ * to start from the beginning), and is moved past the entries returned. Slots never move, so a scan can go on while
+ * files are created and removed: every entry that stays in the directory during the scan is returned exactly once,
+ * and entries created or removed during the scan may or may not be. Each bucket is read at most once per call, and
+ * holes are skipped without any read.
+ *
+ * @param path     the path of the directory ("/" for the root directory)
+ * @param cursor   the slot to start from, moved past the returned entries
+ * @param entries  the array to fill
+ * @param max      the number of entries the array can hold
+ * @return         the number of entries returned (0 once the whole directory has been listed), or -1 on failure
+ */
+int ssfs_readdir(char *path, int *cursor, ssfs_dirent_t *entries, int max) {
+    int dir = find_path(path);
+    if (dir < 0 || get_inode(dir)->indirect != DIRECTORY || *cursor < 0 || max < 0)
+        return -1; // Error: directory not found, or invalid cursor
+    inode_t *inode = get_inode(dir);
+    int slot = *cursor;
+    int count = 0;
+    while (slot < NUM_DIRECTORY_BUCKETS * NUM_ENTRIES_PER_BUCKET && count < max) {
+        int b = slot / NUM_ENTRIES_PER_BUCKET;
+        if (inode->direct[b] < 0) { // Hole
+            slot = (b + 1) * NUM_ENTRIES_PER_BUCKET;
+            continue;
+        }
+        directory_bucket_t *bucket = (directory_bucket_t *) read_metadata_block(inode->direct[b]);
+        if (bucket == NULL)
+            return -1; // Error: no memory for the bucket (the cursor is left as it was)
+        for (; slot < (b + 1) * NUM_ENTRIES_PER_BUCKET && count < max; slot++) {
+            directory_entry_t *entry = &bucket->entries[slot % NUM_ENTRIES_PER_BUCKET];
+            if (entry->inode <= 0)
+                continue;
+            strncpy(entries[count].name, entry->filename, MAX_FILENAME_LENGTH - 1);
+            entries[count].name[MAX_FILENAME_LENGTH - 1] = '\0';
+            fill_stat(entry->inode, &entries[count].stat);
+            count++;
+        }
+        put_block_buffer(bucket);
+    }
+    *cursor = slot;
+    return count; // Success
+}
+
+/**
+ * Changes the size of a file. When shrinking, the blocks past the new end of the file (including preallocated ones)
+ * are freed, reading the indirect block at most once and only looking at the pointers up to the last block the file
+ * may have, and the rest of the new last block is zeroed (in a copy if the block is shared, and a compressed file's
+ * new last cluster is written again if it is cut). When growing, the new part of the file is a hole (a tiny file
+ * stored in its inode first moves to a block if it no longer fits). The read and write pointers are left as they are.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @param size    the new size of the file in bytes
+ * @return        0 on success, -1 on failure
+ */
+int ssfs_truncate(int fileID, int size) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0 || size < 0 || size > MAX_FILE_BLOCKS * BLOCK_SIZE)
+        return -1; // Error: invalid fileID or size
+
+    if (flush_file(fileID) < 0)
+        return -1; // Error: no memory to flush the file
+    reset_read_ahead(fileID);
+    inode_t *inode = get_inode(fileID);
+    if (inode->indirect == INLINE_DATA && size > MAX_INLINE_SIZE && count_free_blocks() - fs->reserved_blocks < 1)
+        return -1; // Error: no free block for the data stored in the inode
+    indirect_block_t *indirect = NULL; // Cache of the indirect block, for every step below
+    int indirect_changed = 0;
+    if (inode->indirect != INLINE_DATA && load_indirect(inode, MAX_FILE_BLOCKS - 1, &indirect) < 0)
+        return -1; // Error: no memory for the indirect block
+    block_t cluster_blocks[CLUSTER_BLOCKS];
+    block_t *cluster = NULL; // New last cluster of a compressed file, when it is cut (in cluster_blocks)
+    int cluster_size = CLUSTER_BLOCKS * BLOCK_SIZE;
+    int error = 0;
+    if (inode->compressed && inode->indirect != INLINE_DATA && size < inode->size && size % cluster_size != 0) {
+        cluster = cluster_blocks;
+        if (count_free_blocks() - fs->reserved_blocks < CLUSTER_BLOCKS)
+            error = 1; // No free blocks to write the cluster again
+        else if (read_cluster(inode, size / cluster_size, cluster, &indirect))
+            error = 1; // The cluster fails its checksum
+        else
+            memset(cluster->bytes + size % cluster_size, 0, (size_t) (cluster_size - size % cluster_size));
+    }
+    int tail = -1; // Address of the new last block, when the rest of it must be zeroed
+    block_t tail_block; // Its contents
+    if (!inode->compressed && inode->indirect != INLINE_DATA && size < inode->size && size % BLOCK_SIZE != 0) {
+        tail = get_block_address(inode, size / BLOCK_SIZE, &indirect);
+        load_bitmaps();
+        if (tail >= 0 && fs->refcounts.bytes[tail] > 0 && count_free_blocks() - fs->reserved_blocks < 1)
+            error = 1; // No free block to copy the shared last block
+        else if (tail >= 0 && read_data_blocks(tail, 1, &tail_block) < 1)
+            error = 1; // The last block fails its checksum
+    }
+    if (error) {
+        if (indirect != NULL)
+            put_block_buffer(indirect);
+        return -1; // Error: no free block, or a block fails its checksum
+    }
+    journal_begin();
+    if (inode->indirect == INLINE_DATA) {
+        if (size <= MAX_INLINE_SIZE) { // Still fits in the inode
+            if (size < inode->size)
+                memset(inode->data + size, 0, inode->size - size);
+            inode->size = size;
+            save_inode(fileID);
+            journal_end();
+            return 0; // Success
+        }
+        block_t block; // Move the data to a block
+        memset(&block, 0, BLOCK_SIZE);
+        memcpy(block.bytes, inode->data, inode->size);
+        clear_inline_data(inode);
+        inode->direct[0] = get_free_block(home_block(fileID));
+        write_data_blocks(inode->direct[0], 1, &block);
+        save_fbm();
+    }
+    int num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE; // Number of blocks to keep
+    int end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE; // One past the last block the file may have
+    if (end < fs->prealloc_ends[fileID])
+        end = fs->prealloc_ends[fileID];
+    int num_freed = 0;
+    for (int i = num_blocks; i < NUM_DIRECT_POINTERS && i < end; i++) {
+        if (inode->direct[i] != -1) {
+            if (inode->direct[i] >= 0)
+                release_block(inode->direct[i]); // Not the slot of a compressed cluster
+            inode->direct[i] = -1;
+            num_freed++;
+        }
+    }
+    if (inode->indirect != -1 && num_blocks < MAX_FILE_BLOCKS) {
+        int first = num_blocks > NUM_DIRECT_POINTERS ? num_blocks - NUM_DIRECT_POINTERS : 0;
+        for (int j = first; j < end - NUM_DIRECT_POINTERS; j++) {
+            if (indirect->inode_indices[j] != -1) {
+                if (indirect->inode_indices[j] >= 0)
+                    release_block(indirect->inode_indices[j]);
+                indirect->inode_indices[j] = -1;
+                indirect_changed = 1;
+                num_freed++;
+            }
+        }
+        if (first == 0) { // No block left behind the single indirect block
+            free_block(inode->indirect);
+            inode->indirect = -1;
+            indirect_changed = 0;
+            num_freed++;
+        }
+    }
+    if (cluster != NULL) { // Write the cut cluster again, without the blocks past the new end
+        int c = size / cluster_size;
+        write_cluster(inode, c, cluster, num_blocks - c * CLUSTER_BLOCKS, 0, &indirect, &indirect_changed);
+        num_freed++;
+    } else if (tail >= 0) { // Zero the rest of the new last block, which would be visible if the file grows again
+        memset(tail_block.bytes + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+        if (fs->refcounts.bytes[tail] > 0) { // Shared with other blocks: copy on write
+            int copy = get_free_block(tail);
+            write_data_blocks(copy, 1, &tail_block);
+            set_block_address(inode, size / BLOCK_SIZE, copy, &indirect, &indirect_changed);
+            release_block(tail);
+        } else {
+            dedup_remove(tail);
+            write_data_blocks(tail, 1, &tail_block);
+        }
+    }
+    if (indirect_changed)
+        journal_write(inode->indirect, indirect);
+    if (indirect != NULL)
+        put_block_buffer(indirect);
+    if (num_freed > 0)
+        save_fbm();
+    inode->size = size;
+    save_inode(fileID);
+    journal_end();
+    fs->prealloc_ends[fileID] = num_blocks; // Nothing is left past the new end
+
+    return 0; // Success
+}
+
+/**
+ * Preallocates the blocks of a file up to the given size, so that later writes there need no allocation. The missing
+ * blocks are allocated together, as a single run right after the file's last block if possible, and zeroed. The size
+ * of the file does not change: blocks past the end of the file stay preallocated until it grows over them. A tiny file
+ * stored in its inode moves to its first block.
+ *
+ * @param fileID  the file ID corresponding to the file (from the open file descriptor table)
+ * @param size    the size in bytes to preallocate the file up to
+ * @return        0 on success, -1 on failure (if there are not enough free blocks, or the file is compressed)
+ */
+int ssfs_fallocate(int fileID, int size) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0 || size < 0 || size > MAX_FILE_BLOCKS * BLOCK_SIZE)
+        return -1; // Error: invalid fileID or size
+
+    if (get_inode(fileID)->compressed)
+        return -1; // Error: the clusters of a compressed file move on every write, so there is nothing to preallocate
+    if (flush_file(fileID) < 0)
+        return -1; // Error: no memory to flush the file
+    inode_t *inode = get_inode(fileID);
+    if (inode->indirect == INLINE_DATA && size <= MAX_INLINE_SIZE)
+        return 0; // Success: already fits in the inode
+    int num_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    indirect_block_t *indirect = NULL;
+    if (load_indirect(inode, num_blocks - 1, &indirect) < 0)
+        return -1; // Error: no memory for the indirect block
+    int missing[MAX_FILE_BLOCKS]; // Indices of the blocks without an address (all of them for a tiny file)
+    int num_missing = 0;
+    int last = -1; // Last address of the file, to extend it contiguously
+    for (int i = 0; i < num_blocks; i++) {
+        int address = get_block_address(inode, i, &indirect);
+        if (address < 0)
+            missing[num_missing++] = i;
+        else
+            last = address;
+    }
+    int new_indirect = num_blocks > NUM_DIRECT_POINTERS && inode->indirect < 0;
+    if (num_missing == 0 || num_missing + new_indirect > count_free_blocks() - fs->reserved_blocks) {
+        if (indirect != NULL)
+            put_block_buffer(indirect);
+        return num_missing == 0 ? 0 : -1; // Nothing to allocate, or error: not enough free blocks
+    }
+
+    cache_page_t *page = get_page(0); // Zeros, written a page at a time
+    if (page == NULL) {
+        if (indirect != NULL)
+            put_block_buffer(indirect);
+        return -1; // Error: no memory for the page
+    }
+    block_t *zeros = page->blocks;
+    memset(zeros, 0, sizeof(page->blocks));
+    journal_begin();
+    if (inode->indirect == INLINE_DATA) { // Block 0 gets the data stored in the inode
+        memcpy(zeros[0].bytes, inode->data, inode->size);
+        clear_inline_data(inode);
+    }
+    int hint = last >= 0 ? last + 1 : home_block(fileID); // Where the file's blocks are, or its allocation group
+    if (new_indirect)
+        inode->indirect = get_free_block(hint); // Its cache is empty
+    int run = allocate_run(num_missing, hint);
+    for (int i = 0; i < num_missing;) {
+        int address = run >= 0 ? run + i : get_free_block(hint);
+        int length = run >= 0 ? num_missing - i : 1; // Number of blocks with consecutive addresses
+        if (length > READ_AHEAD_MAX_BLOCKS)
+            length = READ_AHEAD_MAX_BLOCKS;
+        for (int j = i; j < i + length; j++) {
+            if (missing[j] < NUM_DIRECT_POINTERS)
+                inode->direct[missing[j]] = address + j - i;
+            else
+                indirect->inode_indices[missing[j] - NUM_DIRECT_POINTERS] = address + j - i;
+        }
+        write_data_blocks(address, length, zeros);
+        if (i == 0)
+            memset(&zeros[0], 0, BLOCK_SIZE); // Block 0 may have held the data stored in the inode
+        i += length;
+    }
+    put_page(page);
+    if (indirect != NULL) {
+        if (num_blocks > NUM_DIRECT_POINTERS)
+            journal_write(inode->indirect, indirect);
+        put_block_buffer(indirect);
+    }
+    save_fbm();
+    save_inode(fileID);
+    journal_end();
+    if (num_blocks > fs->prealloc_ends[fileID])
+        fs->prealloc_ends[fileID] = num_blocks;
+    reset_read_ahead(fileID);
+
+    return 0; // Success
+}
+
+/**
+ * Turns compression on or off for a file. The data of a compressed file is compressed by clusters of CLUSTER_BLOCKS
+ * blocks when it is flushed, and decompressed when it is read. This can only be changed while the file has no blocks
+ * (when it is empty, or stored in its inode).
+ *
+ * @param fileID   the file ID corresponding to the file (from the open file descriptor table)
+ * @param enabled  whether to compress the file
+ * @return         0 on success, -1 on failure (if the file already has blocks)
+ */
+int ssfs_set_compression(int fileID, int enabled) {
+    if (fileID < 0 || fileID >= NUM_FILES || fs->ofd_table.read_pointers[fileID] < 0 ||
+        fs->ofd_table.write_pointers[fileID] < 0)
+        return -1; // Error: invalid fileID
+
+    if (flush_file(fileID) < 0)
+        return -1; // Error: no memory to flush the file
+    inode_t *inode = get_inode(fileID);
+    if (has_blocks(inode))
+        return -1; // Error: the file's blocks are already laid out
+    journal_begin();
+    inode->compressed = enabled != 0;
+    save_inode(fileID);
+    journal_end();
+
+    return 0; // Success
+}
+
+/**
+ * Opens a batch of metadata operations. Until the batch is closed, creates, removes and the other metadata operations
+ * are applied in memory and staged in the open journal transaction, which holds a single image of each metadata block
+ * they touch (inode table blocks, directory buckets, summary, FBM). Closing a file in the batch does not commit it
+ * either. The blocks are written once, when the batch closes, instead of with every group of operations or every
+ * closed file. A batch that outgrows a journal transaction is committed in several transactions, each made of whole
+ * operations. Batches can be nested, and only the outermost one commits.
+ *
+ * @return  0
+ */
+int ssfs_batch_begin() {
+    fs->journal.num_batches++;
+    return 0; // Success
+}
+
+/**
+ * Closes a batch of metadata operations opened by ssfs_batch_begin. Once the outermost batch is closed, its
+ * operations are committed.
+ *
+ * @return  0 on success, -1 if no batch is open
+ */
+int ssfs_batch_end() {
+    if (fs->journal.num_batches == 0)
+        return -1; // Error: no open batch
+    if (--fs->journal.num_batches == 0)
+        journal_commit();
+    return 0; // Success
+}
+
+/**
+ * Creates a shadow of the file system. The newly added blocks become read-only. The journal is committed and
+ * checkpointed, so that the shadow is entirely at home on the disk.
+ *
+ * @return  the index of the shadow root that holds the previous commit on success, -1 on failure
+ */
+int ssfs_commit() {
+    int last_shadow = fs->super.last_shadow;
+    if (last_shadow == -1) // Uninitialized last shadow
+        return -1;
+    if (flush_all() < 0)
+        return -1; // Error: no memory to flush the files
+    journal_begin();
+    load_bitmaps();
+    memcpy(&fs->wm, &fs->fbm, sizeof(block_t)); // Copy the FBM into the WM
+    save_wm();
+    journal_commit();
+    int next_shadow = (last_shadow + 1) % NUM_SHADOWS;
+    fs->super.shadow[next_shadow].size = 0;
+    fs->super.last_shadow = next_shadow;
+    journal_checkpoint(); // Saves super
+    return last_shadow;
+}
+
+/**
+ * Restores the file system to a previous shadow (state).
+ *
+ * @param cnum  The commit number to restore to.
+ * @return      0 on success, -1 on failure
+ */
+int ssfs_restore(int cnum) {
     if (cnum < 0 || cnum >= NUM_SHADOWS)
         return -1;
-    super.root = super.shadow[cnum]; // Copy the specified shadow to the root
+    fs->super.root = fs->super.shadow[cnum]; // Copy the specified shadow to the root
+    return 0;
+}
+
+/**
+ * Checks whether a block address can be used for file data (or a single indirect block).
+ *
+ * @param block_num  the address of the block (in number of blocks)
+ * @return           1 if the address is in the data area, 0 otherwise
+ */
+int fsck_valid_block(int block_num) {
+    return block_num >= FIRST_DATA_INDEX && block_num < FBM_INDEX;
+}
+
+/**
+ * Scans an inode, counting the references it holds to each data block. Invalid pointers are not counted. Pointers
+ * past the end of the file are valid (preallocated blocks), as are -1 pointers inside it (holes) and the slots of
+ * compressed clusters. The inode table must
+ * already be cached, since this is called concurrently from the scan threads.
+ *
+ * @param index  the index of the inode
+ * @param refs   the reference counts of each block
+ * @return       the number of problems found in the inode, or -1 if there is no memory for its indirect block
+ */
+int fsck_scan_inode(int index, unsigned short *refs) {
+    inode_t *inode = &fs->inode_table.inodes[index];
+    if (inode->size < 0)
+        return 0; // Unused inode
+    if (inode->indirect == INLINE_DATA)
+        return inode->size > MAX_INLINE_SIZE; // No pointers, but the data must fit in the inode
+    int problems = 0;
+    for (int j = 0; j < NUM_DIRECT_POINTERS; j++) {
+        int block_num = inode->direct[j];
+        if (block_num == -1 || block_num <= COMPRESSED)
+            continue; // Hole, or slot of a compressed cluster
+        if (!fsck_valid_block(block_num))
+            problems++; // Invalid pointer
+        else
+            refs[block_num]++;
+    }
+    if (inode->indirect == DIRECTORY)
+        return problems + (inode->size != NUM_DIRECTORY_BUCKETS * BLOCK_SIZE); // Buckets, but no indirect block
+    if (inode->indirect == -1)
+        return problems;
+    if (!fsck_valid_block(inode->indirect))
+        return problems + 1; // Invalid indirect pointer
+    refs[inode->indirect]++;
+    indirect_block_t *indirect = (indirect_block_t *) read_metadata_block(inode->indirect);
+    if (indirect == NULL)
+        return -1; // Error: no memory for the indirect block
+    for (int j = 0; j < NUM_INDIRECT_POINTERS_PER_BLOCK; j++) {
+        int block_num = indirect->inode_indices[j];
+        if (block_num == -1 || block_num <= COMPRESSED)
+            continue;
+        if (!fsck_valid_block(block_num))
+            problems++; // Garbage in the indirect block
+        else
+            refs[block_num]++;
+    }
+    put_block_buffer(indirect);
+    return problems;
+}
+
+/**
+ * Work of one scan thread: a contiguous range of the inode table, and the block references found in it.
+ */
+typedef struct _fsck_scan_t {
+    int first_inode; // First inode of the range
+    int end_inode; // One past the last inode of the range
+    unsigned short refs[NUM_DATA_BLOCKS]; // Number of references to each block
+    unsigned char *bad_inodes; // Flags of the inodes with problems (shared, but each thread only writes its range)
+    ssfs_t *volume; // Volume being checked
+    int failed; // Whether the thread ran out of memory, so that its references are incomplete
+} fsck_scan_t;
+
+/**
+ * Entry point of a scan thread.
+ *
+ * @param arg  the fsck_scan_t of the thread
+ * @return     NULL
+ */
+void *fsck_scan_thread(void *arg) {
+    fsck_scan_t *scan = arg;
+    fs = scan->volume;
+    use_emulator(fs->emulator);
+    for (int i = scan->first_inode; i < scan->end_inode; i++) {
+        int problems = fsck_scan_inode(i, scan->refs);
+        if (problems < 0)
+            scan->failed = 1;
+        else if (problems > 0)
+            scan->bad_inodes[i] = 1;
+    }
+    return NULL;
+}
+
+/**
+ * Reports (and optionally repairs) the problems of an inode flagged by the scan. Invalid pointers are cleared, and a
+ * file stored in its inode is truncated to the size of the inode.
+ *
+ * @param index   the index of the inode
+ * @param repair  whether to repair the inode
+ * @return        the number of problems found, or -1 if there is no memory for its indirect block
+ */
+int fsck_repair_inode(int index, int repair) {
+    inode_t *inode = get_inode(index);
+    int problems = 0;
+    if (inode->indirect == INLINE_DATA) {
+        printf("fsck: inode %d: inline file of size %d does not fit in the inode\n", index, inode->size);
+        if (repair) {
+            inode->size = MAX_INLINE_SIZE;
+            save_inode(index);
+        }
+        return 1;
+    }
+    for (int j = 0; j < NUM_DIRECT_POINTERS; j++) {
+        int block_num = inode->direct[j];
+        if (block_num == -1 || block_num <= COMPRESSED || fsck_valid_block(block_num))
+            continue;
+        printf("fsck: inode %d: invalid direct pointer %d to block %d\n", index, j, block_num);
+        problems++;
+        if (repair)
+            inode->direct[j] = -1;
+    }
+    if (inode->indirect == DIRECTORY) {
+        if (inode->size != NUM_DIRECTORY_BUCKETS * BLOCK_SIZE) {
+            printf("fsck: inode %d: directory of size %d\n", index, inode->size);
+            problems++;
+            if (repair)
+                inode->size = NUM_DIRECTORY_BUCKETS * BLOCK_SIZE;
+        }
+    } else if (inode->indirect != -1 && !fsck_valid_block(inode->indirect)) {
+        printf("fsck: inode %d: invalid indirect pointer to block %d\n", index, inode->indirect);
+        problems++;
+        if (repair)
+            inode->indirect = -1; // Its blocks are freed as leaks
+    } else if (inode->indirect != -1) {
+        indirect_block_t *indirect = (indirect_block_t *) read_metadata_block(inode->indirect);
+        if (indirect == NULL)
+            return -1; // Error: no memory for the indirect block (the direct pointers are left as they were)
+        int changed = 0;
+        for (int j = 0; j < NUM_INDIRECT_POINTERS_PER_BLOCK; j++) {
+            int block_num = indirect->inode_indices[j];
+            if (block_num == -1 || block_num <= COMPRESSED || fsck_valid_block(block_num))
+                continue;
+            printf("fsck: inode %d: garbage pointer %d in indirect block %d\n", index, block_num, inode->indirect);
+            problems++;
+            if (repair) {
+                indirect->inode_indices[j] = -1;
+                changed = 1;
+            }
+        }
+        if (changed)
+            journal_write(inode->indirect, indirect);
+        put_block_buffer(indirect);
+    }
+    if (repair && problems > 0)
+        save_inode(index);
+    return problems;
+}
+
+/**
+ * Gives every claim after the first its own copy of a metadata block (single indirect block or directory bucket)
+ * claimed several times, or clears the pointer if the disk is full. Data blocks may be shared, by deduplication.
+ *
+ * @param refs    the reference counts of each block
+ * @param repair  whether to repair the duplicate claims
+ * @return        the number of duplicate claims found, or -1 if there is no memory for a block
+ */
+int fsck_repair_duplicates(unsigned short *refs, int repair) {
+    unsigned char claimed[NUM_DATA_BLOCKS] = {0};
+    unsigned char metadata[NUM_DATA_BLOCKS] = {0}; // Whether each block is claimed as metadata
+    for (int i = 0; i < NUM_FILES; i++) {
+        inode_t *inode = get_inode(i);
+        if (inode->size >= 0 && fsck_valid_block(inode->indirect))
+            metadata[inode->indirect] = 1;
+        for (int j = 0; inode->size >= 0 && inode->indirect == DIRECTORY && j < NUM_DIRECTORY_BUCKETS; j++) {
+            if (fsck_valid_block(inode->direct[j]))
+                metadata[inode->direct[j]] = 1;
+        }
+    }
+    int problems = 0;
+    int failed = 0; // Whether a block could not be read for lack of memory
+    for (int i = 0; i < NUM_FILES && !failed; i++) {
+        inode_t *inode = get_inode(i);
+        if (inode->size < 0 || inode->indirect == INLINE_DATA)
+            continue; // Unused, or no pointers
+        int num_pointers = NUM_DIRECT_POINTERS + 1 + NUM_INDIRECT_POINTERS_PER_BLOCK;
+        indirect_block_t *indirect = NULL;
+        int indirect_changed = 0;
+        for (int j = 0; j < num_pointers && !failed; j++) {
+            int *pointer; // Direct pointer, indirect pointer, then the pointers of the indirect block
+            if (j < NUM_DIRECT_POINTERS) {
+                pointer = &inode->direct[j];
+            } else if (j == NUM_DIRECT_POINTERS) {
+                pointer = &inode->indirect;
+            } else {
+                if (indirect == NULL) {
+                    if (!fsck_valid_block(inode->indirect))
+                        break;
+                    indirect = (indirect_block_t *) read_metadata_block(inode->indirect);
+                    if (indirect == NULL) {
+                        failed = 1;
+                        break;
+                    }
+                }
+                pointer = &indirect->inode_indices[j - NUM_DIRECT_POINTERS - 1];
+            }
+            int block_num = *pointer;
+            if (!fsck_valid_block(block_num) || refs[block_num] < 2 || !metadata[block_num])
+                continue;
+            if (!claimed[block_num]) { // The first inode keeps the block
+                claimed[block_num] = 1;
+                continue;
+            }
+            printf("fsck: inode %d: block %d is also claimed by another inode\n", i, block_num);
+            problems++;
+            if (!repair)
+                continue;
+            int is_metadata = j == NUM_DIRECT_POINTERS || inode->indirect == DIRECTORY; // Indirect block, or bucket
+            void *data = is_metadata ? read_metadata_block(block_num) : read_single_block(block_num);
+            if (data == NULL) {
+                failed = 1;
+                break;
+            }
+            journal_begin();
+            int copy = get_free_block(block_num);
+            if (copy >= 0 && copy < NUM_DATA_BLOCKS) {
+                if (is_metadata)
+                    journal_write(copy, data);
+                else
+                    write_data_blocks(copy, 1, data);
+            } else {
+                copy = -1;
+            }
+            put_block_buffer(data);
+            refs[block_num]--;
+            *pointer = copy;
+            if (j > NUM_DIRECT_POINTERS)
+                indirect_changed = 1;
+            save_inode(i);
+            journal_end();
+        }
+        if (indirect != NULL) {
+            if (indirect_changed)
+                journal_write(inode->indirect, indirect);
+            put_block_buffer(indirect);
+        }
+    }
+    return failed ? -1 : problems;
+}
+
+/**
+ * Checks the reference count of each block against the references actually found (a block with n references has a
+ * count of n - 1).
+ *
+ * @param refs    the references to each block
+ * @param repair  whether to repair the reference counts
+ * @return        the number of wrong reference counts found
+ */
+int fsck_repair_refcounts(unsigned short *refs, int repair) {
+    load_bitmaps();
+    int problems = 0;
+    for (int b = 0; b < NUM_DATA_BLOCKS; b++) {
+        int expected = refs[b] > 1 ? refs[b] - 1 : 0;
+        if (expected > MAX_EXTRA_REFS)
+            expected = MAX_EXTRA_REFS; // Only from a corrupted pointer, so leave it to the scan
+        if (fs->refcounts.bytes[b] == expected)
+            continue;
+        printf("fsck: block %d has %d references but a reference count of %d\n", b, refs[b], fs->refcounts.bytes[b]);
+        problems++;
+        if (repair)
+            fs->refcounts.bytes[b] = (unsigned char) expected;
+    }
+    if (repair && problems > 0) {
+        journal_begin();
+        save_refcounts();
+        journal_end();
+    }
+    return problems;
+}
+
+/**
+ * Checks the consistency of the mounted file system: the super block, the directory tree against the inode table,
+ * every inode and its indirect block, the FBM and reference counts against the blocks actually referenced, the WM and
+ * the mount summary. The inodes are scanned in parallel by NUM_FSCK_THREADS threads. Problems are reported on stdout.
+ *
+ * @param repair  whether to repair the problems found: invalid pointers are cleared, leaked blocks are freed,
+ *                referenced blocks are marked used, metadata blocks claimed several times are copied, and reference
+ *                counts are corrected
+ * @return        the number of problems found, or -1 if the disk does not hold an SSFS file system, or if there is no
+ *                memory for the check (which then stops before repairing anything it could not fully see)
+ */
+int ssfs_fsck(int repair) {
+    if (fs->super.magic != MAGIC || fs->super.block_size != BLOCK_SIZE || fs->super.num_blocks != NUM_DATA_BLOCKS + 3) {
+        printf("fsck: bad super block\n");
+        return -1;
+    }
+    if (flush_all() < 0)
+        return -1; // Error: no memory to flush the files
+    int problems = 0;
+
+    // Directory tree against the inode table
+    inode_t *root = get_inode(ROOT_INODE);
+    if (root->indirect != DIRECTORY || root->size != NUM_DIRECTORY_BUCKETS * BLOCK_SIZE) {
+        printf("fsck: root inode is not a directory\n");
+        problems++;
+        if (repair) { // Its blocks are freed below as leaks, and the files below it are orphans
+            journal_begin();
+            root->size = NUM_DIRECTORY_BUCKETS * BLOCK_SIZE;
+            root->indirect = DIRECTORY;
+            for (int j = 0; j < NUM_DIRECT_POINTERS; j++)
+                root->direct[j] = -1;
+            save_inode(ROOT_INODE);
+            journal_end();
+        }
+    }
+    unsigned char reached[NUM_FILES] = {0};
+    int queue[NUM_FILES];
+    int queue_start = 0;
+    int queue_end = 0;
+    reached[ROOT_INODE] = 1;
+    if (root->indirect == DIRECTORY)
+        queue[queue_end++] = ROOT_INODE;
+    while (queue_start < queue_end) {
+        int dir = queue[queue_start++];
+        inode_t *dir_inode = get_inode(dir);
+        for (int b = 0; b < NUM_DIRECTORY_BUCKETS; b++) {
+            if (!fsck_valid_block(dir_inode->direct[b]))
+                continue; // Hole, or invalid pointer (reported by the scan)
+            directory_bucket_t *bucket = (directory_bucket_t *) read_metadata_block(dir_inode->direct[b]);
+            if (bucket == NULL)
+                return -1; // Error: no memory for the bucket (the files below it would look like orphans)
+            int changed = 0;
+            for (int e = 0; e < NUM_ENTRIES_PER_BUCKET; e++) {
+                directory_entry_t *entry = &bucket->entries[e];
+                if (entry->inode <= 0)
+                    continue; // Never used, or removed
+                int i = entry->inode;
+                if (memchr(entry->filename, '\0', MAX_FILENAME_LENGTH) == NULL || entry->filename[0] == '\0') {
+                    printf("fsck: directory %d: entry %d has an invalid name\n", dir, b * NUM_ENTRIES_PER_BUCKET + e);
+                } else if (i >= NUM_FILES || get_inode(i)->size < 0) {
+                    printf("fsck: directory %d: file %s has no inode\n", dir, entry->filename);
+                } else if (reached[i]) {
+                    printf("fsck: directory %d: file %s links inode %d a second time\n", dir, entry->filename, i);
+                } else {
+                    reached[i] = 1;
+                    if (get_inode(i)->indirect == DIRECTORY)
+                        queue[queue_end++] = i;
+                    continue;
+                }
+                problems++;
+                if (repair) {
+                    entry->inode = -1; // Removed
+                    changed = 1;
+                }
+            }
+            if (changed) {
+                journal_begin();
+                journal_write(dir_inode->direct[b], bucket);
+                journal_end();
+            }
+            put_block_buffer(bucket);
+        }
+    }
+    if (repair) { // Entries may have been removed behind the caches
+        fs->path_cache.inode = -1;
+        invalidate_dentries(-1, 0);
+    }
+    int num_files = 0;
+    int high_water = ROOT_INODE + 1;
+    for (int i = ROOT_INODE + 1; i < NUM_FILES; i++) {
+        inode_t *inode = get_inode(i);
+        if (inode->size >= 0 && !reached[i]) {
+            printf("fsck: inode %d: orphan inode of size %d\n", i, inode->size);
+            problems++;
+            if (repair) { // Its blocks are freed below as leaks
+                journal_begin();
+                inode->size = -1;
+                inode->indirect = -1;
+                for (int j = 0; j < NUM_DIRECT_POINTERS; j++)
+                    inode->direct[j] = -1;
+                save_inode(i);
+                journal_end();
+            }
+        }
+        if (inode->size >= 0) {
+            num_files++;
+            high_water = i + 1;
+        }
+    }
+
+    // Parallel scan of the inodes and their indirect blocks
+    pthread_t threads[NUM_FSCK_THREADS];
+    fsck_scan_t *scans = calloc(NUM_FSCK_THREADS, sizeof(fsck_scan_t));
+    if (scans == NULL)
+        return -1; // Error: no memory for the scan
+    unsigned char bad_inodes[NUM_FILES] = {0};
+    int inodes_per_thread = (NUM_FILES + NUM_FSCK_THREADS - 1) / NUM_FSCK_THREADS;
+    for (int t = 0; t < NUM_FSCK_THREADS; t++) {
+        scans[t].first_inode = t * inodes_per_thread;
+        scans[t].end_inode = scans[t].first_inode + inodes_per_thread > NUM_FILES ? NUM_FILES :
+                             scans[t].first_inode + inodes_per_thread;
+        scans[t].bad_inodes = bad_inodes;
+        scans[t].volume = fs;
+        pthread_create(&threads[t], NULL, fsck_scan_thread, &scans[t]);
+    }
+    unsigned short refs[NUM_DATA_BLOCKS] = {0};
+    int failed = 0;
+    for (int t = 0; t < NUM_FSCK_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        for (int b = 0; b < NUM_DATA_BLOCKS; b++)
+            refs[b] += scans[t].refs[b];
+        failed |= scans[t].failed;
+    }
+    free(scans);
+    if (failed)
+        return -1; // Error: no memory for an indirect block (its blocks would look leaked)
+    for (int i = 0; i < NUM_FILES; i++) {
+        if (bad_inodes[i]) {
+            journal_begin();
+            int found = fsck_repair_inode(i, repair);
+            journal_end();
+            if (found < 0)
+                return -1; // Error: no memory for an indirect block
+            problems += found;
+        }
+    }
+
+    // FBM against the references
+    load_bitmaps();
+    int fbm_changed = 0;
+    for (int b = 0; b < NUM_DATA_BLOCKS; b++) {
+        int used = refs[b] > 0 || !fsck_valid_block(b);
+        if (used && fs->fbm.bytes[b] != 0) {
+            printf("fsck: block %d is in use but marked free\n", b);
+            problems++;
+            if (repair) {
+                fs->fbm.bytes[b] = 0;
+                fs->summary.num_free_blocks--;
+                fbm_changed = 1;
+            }
+        } else if (!used && fs->fbm.bytes[b] == 0) {
+            printf("fsck: block %d is leaked\n", b);
+            problems++;
+            if (repair) {
+                fs->fbm.bytes[b] = 1;
+                fs->summary.num_free_blocks++;
+                fbm_changed = 1;
+            }
+        }
+    }
+    if (fbm_changed) {
+        journal_begin();
+        save_fbm();
+        journal_end();
+    }
+    int duplicates = fsck_repair_duplicates(refs, repair);
+    if (duplicates < 0)
+        return -1; // Error: no memory for a block
+    problems += duplicates;
+    problems += fsck_repair_refcounts(refs, repair);
+
+    // WM and summary
+    if (fs->wm.bytes[FBM_INDEX] != 0 || fs->wm.bytes[WM_INDEX] != 0) {
+        printf("fsck: FBM or WM block marked writeable\n");
+        problems++;
+        if (repair) {
+            journal_begin();
+            fs->wm.bytes[FBM_INDEX] = 0;
+            fs->wm.bytes[WM_INDEX] = 0;
+            save_wm();
+            journal_end();
+        }
+    }
+    int num_free_blocks = scan_free_blocks();
+    if (fs->summary.num_files != num_files || fs->summary.inode_high_water != high_water ||
+        fs->summary.num_free_blocks != num_free_blocks) {
+        printf("fsck: summary has %d files up to inode %d and %d free blocks, expected %d files up to inode %d and %d "
+               "free blocks\n", fs->summary.num_files, fs->summary.inode_high_water, fs->summary.num_free_blocks,
+               num_files, high_water, num_free_blocks);
+        problems++;
+        if (repair) {
+            journal_begin();
+            fs->summary.num_files = num_files;
+            fs->summary.inode_high_water = high_water;
+            fs->summary.num_free_blocks = num_free_blocks;
+            save_summary();
+            journal_end();
+        }
+    }
+    journal_commit();
+    return problems;
+}
+
+/**
+ * Verifies the checksum of every block in use, reading runs of consecutive blocks with a single read. The journal is
+ * checkpointed first, so that every block is at its home address. Blocks that fail their checksum are reported on
+ * stdout. They cannot be repaired, since the file system keeps no second copy of them.
+ *
+ * @return  the number of blocks that fail their checksum, or -1 if the disk does not hold an SSFS file system, or if
+ *          there is no memory for the scrub
+ */
+int ssfs_scrub() {
+    if (fs->super.magic != MAGIC || fs->super.block_size != BLOCK_SIZE || fs->super.num_blocks != NUM_DATA_BLOCKS + 3)
+        return -1; // Error: bad super block
+    if (flush_all() < 0)
+        return -1; // Error: no memory to flush the files
+    journal_commit();
+    journal_checkpoint();
+    load_bitmaps();
+    block_t *blocks = malloc(READ_AHEAD_MAX_BLOCKS * BLOCK_SIZE);
+    if (blocks == NULL)
+        return -1; // Error: no memory for the blocks read
+    int corrupted = 0;
+    for (int b = 0; b < NUM_DATA_BLOCKS;) {
+        if (!checksummed(b) || fs->fbm.bytes[b] != 0) { // No checksum, or free
+            b++;
+            continue;
+        }
+        int length = 1; // Number of consecutive blocks in use
+        while (length < READ_AHEAD_MAX_BLOCKS && b + length < NUM_DATA_BLOCKS && checksummed(b + length) &&
+               fs->fbm.bytes[b + length] == 0)
+            length++;
+        int good = read_data_blocks(b, length, blocks);
+        corrupted += good < length;
+        b += good < length ? good + 1 : length; // Carry on after the block that fails
+    }
+    free(blocks);
+    return corrupted;
+}
+
+/**
+ * Measures the fragmentation of a file, as the number of extents (runs of consecutive blocks) holding its data.
+ *
+ * @param name  the path of the file
+ * @return      the number of extents of the file (0 for an empty file, 1 for a contiguous file), or -1 on failure
+ */
+int ssfs_fragmentation(char *name) {
+    int index = find_file(name);
+    if (index < 0 || get_inode(index)->indirect == DIRECTORY)
+        return -1; // Error: file not found
+    int blocks[MAX_FILE_BLOCKS];
+    int num_blocks = get_file_blocks(index, blocks);
+    return num_blocks < 0 ? -1 : count_extents(blocks, num_blocks);
+}
+
+/**
+ * Moves a block of a file to a free block, within the caller's metadata operation. The free block is taken in the FBM,
+ * and the block it leaves is freed.
+ *
+ * @param index  the index of the file
+ * @param i      the index of the block in the file
+ * @param from   the address of the block
+ * @param to     the address to move it to
+ * @param data   the data of the block
+ * @return       0 on success, or -1 if there is no memory for the file's indirect block (nothing is changed then)
+ */
+int move_file_block(int index, int i, int from, int to, block_t *data) {
+    if (set_file_block(index, i, to) < 0)
+        return -1; // Error: no memory for the indirect block
+    fs->fbm.bytes[to] = 0;
+    fs->summary.num_free_blocks--;
+    write_data_blocks(to, 1, data);
+    if (fs->dedup_index.indexed[from])
+        dedup_insert(to, fs->dedup_index.hashes[from]);
+    free_block(from);
+    save_fbm();
+    return 0;
+}
+
+/**
+ * Runs the online defragmenter for a limited number of block moves. Fragmented files are moved, one block at a time,
+ * into a run of free blocks large enough to hold them entirely (compressed files are skipped, since every flush lays
+ * out their clusters one after the other, and blocks shared with other files or failing their checksum stay where they
+ * are). Progress is kept between calls, so that the whole disk is eventually defragmented by calling this repeatedly.
+ * The journal is committed before returning, so that a block that was moved away can never be reused while the
+ * committed metadata still points to it.
+ *
+ * @param budget  the maximum number of blocks to move
+ * @return        the number of blocks moved, 0 once every file has been visited (the next call starts over), or -1 on
+ *                failure
+ */
+int ssfs_defrag(int budget) {
+    if (budget <= 0)
+        return -1; // Error: invalid budget
+    if (flush_all() < 0)
+        return -1; // Error: no memory to flush the files
+    int moved = 0;
+    int blocks[MAX_FILE_BLOCKS];
+    while (moved < budget && fs->defrag.file < fs->summary.inode_high_water) {
+        int index = fs->defrag.file;
+        inode_t *inode = get_inode(index);
+        int num_blocks = inode->size > 0 && inode->indirect != DIRECTORY && !inode->compressed ?
+                         get_file_blocks(index, blocks) : 0;
+        if (num_blocks < 0) {
+            journal_commit();
+            return -1; // Error: no memory for the indirect block (progress is kept for the next call)
+        }
+        if (fs->defrag.target < 0) { // Choose where to move the file
+            if (num_blocks == 0 || count_extents(blocks, num_blocks) <= 1 ||
+                (fs->defrag.target = find_free_run(num_blocks, home_block(index))) < 0) {
+                fs->defrag.file++; // Nothing to do, or no room to do it
+                continue;
+            }
+            fs->defrag.next_block = 0;
+        }
+        for (; fs->defrag.next_block < num_blocks && moved < budget; fs->defrag.next_block++) {
+            int from = blocks[fs->defrag.next_block];
+            int to = fs->defrag.target + fs->defrag.next_block;
+            if (from == to || from < 0 || fs->refcounts.bytes[from] > 0)
+                continue; // Already in place, a hole, or shared
+            if (fs->fbm.bytes[to] == 0) { // The run was taken by a write since the last call
+                fs->defrag.next_block = num_blocks;
+                break;
+            }
+            block_t data;
+            if (read_data_blocks(from, 1, &data) < 1)
+                continue; // Fails its checksum: left in place, rather than moved with a new checksum
+            journal_begin();
+            int failed = move_file_block(index, fs->defrag.next_block, from, to, &data) < 0;
+            journal_end();
+            if (failed) {
+                journal_commit();
+                return -1; // Error: no memory for the indirect block (progress is kept for the next call)
+            }
+            moved++;
+        }
+        if (fs->defrag.next_block >= num_blocks) { // Done with this file
+            fs->defrag.file++;
+            fs->defrag.target = -1;
+        }
+    }
+    journal_commit();
+    if (moved == 0) // Every file was visited
+        fs->defrag.file = 0;
+    return moved;
+}
+
+/**
+ * Sets whether the file system is log-structured. In log-structured mode, data blocks are never overwritten in place:
+ * every flush appends the blocks it writes at the head of the log and frees the blocks they replace, so that small
+ * random overwrites reach the disk as sequential writes. The metadata keeps going through the journal, which is
+ * already written sequentially. The layout of the disk is the same in both modes, so the mode can be changed at any
+ * time, and is kept in the super block.
+ *
+ * @param enabled  whether the file system is log-structured
+ * @return         0 on success, or -1 if no file system is mounted
+ */
+int ssfs_set_log_structured(int enabled) {
+    if (!fs->mounted)
+        return -1; // Error: no file system
+    fs->super.log_structured = enabled != 0;
+    save_super();
+    return 0; // Success: Mode set
+}
+
+/**
+ * Runs the segment cleaner for a limited number of block moves. The least used segments, other than those the log is
+ * appending to, are emptied by moving their blocks to the head of the log, so that the log finds free segments to fill
+ * sequentially. Blocks of directories and compressed files, indirect blocks, blocks shared with other files and blocks
+ * failing their checksum stay where they are. The journal is committed before returning, as in ssfs_defrag.
+ * Volumes mounted with ssfs_mount are also cleaned by their background flusher once fewer than CLEAN_MIN_FREE_SEGMENTS
+ * segments are free, but the default volume has no flusher, so its callers must clean it themselves.
+ *
+ * @param budget  the maximum number of blocks to move
+ * @return        the number of blocks moved (0 once no segment can be emptied any further), or -1 on failure
+ */
+int ssfs_clean(int budget) {
+    if (budget <= 0)
+        return -1; // Error: invalid budget
+    if (flush_all() < 0)
+        return -1; // Error: no memory to flush the files
+    int owners[BLOCK_SIZE]; // File of each block that can be moved, or -1
+    int positions[BLOCK_SIZE]; // Index of each block that can be moved in its file
+    int blocks[MAX_FILE_BLOCKS];
+    for (int i = 0; i < BLOCK_SIZE; i++)
+        owners[i] = -1;
+    for (int index = 0; index < fs->summary.inode_high_water; index++) {
+        inode_t *inode = get_inode(index);
+        int num_blocks = inode->size > 0 && inode->indirect != DIRECTORY && !inode->compressed ?
+                         get_file_blocks(index, blocks) : 0;
+        if (num_blocks < 0)
+            return -1; // Error: no memory for the indirect block
+        for (int i = 0; i < num_blocks; i++) {
+            if (blocks[i] >= 0 && fs->refcounts.bytes[blocks[i]] == 0) {
+                owners[blocks[i]] = index;
+                positions[blocks[i]] = i;
+            }
+        }
+    }
+    unsigned char done[NUM_SEGMENTS]; // Whether each segment was cleaned or written to by this call
+    memset(done, 0, NUM_SEGMENTS);
+    int moved = 0;
+    while (moved < budget) {
+        done[(log_head() - FIRST_DATA_INDEX) / SEGMENT_BLOCKS] = 1;
+        int victim = -1;
+        int victim_used = 0;
+        for (int s = 0; s < NUM_SEGMENTS; s++) {
+            int end = segment_start(s + 1) < FBM_INDEX ? segment_start(s + 1) : FBM_INDEX;
+            int used = count_segment_blocks(s);
+            if (!done[s] && used > 0 && used < end - segment_start(s) && (victim < 0 || used < victim_used)) {
+                victim = s;
+                victim_used = used;
+            }
+        }
+        if (victim < 0)
+            break; // Every segment is empty, full, or already cleaned
+        done[victim] = 1;
+        for (int from = segment_start(victim); from < segment_start(victim + 1) && from < FBM_INDEX; from++) {
+            if (moved >= budget)
+                break;
+            block_t data;
+            if (fs->fbm.bytes[from] != 0 || owners[from] < 0 || read_data_blocks(from, 1, &data) < 1)
+                continue; // Free, or stays in place
+            int head = log_head();
+            int to = -1;
+            for (int k = 0; k < FBM_INDEX - FIRST_DATA_INDEX && to < 0; k++) { // Next free block outside the victim
+                int i = FIRST_DATA_INDEX + (head - FIRST_DATA_INDEX + k) % (FBM_INDEX - FIRST_DATA_INDEX);
+                if (fs->fbm.bytes[i] != 0 && (i - FIRST_DATA_INDEX) / SEGMENT_BLOCKS != victim)
+                    to = i;
+            }
+            if (to < 0)
+                break; // No room outside the victim
+            journal_begin();
+            int failed = move_file_block(owners[from], positions[from], from, to, &data) < 0;
+            journal_end();
+            if (failed) {
+                journal_commit();
+                return -1; // Error: no memory for the indirect block
+            }
+            owners[to] = owners[from];
+            positions[to] = positions[from];
+            owners[from] = -1;
+            fs->log_head = to + 1;
+            done[(to - FIRST_DATA_INDEX) / SEGMENT_BLOCKS] = 1;
+            moved++;
+        }
+    }
+    journal_commit();
+    return moved;
+}
+
+/**
+ * Makes the calling thread serve a volume, once no other thread serves it.
+ *
+ * @param volume  the volume
+ * @return        the volume and emulator the thread served until now
+ */
+volume_context_t enter_volume(ssfs_t *volume) {
+    pthread_mutex_lock(&volume->lock);
+    volume_context_t previous = {fs, use_emulator(volume->emulator)};
+    fs = volume;
+    return previous;
+}
+
+/**
+ * Makes the calling thread serve the volume it served before entering the current one, and lets other threads serve
+ * the current one.
+ *
+ * @param previous  the volume and emulator the thread served before
+ */
+void leave_volume(volume_context_t previous) {
+    ssfs_t *volume = fs;
+    fs = previous.volume;
+    use_emulator(previous.emulator);
+    pthread_mutex_unlock(&volume->lock);
+}
+
+/**
+ * Frees a volume that is not mounted.
+ *
+ * @param volume  the volume
+ */
+void close_volume(ssfs_t *volume) {
+    pthread_cond_destroy(&volume->flusher.wake);
+    slab_drain(&volume->block_slab);
+    slab_drain(&volume->write_buffer_slab);
+    slab_drain(&volume->page_slab);
+    free_emulator(volume->emulator);
+    pthread_mutex_destroy(&volume->lock);
+    pthread_mutex_destroy(&volume->block_slab.lock);
+    pthread_mutex_destroy(&volume->write_buffer_slab.lock);
+    pthread_mutex_destroy(&volume->page_slab.lock);
+    free(volume);
+}
+
+/**
+ * Runs the segment cleaner for CLEAN_BUDGET_BLOCKS block moves if the file system is log-structured and fewer than
+ * CLEAN_MIN_FREE_SEGMENTS segments are free. Nothing is cleaned while a batch is open, since cleaning commits the
+ * journal, and a clean that moved no block is not run again until the log moves on or blocks are freed.
+ */
+void clean_in_background() {
+    flusher_t *flusher = &fs->flusher;
+    if (!fs->super.log_structured || fs->journal.num_batches > 0 || count_free_segments() >= CLEAN_MIN_FREE_SEGMENTS)
+        return;
+    if (fs->log_head == flusher->stalled_head && count_free_blocks() == flusher->stalled_free_blocks)
+        return; // Nothing changed since the last clean, which could not move anything
+    int moved = ssfs_clean(CLEAN_BUDGET_BLOCKS);
+    flusher->stalled_head = moved == 0 ? fs->log_head : -1; // A failed clean is tried again
+    flusher->stalled_free_blocks = count_free_blocks();
+}
+
+/**
+ * Runs the background flusher of a volume, until it is stopped. The thread holds the volume's lock while it writes
+ * back or cleans, and waits on it otherwise, so that it only runs between the calls made on the volume.
+ *
+ * @param arg  the volume
+ * @return     NULL
+ */
+void *flusher_thread(void *arg) {
+    ssfs_t *volume = arg;
+    pthread_mutex_lock(&volume->lock);
+    fs = volume;
+    use_emulator(volume->emulator);
+    while (!volume->flusher.stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&volume->flusher.wake, &volume->lock, &deadline);
+        if (!volume->flusher.stopping && volume->mounted) {
+            write_back();
+            clean_in_background();
+        }
+    }
+    pthread_mutex_unlock(&volume->lock);
+    return NULL;
+}
+
+/**
+ * Stops the background flusher of a volume, and waits for its thread to finish.
+ *
+ * @param volume  the volume
+ */
+void stop_flusher(ssfs_t *volume) {
+    if (!volume->flusher.running)
+        return;
+    pthread_mutex_lock(&volume->lock);
+    volume->flusher.stopping = 1;
+    pthread_cond_signal(&volume->flusher.wake);
+    pthread_mutex_unlock(&volume->lock);
+    pthread_join(volume->flusher.thread, NULL);
+    volume->flusher.running = 0;
+}
+
+/**
+ * Mounts a volume of its own, independent of the default volume and of any other volume. Calls on different volumes
+ * can be made from different threads at the same time, while the calls on one volume are carried out one at a time.
+ * Batched metadata is only committed when the volume is unmounted (or committed).
+ *
+ * @param path     the name of the first disk image of the volume (the others are named after it)
+ * @param options  whether the file system is created from scratch, and the layout of its disk images if so (NULL to
+ *                 open an existing file system)
+ * @return         the volume, or NULL on failure
+ */
+ssfs_t *ssfs_mount(char *path, ssfs_options_t *options) {
+    ssfs_options_t existing = {0, 1, DEFAULT_STRIPE_WIDTH, 0};
+    if (options == NULL)
+        options = &existing;
+    if (options->fresh && (options->num_disks < 1 || options->num_disks > MAX_DISKS || options->stripe_width < 1))
+        return NULL; // Error: Invalid layout
+    ssfs_t *volume = calloc(1, sizeof(ssfs_t));
+    if (volume == NULL)
+        return NULL; // Error: no memory for the volume
+    pthread_mutex_init(&volume->lock, NULL);
+    pthread_mutex_init(&volume->block_slab.lock, NULL);
+    pthread_mutex_init(&volume->write_buffer_slab.lock, NULL);
+    pthread_mutex_init(&volume->page_slab.lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC); // Deadlines of the flusher
+    pthread_cond_init(&volume->flusher.wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    volume->emulator = new_emulator();
+    volume_context_t previous = enter_volume(volume);
+    int result = mount_volume(path, options);
+    leave_volume(previous);
+    if (result < 0) { // Error: The disk images could not be created or opened
+        close_volume(volume);
+        return NULL;
+    }
+    volume->flusher.stalled_head = -1;
+    volume->flusher.running = pthread_create(&volume->flusher.thread, NULL, flusher_thread, volume) == 0;
+    return volume; // Success: Volume mounted
+}
+
+/**
+ * Unmounts a volume returned by ssfs_mount: its buffered data and batched metadata are written to its disk images,
+ * which are closed, and the volume is freed.
+ *
+ * @param volume  the volume
+ * @return        0 on success, or -1 if there is no memory to flush the buffered data (the volume then stays mounted,
+ *                without its background flusher, and can be unmounted again)
+ */
+int ssfs_unmount(ssfs_t *volume) {
+    stop_flusher(volume);
+    volume_context_t previous = enter_volume(volume);
+    if (fs->mounted) {
+        if (flush_all() < 0) {
+            leave_volume(previous);
+            return -1; // Error: no memory to flush the files
+        }
+        journal_commit();
+        init_ofd(); // Frees the read-ahead caches
+        close_disk();
+        fs->mounted = 0;
+    }
+    while (fs->pinned_pages != NULL) { // Pins that were never released
+        cache_page_t *page = fs->pinned_pages;
+        fs->pinned_pages = page->next_pinned;
+        free(page);
+    }
+    leave_volume(previous);
+    close_volume(volume);
     return 0;
 }
+
+int ssfs_volume_fopen(ssfs_t *volume, char *name) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fopen(name);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fclose(ssfs_t *volume, int fileID) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fclose(fileID);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fsync(ssfs_t *volume, int fileID) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fsync(fileID);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_frseek(ssfs_t *volume, int fileID, int loc) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_frseek(fileID, loc);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fwseek(ssfs_t *volume, int fileID, int loc) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fwseek(fileID, loc);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fwrite(ssfs_t *volume, int fileID, char *buf, int length) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fwrite(fileID, buf, length);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fread(ssfs_t *volume, int fileID, char *buf, int length) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fread(fileID, buf, length);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fpin(ssfs_t *volume, int fileID, int length, const char **data) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fpin(fileID, length, data);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_frelease(ssfs_t *volume, const char *data) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_frelease(data);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_remove(ssfs_t *volume, char *file) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_remove(file);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_mkdir(ssfs_t *volume, char *path) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_mkdir(path);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_rmdir(ssfs_t *volume, char *path) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_rmdir(path);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_stat(ssfs_t *volume, char *path, ssfs_stat_t *stat) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_stat(path, stat);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_statfs(ssfs_t *volume, ssfs_statfs_t *statfs) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_statfs(statfs);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_readdir(ssfs_t *volume, char *path, int *cursor, ssfs_dirent_t *entries, int max) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_readdir(path, cursor, entries, max);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_truncate(ssfs_t *volume, int fileID, int size) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_truncate(fileID, size);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fallocate(ssfs_t *volume, int fileID, int size) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fallocate(fileID, size);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_set_compression(ssfs_t *volume, int fileID, int enabled) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_set_compression(fileID, enabled);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_batch_begin(ssfs_t *volume) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_batch_begin();
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_batch_end(ssfs_t *volume) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_batch_end();
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_commit(ssfs_t *volume) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_commit();
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_restore(ssfs_t *volume, int cnum) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_restore(cnum);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fsck(ssfs_t *volume, int repair) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fsck(repair);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_scrub(ssfs_t *volume) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_scrub();
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_fragmentation(ssfs_t *volume, char *name) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_fragmentation(name);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_defrag(ssfs_t *volume, int budget) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_defrag(budget);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_set_log_structured(ssfs_t *volume, int enabled) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_set_log_structured(enabled);
+    leave_volume(previous);
+    return result;
+}
+
+int ssfs_volume_clean(ssfs_t *volume, int budget) {
+    volume_context_t previous = enter_volume(volume);
+    int result = ssfs_clean(budget);
+    leave_volume(previous);
+    return result;
+}
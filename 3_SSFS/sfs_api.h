@@ -6,13 +6,93 @@
  * April 11, 2017
  */
 
+typedef struct _ssfs_t ssfs_t; // A mounted volume
+
+typedef struct _ssfs_options_t {
+    int fresh; // Whether to create the file system from scratch (or open it)
+    int num_disks; // Number of disk images the data blocks are striped across, when fresh
+    int stripe_width; // Consecutive data blocks kept on one disk before moving on to the next, when fresh
+    int mirrored; // Whether each disk image has a mirror image, when fresh
+} ssfs_options_t;
+
+typedef struct _ssfs_stat_t {
+    int inode; // Index of the inode, which identifies the file as long as it exists
+    int size; // Size in bytes, including data not flushed yet
+    int directory; // Whether it is a directory
+    int compressed; // Whether the file is compressed
+} ssfs_stat_t;
+
+typedef struct _ssfs_dirent_t {
+    char name[60]; // Name in the directory, null-terminated
+    ssfs_stat_t stat;
+} ssfs_dirent_t;
+
+typedef struct _ssfs_statfs_t {
+    int block_size; // Size of a block in bytes
+    int num_blocks; // Number of blocks of the data area
+    int free_blocks; // Number of free blocks, not counting those reserved for buffered data
+    int num_files; // Most files and directories, not including the root directory
+    int free_files; // Number of files and directories that can still be created
+} ssfs_statfs_t;
+
 void mkssfs(int fresh);
+int ssfs_set_striping(int num_disks, int stripe_width);
+void ssfs_set_mirroring(int enabled);
 int ssfs_fopen(char *name);
 int ssfs_fclose(int fileID);
+int ssfs_fsync(int fileID);
 int ssfs_frseek(int fileID, int loc);
 int ssfs_fwseek(int fileID, int loc);
 int ssfs_fwrite(int fileID, char *buf, int length);
 int ssfs_fread(int fileID, char *buf, int length);
+int ssfs_fpin(int fileID, int length, const char **data);
+int ssfs_frelease(const char *data);
 int ssfs_remove(char *file);
+int ssfs_mkdir(char *path);
+int ssfs_rmdir(char *path);
+int ssfs_stat(char *path, ssfs_stat_t *stat);
+int ssfs_statfs(ssfs_statfs_t *statfs);
+int ssfs_readdir(char *path, int *cursor, ssfs_dirent_t *entries, int max);
+int ssfs_truncate(int fileID, int size);
+int ssfs_fallocate(int fileID, int size);
+int ssfs_set_compression(int fileID, int enabled);
+int ssfs_batch_begin();
+int ssfs_batch_end();
 int ssfs_commit();
-int ssfs_restore(int cnum);
\ No newline at end of file
+int ssfs_restore(int cnum);
+int ssfs_fsck(int repair);
+int ssfs_scrub();
+int ssfs_fragmentation(char *name);
+int ssfs_defrag(int budget);
+int ssfs_set_log_structured(int enabled);
+int ssfs_clean(int budget);
+ssfs_t *ssfs_mount(char *path, ssfs_options_t *options);
+int ssfs_unmount(ssfs_t *volume);
+int ssfs_volume_fopen(ssfs_t *volume, char *name);
+int ssfs_volume_fclose(ssfs_t *volume, int fileID);
+int ssfs_volume_fsync(ssfs_t *volume, int fileID);
+int ssfs_volume_frseek(ssfs_t *volume, int fileID, int loc);
+int ssfs_volume_fwseek(ssfs_t *volume, int fileID, int loc);
+int ssfs_volume_fwrite(ssfs_t *volume, int fileID, char *buf, int length);
+int ssfs_volume_fread(ssfs_t *volume, int fileID, char *buf, int length);
+int ssfs_volume_fpin(ssfs_t *volume, int fileID, int length, const char **data);
+int ssfs_volume_frelease(ssfs_t *volume, const char *data);
+int ssfs_volume_remove(ssfs_t *volume, char *file);
+int ssfs_volume_mkdir(ssfs_t *volume, char *path);
+int ssfs_volume_rmdir(ssfs_t *volume, char *path);
+int ssfs_volume_stat(ssfs_t *volume, char *path, ssfs_stat_t *stat);
+int ssfs_volume_statfs(ssfs_t *volume, ssfs_statfs_t *statfs);
+int ssfs_volume_readdir(ssfs_t *volume, char *path, int *cursor, ssfs_dirent_t *entries, int max);
+int ssfs_volume_truncate(ssfs_t *volume, int fileID, int size);
+int ssfs_volume_fallocate(ssfs_t *volume, int fileID, int size);
+int ssfs_volume_set_compression(ssfs_t *volume, int fileID, int enabled);
+int ssfs_volume_batch_begin(ssfs_t *volume);
+int ssfs_volume_batch_end(ssfs_t *volume);
+int ssfs_volume_commit(ssfs_t *volume);
+int ssfs_volume_restore(ssfs_t *volume, int cnum);
+int ssfs_volume_fsck(ssfs_t *volume, int repair);
+int ssfs_volume_scrub(ssfs_t *volume);
+int ssfs_volume_fragmentation(ssfs_t *volume, char *name);
+int ssfs_volume_defrag(ssfs_t *volume, int budget);
+int ssfs_volume_set_log_structured(ssfs_t *volume, int enabled);
+int ssfs_volume_clean(ssfs_t *volume, int budget);
\ No newline at end of file
@@ -0,0 +1,100 @@
+/**
+ * ECSE-427: Assignment 3
+ * Simple Shadow File System
+ *
+ * Allocation benchmark. Counts the heap allocations made by SSFS during each phase of a small workload, along with
+ * its time. The allocation functions are wrapped at link time (-Wl,--wrap), so only the calls made by the file system
+ * are counted, not those of the C library.
+ */
+
+#include "sfs_api.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BLOCK_SIZE 1024 // Size of a block of SSFS
+#define BENCH_BLOCKS 200 // Blocks of the benchmark file
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+long num_allocations = 0; // Heap allocations made since the start of the phase
+
+void *__wrap_malloc(size_t size) {
+    num_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    num_allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    num_allocations++;
+    return __real_realloc(pointer, size);
+}
+
+/**
+ * Prints the allocations made during a phase, and starts the next one.
+ *
+ * @param phase  the name of the phase
+ */
+void end_phase(char *phase) {
+    printf("%-36s %6ld\n", phase, num_allocations);
+    num_allocations = 0;
+}
+
+int main() {
+    char buf[BENCH_BLOCK_SIZE];
+    for (int i = 0; i < BENCH_BLOCK_SIZE; i++)
+        buf[i] = 'a' + i % 26;
+    mkssfs(1);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("%-36s %6s\n", "phase", "allocations");
+    num_allocations = 0;
+
+    int fd = ssfs_fopen("bench.txt");
+    for (int i = 0; i < BENCH_BLOCKS; i++) {
+        buf[0] = (char) i; // Distinct blocks, so that none is deduplicated
+        ssfs_fwrite(fd, buf, BENCH_BLOCK_SIZE);
+    }
+    ssfs_fclose(fd);
+    end_phase("sequential write, 200 x 1 KB");
+
+    fd = ssfs_fopen("bench.txt");
+    for (int r = 0; r < 20; r++) {
+        ssfs_frseek(fd, 0);
+        for (int i = 0; i < BENCH_BLOCKS; i++)
+            ssfs_fread(fd, buf, BENCH_BLOCK_SIZE);
+    }
+    end_phase("sequential read, 20 x 200 x 1 KB");
+
+    for (int i = 0; i < 2000; i++) {
+        ssfs_frseek(fd, (i * 7919) % (BENCH_BLOCKS - 1) * BENCH_BLOCK_SIZE + 100);
+        ssfs_fread(fd, buf, 300);
+    }
+    end_phase("2000 random 300-byte reads");
+
+    for (int i = 0; i < 500; i++) {
+        ssfs_fwseek(fd, (i * 7919) % (BENCH_BLOCKS - 1) * BENCH_BLOCK_SIZE + 10);
+        ssfs_fwrite(fd, buf, 100);
+    }
+    ssfs_fclose(fd);
+    end_phase("500 random 100-byte overwrites");
+
+    fd = ssfs_fopen("bench.txt");
+    for (int i = 0; i < 20; i++) {
+        ssfs_truncate(fd, (BENCH_BLOCKS - 100) * BENCH_BLOCK_SIZE + 500);
+        ssfs_fallocate(fd, BENCH_BLOCKS * BENCH_BLOCK_SIZE);
+    }
+    ssfs_fclose(fd);
+    end_phase("20 truncates and fallocates");
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%.1f ms\n", (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
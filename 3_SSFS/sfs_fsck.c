@@ -0,0 +1,25 @@
+/**
+ * ECSE-427: Assignment 3
+ * Simple Shadow File System
+ *
+ * Consistency checker for an existing SSFS disk. Run with -y to repair the problems found.
+ */
+
+#include "sfs_api.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+    int repair = argc > 1 && strcmp(argv[1], "-y") == 0;
+    mkssfs(0);
+    int problems = ssfs_fsck(repair);
+    if (problems < 0) {
+        printf("fsck: not an SSFS disk\n");
+        return 8;
+    }
+    printf("fsck: %d problem(s) found%s\n", problems, repair && problems > 0 ? " and repaired" : "");
+    if (problems == 0)
+        return 0;
+    return repair ? 1 : 4; // Same exit codes as e2fsck
+}
@@ -0,0 +1,21 @@
+/**
+ * ECSE-427: Assignment 3
+ * Simple Shadow File System
+ *
+ * Checksum scrubber for an existing SSFS disk. Every block in use is read and checked against its CRC.
+ */
+
+#include "sfs_api.h"
+
+#include <stdio.h>
+
+int main() {
+    mkssfs(0);
+    int corrupted = ssfs_scrub();
+    if (corrupted < 0) {
+        printf("scrub: not an SSFS disk\n");
+        return 8;
+    }
+    printf("scrub: %d block(s) fail their checksum\n", corrupted);
+    return corrupted == 0 ? 0 : 4;
+}
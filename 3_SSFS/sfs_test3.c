@@ -0,0 +1,1350 @@
+#include "tests.h"
+#include "disk_emu.h"
+
+#include <pthread.h>
+
+#define FBM_BLOCK 1022 //Address of the FBM on the SSFS disk
+
+//Tests for the SSFS extensions (journal, ...).
+//For all tests, -1 is considered error and 0 is considered success.
+
+/*
+Remounts the file system, so that the FBM is checkpointed to its home on the disk, and counts its free blocks.
+*/
+int count_free_blocks_on_disk(){
+  char fbm[1024];
+  int free_blocks = 0;
+  mkssfs(0);
+  read_blocks(FBM_BLOCK, 1, fbm);
+  for(int i = 0; i < 1024; i++)
+    free_blocks += fbm[i];
+  return free_blocks;
+}
+
+/*
+Writes a file and closes it in a child process that exits without running its exit handlers,
+as if it had crashed. The file should be recovered from the journal when remounting.
+*/
+int test_journal_replay(int *err_no){
+  char *file_name = "jrnl.txt";
+  char *text = rand_text(3000);
+  char *read_buf = calloc(3001, sizeof(char));
+  int temp;
+  int pid = fork();
+  if(pid == 0){
+    mkssfs(1);
+    int fd = ssfs_fopen(file_name);
+    ssfs_fwrite(fd, text, 3000);
+    ssfs_fclose(fd); //Closing commits the journal
+    _exit(0);
+  }
+  waitpid(pid, &temp, 0);
+  mkssfs(0);
+  int fd = ssfs_fopen(file_name);
+  if(ssfs_fread(fd, read_buf, 3000) != 3000 || strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: File was not recovered from the journal\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove(file_name);
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nJournal replay: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Checks a consistent file system, then marks every block free in the FBM behind the file system's back.
+ssfs_fsck should find the problems, repair them, and leave the files intact.
+*/
+int test_fsck(int *err_no){
+  char *text = rand_text(20000); //Uses the indirect block
+  char *read_buf = calloc(20001, sizeof(char));
+  char fbm[1024];
+  mkssfs(1);
+  int fd = ssfs_fopen("fsck.txt");
+  ssfs_fwrite(fd, text, 20000);
+  ssfs_fclose(fd);
+  if(ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: ssfs_fsck found problems in a consistent file system\n");
+    *err_no += 1;
+  }
+  mkssfs(0); //Replays the journal, so the FBM is at home on the disk
+  memset(fbm, 1, sizeof(fbm));
+  write_blocks(FBM_BLOCK, 1, fbm);
+  mkssfs(0);
+  if(ssfs_fsck(1) <= 0){
+    fprintf(stderr, "Error: ssfs_fsck did not find the corrupted FBM\n");
+    *err_no += 1;
+  }
+  if(ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: ssfs_fsck did not repair the corrupted FBM\n");
+    *err_no += 1;
+  }
+  fd = ssfs_fopen("fsck.txt");
+  if(ssfs_fread(fd, read_buf, 20000) != 20000 || strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: File was damaged by ssfs_fsck\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("fsck.txt");
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nFsck: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Appends to two files in turn, closing them after every block so that their blocks alternate on the disk, then
+runs the defragmenter with a small budget until it is done. Both files should end up contiguous and intact.
+*/
+int test_defrag(int *err_no){
+  char *text[2];
+  char *read_buf = calloc(16 * 1024 + 1, sizeof(char));
+  char *names[2] = {"frag1.txt", "frag2.txt"};
+  int fd[2];
+  mkssfs(1);
+  for(int i = 0; i < 2; i++)
+    text[i] = rand_text(16 * 1024);
+  for(int j = 0; j < 16; j++){
+    for(int i = 0; i < 2; i++){
+      fd[i] = ssfs_fopen(names[i]);
+      ssfs_fwrite(fd[i], text[i] + j * 1024, 1024);
+      ssfs_fclose(fd[i]);
+    }
+  }
+  for(int i = 0; i < 2; i++)
+    fd[i] = ssfs_fopen(names[i]);
+  if(ssfs_fragmentation(names[0]) < 2){
+    fprintf(stderr, "Error: Interleaved file should be fragmented\n");
+    *err_no += 1;
+  }
+  int rounds = 0;
+  while(ssfs_defrag(5) > 0 && rounds < 100)
+    rounds++;
+  for(int i = 0; i < 2; i++){
+    if(ssfs_fragmentation(names[i]) != 1){
+      fprintf(stderr, "Error: File %s has %d extents after defragmenting\n", names[i], ssfs_fragmentation(names[i]));
+      *err_no += 1;
+    }
+    ssfs_frseek(fd[i], 0);
+    if(ssfs_fread(fd[i], read_buf, 16 * 1024) != 16 * 1024 || strcmp(read_buf, text[i]) != 0){
+      fprintf(stderr, "Error: File %s was damaged by the defragmenter\n", names[i]);
+      *err_no += 1;
+    }
+    ssfs_fclose(fd[i]);
+    ssfs_remove(names[i]);
+    free(text[i]);
+  }
+  free(read_buf);
+  printf("\n-------------------------------\nDefrag: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Streams small writes to several files in turn. With delayed allocation, each file should still be
+contiguous on the disk once closed, and should read back correctly before and after closing.
+*/
+int test_delayed_allocation(int *err_no){
+  char *names[3] = {"dela1.txt", "dela2.txt", "dela3.txt"};
+  char *text[3];
+  char *read_buf = calloc(40000 + 1, sizeof(char));
+  int fd[3];
+  mkssfs(1);
+  for(int i = 0; i < 3; i++){
+    text[i] = rand_text(40000);
+    fd[i] = ssfs_fopen(names[i]);
+  }
+  for(int j = 0; j < 40000; j += 100){
+    for(int i = 0; i < 3; i++)
+      ssfs_fwrite(fd[i], text[i] + j, 100);
+  }
+  for(int i = 0; i < 3; i++){
+    if(ssfs_fread(fd[i], read_buf, 40000) != 40000 || strcmp(read_buf, text[i]) != 0){
+      fprintf(stderr, "Error: Buffered data of %s read back incorrectly\n", names[i]);
+      *err_no += 1;
+    }
+    ssfs_fclose(fd[i]);
+    if(ssfs_fragmentation(names[i]) != 1){
+      fprintf(stderr, "Error: File %s has %d extents with delayed allocation\n", names[i], ssfs_fragmentation(names[i]));
+      *err_no += 1;
+    }
+  }
+  mkssfs(0);
+  for(int i = 0; i < 3; i++){
+    fd[i] = ssfs_fopen(names[i]);
+    memset(read_buf, 0, 40000);
+    if(ssfs_fread(fd[i], read_buf, 40000) != 40000 || strcmp(read_buf, text[i]) != 0){
+      fprintf(stderr, "Error: File %s read back incorrectly after remounting\n", names[i]);
+      *err_no += 1;
+    }
+    ssfs_fclose(fd[i]);
+    ssfs_remove(names[i]);
+    free(text[i]);
+  }
+  free(read_buf);
+  printf("\n-------------------------------\nDelayed allocation: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Reads a file front to back in small chunks, then overwrites a part that is in the read-ahead cache
+with enough data to flush the write buffer. Reads should never see stale data.
+*/
+int test_read_ahead(int *err_no){
+  char *text = rand_text(100 * 1024);
+  char *new_text = rand_text(100 * 1024); //Generated before mounting, which reseeds rand()
+  char *read_buf = calloc(100 * 1024 + 1, sizeof(char));
+  mkssfs(1);
+  int fd = ssfs_fopen("ra.txt");
+  ssfs_fwrite(fd, text, 100 * 1024);
+  ssfs_fclose(fd);
+  fd = ssfs_fopen("ra.txt");
+  for(int j = 0; j < 100 * 1024; j += 100){
+    int length = 100 * 1024 - j < 100 ? 100 * 1024 - j : 100;
+    if(ssfs_fread(fd, read_buf + j, length) != length){
+      fprintf(stderr, "Error: Sequential read failed at %d\n", j);
+      *err_no += 1;
+      break;
+    }
+  }
+  if(strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: Sequential reads returned wrong data\n");
+    *err_no += 1;
+  }
+  ssfs_frseek(fd, 0);
+  ssfs_fread(fd, read_buf, 1000); //Caches the first blocks
+  ssfs_fwseek(fd, 0);
+  ssfs_fwrite(fd, new_text, 100 * 1024); //Overwrite everything, flushing the write buffer along the way
+  ssfs_frseek(fd, 0);
+  if(ssfs_fread(fd, read_buf, 100 * 1024) != 100 * 1024 || strcmp(read_buf, new_text) != 0){
+    fprintf(stderr, "Error: Read returned stale data after an overwrite\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("ra.txt");
+  free(read_buf);
+  free(new_text);
+  free(text);
+  printf("\n-------------------------------\nRead-ahead: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Writes a byte at the start of a file and 100 bytes far past its end, leaving a hole that should read as zeros
+and take no blocks on the disk (only the two written blocks and the single indirect block).
+*/
+int test_sparse_file(int *err_no){
+  char *text = rand_text(100);
+  char *read_buf = calloc(200 * 1024 + 100, sizeof(char));
+  mkssfs(1);
+  int free_blocks = count_free_blocks_on_disk();
+  int fd = ssfs_fopen("hole.txt");
+  ssfs_fwrite(fd, "A", 1);
+  if(ssfs_fwseek(fd, 200 * 1024) != 0 || ssfs_fwrite(fd, text, 100) != 100){
+    fprintf(stderr, "Error: Could not write past the end of the file\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  free_blocks -= count_free_blocks_on_disk();
+  if(free_blocks != 3){
+    fprintf(stderr, "Error: Sparse file takes %d blocks instead of 3\n", free_blocks);
+    *err_no += 1;
+  }
+  fd = ssfs_fopen("hole.txt");
+  if(ssfs_fread(fd, read_buf, 200 * 1024 + 100) != 200 * 1024 + 100 || read_buf[0] != 'A' ||
+     memcmp(read_buf + 200 * 1024, text, 100) != 0){
+    fprintf(stderr, "Error: Sparse file read back incorrectly\n");
+    *err_no += 1;
+  }
+  for(int i = 1; i < 200 * 1024; i++){
+    if(read_buf[i] != 0){
+      fprintf(stderr, "Error: Hole does not read as zeros at %d\n", i);
+      *err_no += 1;
+      break;
+    }
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("hole.txt");
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nSparse file: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Truncates a file using the indirect block down to a few blocks, then grows it again: its blocks past the new end
+should be freed, and the grown part should read as zeros. Then preallocates a file and appends to it block by block
+in turn with another file: the preallocated file should stay contiguous.
+*/
+int test_truncate_fallocate(int *err_no){
+  char *text = rand_text(40 * 1024);
+  char *read_buf = calloc(40 * 1024 + 1, sizeof(char));
+  mkssfs(1);
+  int free_blocks = count_free_blocks_on_disk();
+  int fd = ssfs_fopen("trnc.txt");
+  ssfs_fwrite(fd, text, 20000);
+  if(ssfs_truncate(fd, 5000) != 0 || ssfs_truncate(fd, 8000) != 0){
+    fprintf(stderr, "Error: ssfs_truncate failed\n");
+    *err_no += 1;
+  }
+  if(ssfs_fread(fd, read_buf, 20000) != 8000 || strncmp(read_buf, text, 5000) != 0){
+    fprintf(stderr, "Error: Truncated file read back incorrectly\n");
+    *err_no += 1;
+  }
+  for(int i = 5000; i < 8000; i++){
+    if(read_buf[i] != 0){
+      fprintf(stderr, "Error: Grown part of a truncated file does not read as zeros at %d\n", i);
+      *err_no += 1;
+      break;
+    }
+  }
+  ssfs_fclose(fd);
+  if(free_blocks - count_free_blocks_on_disk() != 5){
+    fprintf(stderr, "Error: Truncated file does not take 5 blocks\n");
+    *err_no += 1;
+  }
+  ssfs_remove("trnc.txt");
+
+  ssfs_fclose(ssfs_fopen("pre.txt"));
+  free_blocks = count_free_blocks_on_disk();
+  fd = ssfs_fopen("pre.txt");
+  ssfs_fwrite(fd, text, 2000);
+  if(ssfs_fallocate(fd, 30 * 1024) != 0 || ssfs_truncate(fd, 1000) != 0){
+    fprintf(stderr, "Error: ssfs_truncate failed on a preallocated file\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  if(free_blocks - count_free_blocks_on_disk() != 1){
+    fprintf(stderr, "Error: Truncate does not free the blocks preallocated past the end of a file\n");
+    *err_no += 1;
+  }
+  ssfs_remove("pre.txt");
+
+  fd = ssfs_fopen("falc.txt");
+  if(ssfs_fallocate(fd, 40 * 1024) != 0){
+    fprintf(stderr, "Error: ssfs_fallocate failed\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  for(int j = 0; j < 40; j++){
+    fd = ssfs_fopen("falc.txt");
+    ssfs_fwrite(fd, text + j * 1024, 1024);
+    ssfs_fclose(fd);
+    fd = ssfs_fopen("other.txt");
+    ssfs_fwrite(fd, text, 1024);
+    ssfs_fclose(fd);
+  }
+  if(ssfs_fragmentation("falc.txt") != 1){
+    fprintf(stderr, "Error: Preallocated file has %d extents\n", ssfs_fragmentation("falc.txt"));
+    *err_no += 1;
+  }
+  if(ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: ssfs_fsck found problems with truncated and preallocated files\n");
+    *err_no += 1;
+  }
+  fd = ssfs_fopen("falc.txt");
+  memset(read_buf, 0, 40 * 1024);
+  if(ssfs_fread(fd, read_buf, 40 * 1024) != 40 * 1024 || strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: Preallocated file read back incorrectly\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("falc.txt");
+  ssfs_remove("other.txt");
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nTruncate and fallocate: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Creates tiny files, which should be stored in their inodes and take no blocks, then appends to one of them until it
+needs blocks. Every file should read back correctly, before and after remounting.
+*/
+int test_inline_data(int *err_no){
+  char names[10][10];
+  char *text[10];
+  char *big_text = rand_text(3000);
+  char *read_buf = calloc(3001, sizeof(char));
+  mkssfs(1);
+  int free_blocks = count_free_blocks_on_disk();
+  for(int i = 0; i < 10; i++){
+    sprintf(names[i], "tiny%d.txt", i);
+    text[i] = rand_text(5 * i + 1);
+    int fd = ssfs_fopen(names[i]);
+    ssfs_fwrite(fd, text[i], 5 * i); //Two writes, so the second one starts from the inode
+    ssfs_fclose(fd);
+    fd = ssfs_fopen(names[i]);
+    ssfs_fwrite(fd, text[i] + 5 * i, 1);
+    ssfs_fclose(fd);
+  }
+  if(count_free_blocks_on_disk() != free_blocks){
+    fprintf(stderr, "Error: Tiny files take %d blocks\n", free_blocks - count_free_blocks_on_disk());
+    *err_no += 1;
+  }
+  int fd = ssfs_fopen(names[9]);
+  memcpy(big_text, text[9], 46);
+  ssfs_fwrite(fd, big_text + 46, 3000 - 46);
+  ssfs_fclose(fd);
+  for(int i = 0; i < 10; i++){
+    fd = ssfs_fopen(names[i]);
+    char *expected = i == 9 ? big_text : text[i];
+    memset(read_buf, 0, 3001);
+    if(ssfs_fread(fd, read_buf, 3000) != (int) strlen(expected) || strcmp(read_buf, expected) != 0){
+      fprintf(stderr, "Error: Tiny file %s read back incorrectly\n", names[i]);
+      *err_no += 1;
+    }
+    ssfs_fclose(fd);
+    ssfs_remove(names[i]);
+    free(text[i]);
+  }
+  if(count_free_blocks_on_disk() != free_blocks){
+    fprintf(stderr, "Error: Removing tiny files leaked %d blocks\n", free_blocks - count_free_blocks_on_disk());
+    *err_no += 1;
+  }
+  free(read_buf);
+  free(big_text);
+  printf("\n-------------------------------\nInline data: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_directories(int *err_no){
+  char *long_name = "projects/ssfs/a_file_name_much_longer_than_the_old_ten_characters.txt";
+  char *text = rand_text(2000);
+  char *read_buf = calloc(2001, sizeof(char));
+  char name[64];
+  mkssfs(1);
+  int free_blocks = count_free_blocks_on_disk();
+  if(ssfs_mkdir("projects") < 0 || ssfs_mkdir("projects/ssfs") < 0 || ssfs_mkdir("projects") >= 0){
+    fprintf(stderr, "Error: Could not create directories\n");
+    *err_no += 1;
+  }
+  int fd = ssfs_fopen(long_name);
+  ssfs_fwrite(fd, text, 2000);
+  ssfs_fclose(fd);
+  for(int i = 0; i < 100; i++){
+    sprintf(name, "projects/many/file%d.txt", i);
+    if(i == 0 && ssfs_fopen(name) >= 0){
+      fprintf(stderr, "Error: Opened a file in a missing directory\n");
+      *err_no += 1;
+      ssfs_mkdir("projects/many");
+    }
+    if(i == 0)
+      ssfs_mkdir("projects/many");
+    fd = ssfs_fopen(name);
+    if(fd < 0){
+      fprintf(stderr, "Error: Could not create %s\n", name);
+      *err_no += 1;
+    }
+    ssfs_fclose(fd);
+  }
+  if(ssfs_remove("projects/ssfs") >= 0 || ssfs_rmdir("projects/ssfs") >= 0 || ssfs_fopen("projects") >= 0){
+    fprintf(stderr, "Error: Directory treated as a file, or non-empty directory removed\n");
+    *err_no += 1;
+  }
+  mkssfs(0);
+  fd = ssfs_fopen(long_name);
+  if(fd < 0 || ssfs_fread(fd, read_buf, 2000) != 2000 || memcmp(read_buf, text, 2000) != 0){
+    fprintf(stderr, "Error: File in a directory read back incorrectly\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  if(ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: fsck found problems in the directory tree\n");
+    *err_no += 1;
+  }
+  for(int i = 0; i < 100; i++){
+    sprintf(name, "/projects//many/file%d.txt", i); //Extra slashes are ignored
+    if(ssfs_remove(name) < 0){
+      fprintf(stderr, "Error: Could not remove %s\n", name);
+      *err_no += 1;
+    }
+  }
+  ssfs_remove(long_name);
+  if(ssfs_rmdir("projects/many") < 0 || ssfs_rmdir("projects/ssfs") < 0 || ssfs_rmdir("projects") < 0){
+    fprintf(stderr, "Error: Could not remove empty directories\n");
+    *err_no += 1;
+  }
+  if(count_free_blocks_on_disk() != free_blocks){
+    fprintf(stderr, "Error: Removing directories leaked %d blocks\n", free_blocks - count_free_blocks_on_disk());
+    *err_no += 1;
+  }
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nDirectories: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_lookup_cache(int *err_no){
+  char *text = rand_text(100);
+  char *read_buf = calloc(101, sizeof(char));
+  mkssfs(1);
+  ssfs_mkdir("cache");
+  if(ssfs_remove("cache/missing.txt") >= 0 || ssfs_remove("cache/missing.txt") >= 0){ //Negative lookups
+    fprintf(stderr, "Error: Removed a missing file\n");
+    *err_no += 1;
+  }
+  int fd = ssfs_fopen("cache/missing.txt"); //Created in the slot remembered by the negative lookup
+  ssfs_fwrite(fd, text, 100);
+  ssfs_fclose(fd);
+  for(int i = 0; i < 50; i++){
+    fd = ssfs_fopen("cache/missing.txt");
+    ssfs_fclose(fd);
+  }
+  mkssfs(0); //Lookups cached before the remount must not be used
+  fd = ssfs_fopen("cache/missing.txt");
+  if(fd < 0 || ssfs_fread(fd, read_buf, 100) != 100 || memcmp(read_buf, text, 100) != 0){
+    fprintf(stderr, "Error: File created after a negative lookup read back incorrectly\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("cache/missing.txt");
+  fd = ssfs_fopen("cache/missing.txt");
+  if(fd < 0 || ssfs_fread(fd, read_buf, 100) != 0){
+    fprintf(stderr, "Error: Removed file still found through the lookup cache\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("cache/missing.txt");
+  ssfs_rmdir("cache");
+  ssfs_mkdir("cache"); //Likely the same inode as the removed directory
+  if(ssfs_remove("cache/missing.txt") >= 0 || ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: Lookup cache survived its directory\n");
+    *err_no += 1;
+  }
+  ssfs_rmdir("cache");
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nLookup cache: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_compression(int *err_no){
+  int size = 20000;
+  char *text = calloc(size + 1, sizeof(char));
+  for(int i = 0; (int) strlen(text) + 64 < size; i++) //Highly compressible text
+    sprintf(text + strlen(text), "line %d: the quick brown fox jumps over the lazy dog\n", i);
+  memset(text + strlen(text), '.', size - strlen(text));
+  char *patch = rand_text(300);
+  char *noise = rand_text(5000); //Random text does not compress
+  char *read_buf = calloc(size + 1, sizeof(char));
+  mkssfs(1);
+  int free_blocks = count_free_blocks_on_disk();
+  int fd = ssfs_fopen("comp.txt");
+  int fd2 = ssfs_fopen("noise.txt");
+  if(ssfs_set_compression(fd, 1) < 0 || ssfs_set_compression(fd2, 1) < 0){
+    fprintf(stderr, "Error: Could not turn compression on\n");
+    *err_no += 1;
+  }
+  for(int i = 0; i < size; i += 1000)
+    ssfs_fwrite(fd, text + i, 1000);
+  ssfs_fwrite(fd2, noise, 5000);
+  ssfs_fclose(fd);
+  ssfs_fclose(fd2);
+  int used = free_blocks - count_free_blocks_on_disk();
+  if(used > size / 1024 / 2 + 5 + 1){
+    fprintf(stderr, "Error: Compressed files take %d blocks\n", used);
+    *err_no += 1;
+  }
+  fd = ssfs_fopen("comp.txt");
+  ssfs_fwseek(fd, 5000); //Overwrite part of a compressed cluster
+  ssfs_fwrite(fd, patch, 300);
+  memcpy(text + 5000, patch, 300);
+  if(ssfs_set_compression(fd, 0) >= 0 || ssfs_fallocate(fd, size + 5000) >= 0){
+    fprintf(stderr, "Error: Changed the layout of a compressed file\n");
+    *err_no += 1;
+  }
+  ssfs_truncate(fd, 9500); //Cuts a cluster
+  text[9500] = '\0';
+  ssfs_fclose(fd);
+  mkssfs(0);
+  fd = ssfs_fopen("comp.txt");
+  fd2 = ssfs_fopen("noise.txt");
+  if(ssfs_fread(fd, read_buf, size) != 9500 || strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: Compressed file read back incorrectly\n");
+    *err_no += 1;
+  }
+  memset(read_buf, 0, size + 1);
+  ssfs_frseek(fd2, 1234);
+  if(ssfs_fread(fd2, read_buf, 3000) != 3000 || memcmp(read_buf, noise + 1234, 3000) != 0){
+    fprintf(stderr, "Error: Incompressible file read back incorrectly\n");
+    *err_no += 1;
+  }
+  if(ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: fsck found problems in compressed files\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_fclose(fd2);
+  ssfs_remove("comp.txt");
+  ssfs_remove("noise.txt");
+  if(count_free_blocks_on_disk() != free_blocks){
+    fprintf(stderr, "Error: Removing compressed files leaked %d blocks\n", free_blocks - count_free_blocks_on_disk());
+    *err_no += 1;
+  }
+  free(read_buf);
+  free(noise);
+  free(patch);
+  free(text);
+  printf("\n-------------------------------\nCompression: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Writes the same block many times over two files, which should take a single block on the disk. Overwriting part of
+a shared block copies it, and removing the files frees their blocks with their last reference.
+*/
+int test_dedup(int *err_no){
+  int size = 8 * 1024;
+  char *block = rand_text(1024);
+  char *patch = rand_text(100);
+  char *text = calloc(size + 1, sizeof(char));
+  for(int i = 0; i < size; i += 1024)
+    memcpy(text + i, block, 1024);
+  char *patched = strdup(text);
+  memcpy(patched + 3000, patch, 100);
+  char *read_buf = calloc(size + 1, sizeof(char));
+  mkssfs(1);
+  int free_blocks = count_free_blocks_on_disk();
+  int fd = ssfs_fopen("dup1.txt");
+  int fd2 = ssfs_fopen("dup2.txt");
+  ssfs_fwrite(fd, text, size);
+  ssfs_fclose(fd);
+  ssfs_fwrite(fd2, text, size);
+  ssfs_fclose(fd2);
+  int used = free_blocks - count_free_blocks_on_disk();
+  if(used != 1){
+    fprintf(stderr, "Error: Duplicate blocks take %d blocks instead of 1\n", used);
+    *err_no += 1;
+  }
+  fd2 = ssfs_fopen("dup2.txt");
+  ssfs_fwseek(fd2, 3000); //Copy on write of a shared block
+  ssfs_fwrite(fd2, patch, 100);
+  ssfs_fclose(fd2);
+  mkssfs(0);
+  fd = ssfs_fopen("dup1.txt");
+  fd2 = ssfs_fopen("dup2.txt");
+  if(ssfs_fread(fd, read_buf, size) != size || strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: Shared blocks changed by a write to another file\n");
+    *err_no += 1;
+  }
+  if(ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: fsck found problems in shared blocks\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("dup1.txt");
+  memset(read_buf, 0, size + 1);
+  if(ssfs_fread(fd2, read_buf, size) != size || strcmp(read_buf, patched) != 0){
+    fprintf(stderr, "Error: Shared blocks freed while still referenced\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd2);
+  ssfs_remove("dup2.txt");
+  if(count_free_blocks_on_disk() != free_blocks){
+    fprintf(stderr, "Error: Removing shared blocks leaked %d blocks\n", free_blocks - count_free_blocks_on_disk());
+    *err_no += 1;
+  }
+  free(read_buf);
+  free(patched);
+  free(text);
+  free(patch);
+  free(block);
+  printf("\n-------------------------------\nDeduplication: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Flips a bit of a file's block directly on the disk. Reads of that block should fail, while the blocks before it still
+read, the scrub should find it, and overwriting the block should clear the error.
+*/
+int test_checksums(int *err_no){
+  int size = 3 * 1024;
+  char *text = rand_text(size);
+  char *read_buf = calloc(size + 1, sizeof(char));
+  char block[1024];
+  mkssfs(1);
+  int fd = ssfs_fopen("crc.txt");
+  ssfs_fwrite(fd, text, size);
+  ssfs_fclose(fd);
+  mkssfs(0); //Checkpoints everything to the disk
+  if(ssfs_scrub() != 0){
+    fprintf(stderr, "Error: Scrub found corrupted blocks on a clean disk\n");
+    *err_no += 1;
+  }
+  int address = -1;
+  for(int i = 0; i < 1024 && address < 0; i++){ //Find the second block of the file
+    read_blocks(i, 1, block);
+    if(memcmp(block, text + 1024, 1024) == 0)
+      address = i;
+  }
+  if(address < 0){
+    fprintf(stderr, "Error: Could not find the file's block on the disk\n");
+    *err_no += 1;
+    address = 1021; //A free block, which the reads below never use
+  }
+  block[100] ^= 1;
+  write_blocks(address, 1, block);
+  fd = ssfs_fopen("crc.txt");
+  if(ssfs_fread(fd, read_buf, 1024) != 1024 || memcmp(read_buf, text, 1024) != 0){
+    fprintf(stderr, "Error: Could not read the block before a corrupted block\n");
+    *err_no += 1;
+  }
+  if(ssfs_fread(fd, read_buf, 1024) != -1){
+    fprintf(stderr, "Error: Read a corrupted block\n");
+    *err_no += 1;
+  }
+  if(ssfs_scrub() != 1){
+    fprintf(stderr, "Error: Scrub did not find the corrupted block\n");
+    *err_no += 1;
+  }
+  ssfs_fwseek(fd, 1024); //Overwrite the whole block
+  ssfs_fwrite(fd, text + 1024, 1024);
+  ssfs_fclose(fd);
+  mkssfs(0);
+  fd = ssfs_fopen("crc.txt");
+  if(ssfs_fread(fd, read_buf, size) != size || memcmp(read_buf, text, size) != 0 || ssfs_scrub() != 0){
+    fprintf(stderr, "Error: Overwriting a corrupted block did not repair it\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nChecksums: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Stripes a file system across three disk images. A file should read back the same after a remount, with some of its
+blocks on the second disk, and the file system should still check out clean.
+*/
+int test_striping(int *err_no){
+  int size = 40 * 1024;
+  char *text = rand_text(size);
+  char *read_buf = calloc(size + 1, sizeof(char));
+  char block[1024];
+  if(ssfs_set_striping(0, 4) != -1 || ssfs_set_striping(MAX_DISKS + 1, 4) != -1 || ssfs_set_striping(2, 0) != -1){
+    fprintf(stderr, "Error: Accepted an invalid striping\n");
+    *err_no += 1;
+  }
+  ssfs_set_striping(3, 4);
+  mkssfs(1);
+  int fd = ssfs_fopen("striped.txt");
+  ssfs_fwrite(fd, text, size);
+  ssfs_fclose(fd);
+  mkssfs(0);
+  fd = ssfs_fopen("striped.txt");
+  if(ssfs_fread(fd, read_buf, size) != size || strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: Striped file did not read back\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  int found = 0;
+  for(int i = 0; i < 1024 && !found; i++){
+    read_disk_blocks(1, i, 1, block);
+    for(int j = 0; j < size && !found; j += 1024)
+      found = memcmp(block, text + j, 1024) == 0;
+  }
+  if(!found){
+    fprintf(stderr, "Error: No block of the striped file is on the second disk\n");
+    *err_no += 1;
+  }
+  if(ssfs_fsck(0) != 0 || ssfs_scrub() != 0){
+    fprintf(stderr, "Error: Striped file system does not check out clean\n");
+    *err_no += 1;
+  }
+  ssfs_set_striping(1, 4);
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nStriping: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Mirrors the disk, then makes every transfer on the first image fail. Reads should fail over to the mirror, and writes
+should leave the first image out of the mirror while still reading back. Closing the disk rebuilds the stale image.
+*/
+int test_mirroring(int *err_no){
+  int size = 10 * 1024;
+  char *text = rand_text(size);
+  char *text2 = rand_text(size);
+  char *read_buf = calloc(size + 1, sizeof(char));
+  ssfs_set_mirroring(1);
+  mkssfs(1);
+  int fd = ssfs_fopen("mirrored.txt");
+  ssfs_fwrite(fd, text, size);
+  ssfs_fclose(fd);
+  mkssfs(0);
+  set_failure_rate(0, 0, 2.0); //Every transfer on the first image fails
+  fd = ssfs_fopen("mirrored.txt");
+  if(ssfs_fread(fd, read_buf, size) != size || strcmp(read_buf, text) != 0){
+    fprintf(stderr, "Error: Reads did not fail over to the mirror\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  fd = ssfs_fopen("mirrored2.txt");
+  ssfs_fwrite(fd, text2, size);
+  ssfs_fclose(fd);
+  ssfs_commit();
+  set_failure_rate(0, 0, -1.0); //The first image is stale, and should stay out of the mirror
+  fd = ssfs_fopen("mirrored2.txt");
+  memset(read_buf, 0, size + 1);
+  if(ssfs_fread(fd, read_buf, size) != size || strcmp(read_buf, text2) != 0){
+    fprintf(stderr, "Error: Read stale data from a replica that missed a write\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  mkssfs(0); //Rebuilds the first image
+  fd = ssfs_fopen("mirrored2.txt");
+  memset(read_buf, 0, size + 1);
+  if(ssfs_fread(fd, read_buf, size) != size || strcmp(read_buf, text2) != 0 || ssfs_fsck(0) != 0 || ssfs_scrub() != 0){
+    fprintf(stderr, "Error: The stale replica was not rebuilt\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_set_mirroring(0);
+  free(read_buf);
+  free(text2);
+  free(text);
+  printf("\n-------------------------------\nMirroring: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Work of one thread of test_volumes: writes a file to its own volume, then reads it back.
+*/
+typedef struct {
+  ssfs_t *volume;
+  char *text;
+  int size;
+  int ok;
+} volume_work_t;
+
+void *volume_worker(void *arg){
+  volume_work_t *work = arg;
+  char *read_buf = calloc(work->size + 1, sizeof(char));
+  ssfs_volume_mkdir(work->volume, "dir");
+  int fd = ssfs_volume_fopen(work->volume, "dir/same_name.txt");
+  for(int i = 0; i < work->size; i += 1000) //Many small calls, to interleave with the other thread
+    ssfs_volume_fwrite(work->volume, fd, work->text + i, work->size - i < 1000 ? work->size - i : 1000);
+  work->ok = ssfs_volume_fread(work->volume, fd, read_buf, work->size) == work->size &&
+             strcmp(read_buf, work->text) == 0;
+  ssfs_volume_fclose(work->volume, fd);
+  free(read_buf);
+  return NULL;
+}
+
+/*
+Mounts two volumes and writes a file of the same name to each from its own thread. Each volume should keep its own
+file, across an unmount, and the default volume should be left alone.
+*/
+int test_volumes(int *err_no){
+  int size = 30 * 1024;
+  ssfs_options_t fresh = {1, 1, 4, 0};
+  ssfs_options_t invalid = {1, 0, 4, 0};
+  volume_work_t works[2] = {{NULL, rand_text(size), size, 0}, {NULL, rand_text(size), size, 0}};
+  char *read_buf = calloc(size + 1, sizeof(char));
+  pthread_t threads[2];
+  mkssfs(1);
+  int default_fd = ssfs_fopen("default.txt");
+  ssfs_fwrite(default_fd, works[0].text, 100);
+  if(ssfs_mount("volume_a", &invalid) != NULL || ssfs_mount("no_such_volume", NULL) != NULL){
+    fprintf(stderr, "Error: Mounted a volume that does not exist, or with an invalid layout\n");
+    *err_no += 1;
+  }
+  works[0].volume = ssfs_mount("volume_a", &fresh);
+  fresh.num_disks = 2; //The second volume is striped
+  works[1].volume = ssfs_mount("volume_b", &fresh);
+  for(int i = 0; i < 2; i++)
+    pthread_create(&threads[i], NULL, volume_worker, &works[i]);
+  for(int i = 0; i < 2; i++){
+    pthread_join(threads[i], NULL);
+    if(!works[i].ok){
+      fprintf(stderr, "Error: Could not read back a file written to volume %d\n", i);
+      *err_no += 1;
+    }
+    ssfs_unmount(works[i].volume);
+  }
+  for(int i = 0; i < 2; i++){
+    ssfs_t *volume = ssfs_mount(i == 0 ? "volume_a" : "volume_b", NULL);
+    int fd = volume == NULL ? -1 : ssfs_volume_fopen(volume, "dir/same_name.txt");
+    memset(read_buf, 0, size + 1);
+    if(fd < 0 || ssfs_volume_fread(volume, fd, read_buf, size) != size || strcmp(read_buf, works[i].text) != 0 ||
+       ssfs_volume_fsck(volume, 0) != 0){
+      fprintf(stderr, "Error: Volume %d did not keep its own file across an unmount\n", i);
+      *err_no += 1;
+    }
+    if(volume != NULL)
+      ssfs_unmount(volume);
+  }
+  memset(read_buf, 0, size + 1);
+  ssfs_frseek(default_fd, 0);
+  if(ssfs_fread(default_fd, read_buf, size) != 100 || strncmp(read_buf, works[0].text, 100) != 0 ||
+     ssfs_fopen("dir/same_name.txt") != -1){
+    fprintf(stderr, "Error: Other volumes changed the default volume\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(default_fd);
+  remove("volume_a");
+  remove("volume_b");
+  remove("volume_b.1");
+  free(read_buf);
+  free(works[0].text);
+  free(works[1].text);
+  printf("\n-------------------------------\nVolumes: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Reads a file through pinned cache pages, chunk by chunk. The chunks should hold the file, and stay unchanged by a
+later write to the file until they are released. A tiny file stored in its inode should pin too.
+*/
+int test_zero_copy(int *err_no){
+  int size = 40 * 1024;
+  char *text = rand_text(size);
+  char *patch = rand_text(2000);
+  const char *chunks[64];
+  int lengths[64];
+  int num_chunks = 0;
+  int done = 0;
+  const char *tiny_data;
+  char read_buf[2000];
+  mkssfs(1);
+  int fd = ssfs_fopen("pinned.txt");
+  ssfs_fwrite(fd, text, size);
+  ssfs_fclose(fd);
+  int tiny = ssfs_fopen("tiny.txt");
+  ssfs_fwrite(tiny, "tiny file in an inode", 21);
+  fd = ssfs_fopen("pinned.txt");
+  while(num_chunks < 64 && (lengths[num_chunks] = ssfs_fpin(fd, size - done, &chunks[num_chunks])) > 0){
+    if(memcmp(chunks[num_chunks], text + done, lengths[num_chunks]) != 0){
+      fprintf(stderr, "Error: Pinned chunk %d does not hold the file's data\n", num_chunks);
+      *err_no += 1;
+    }
+    done += lengths[num_chunks++];
+  }
+  if(done != size || num_chunks < 2){
+    fprintf(stderr, "Error: Pinned %d bytes in %d chunks instead of the whole file\n", done, num_chunks);
+    *err_no += 1;
+  }
+  ssfs_fwseek(fd, 0);
+  ssfs_fwrite(fd, patch, 2000);
+  ssfs_commit();
+  ssfs_frseek(fd, 0); //Refills the cache of the file
+  if(ssfs_fread(fd, read_buf, 2000) != 2000 || memcmp(read_buf, patch, 2000) != 0){
+    fprintf(stderr, "Error: Could not read a write made while chunks are pinned\n");
+    *err_no += 1;
+  }
+  if(num_chunks > 0 && memcmp(chunks[0], text, lengths[0]) != 0){
+    fprintf(stderr, "Error: A write changed a pinned chunk\n");
+    *err_no += 1;
+  }
+  for(int i = 0; i < num_chunks; i++){
+    if(ssfs_frelease(chunks[i]) != 0){
+      fprintf(stderr, "Error: Could not release pinned chunk %d\n", i);
+      *err_no += 1;
+    }
+  }
+  if(num_chunks > 0 && ssfs_frelease(chunks[0]) != -1){
+    fprintf(stderr, "Error: Released a chunk twice\n");
+    *err_no += 1;
+  }
+  ssfs_frseek(tiny, 0);
+  if(ssfs_fpin(tiny, 100, &tiny_data) != 21 || memcmp(tiny_data, "tiny file in an inode", 21) != 0 ||
+     ssfs_frelease(tiny_data) != 0){
+    fprintf(stderr, "Error: Could not pin a tiny file\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(tiny);
+  ssfs_fclose(fd);
+  free(patch);
+  free(text);
+  printf("\n-------------------------------\nZero-copy: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_batch(int *err_no){
+  char name[32];
+  mkssfs(1);
+  if(ssfs_batch_end() != -1){
+    fprintf(stderr, "Error: Closed a batch that was never opened\n");
+    *err_no += 1;
+  }
+  ssfs_batch_begin();
+  ssfs_mkdir("batch");
+  ssfs_batch_begin(); //Nested
+  for(int i = 0; i < 150; i++){
+    sprintf(name, "batch/file%d", i);
+    ssfs_fclose(ssfs_fopen(name));
+  }
+  ssfs_batch_end();
+  for(int i = 0; i < 150; i += 3){
+    sprintf(name, "batch/file%d", i);
+    ssfs_remove(name);
+  }
+  if(ssfs_batch_end() != 0){
+    fprintf(stderr, "Error: Could not close a batch\n");
+    *err_no += 1;
+  }
+  mkssfs(0); //The batch must be on the disk
+  for(int i = 0; i < 150; i++){
+    sprintf(name, "batch/file%d", i);
+    if(ssfs_remove(name) != (i % 3 == 0 ? -1 : 0)){
+      fprintf(stderr, "Error: File %s is %s after a batch\n", name, i % 3 == 0 ? "back" : "missing");
+      *err_no += 1;
+    }
+  }
+  if(ssfs_rmdir("batch") != 0 || ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: The file system is not consistent after a batch\n");
+    *err_no += 1;
+  }
+  printf("\n-------------------------------\nBatch: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_readdir(int *err_no){
+  char name[64];
+  char buf[100];
+  int seen[60] = {0};
+  ssfs_dirent_t entries[7];
+  ssfs_stat_t stat;
+  int cursor = 0;
+  int count;
+  mkssfs(1);
+  ssfs_mkdir("listed");
+  for(int i = 0; i < 60; i++){
+    sprintf(name, "listed/file%d", i);
+    int fd = ssfs_fopen(name);
+    ssfs_fwrite(fd, buf, i);
+  }
+  ssfs_mkdir("listed/sub");
+  while((count = ssfs_readdir("listed", &cursor, entries, 7)) > 0){
+    for(int j = 0; j < count; j++){
+      int i;
+      if(strcmp(entries[j].name, "late") == 0)
+        continue; //May or may not be listed
+      if(strcmp(entries[j].name, "sub") == 0){
+        if(!entries[j].stat.directory){
+          fprintf(stderr, "Error: A directory is listed as a file\n");
+          *err_no += 1;
+        }
+      }else if(sscanf(entries[j].name, "file%d", &i) != 1 || i < 0 || i >= 60 || seen[i]++ ||
+               entries[j].stat.size != i || entries[j].stat.directory){
+        fprintf(stderr, "Error: Unexpected listed entry %s of size %d\n", entries[j].name, entries[j].stat.size);
+        *err_no += 1;
+      }
+    }
+    ssfs_fclose(ssfs_fopen("listed/late")); //Entries created during the scan do not disturb it
+  }
+  for(int i = 0; i < 60; i++){
+    if(seen[i] != 1){
+      fprintf(stderr, "Error: File file%d was listed %d times\n", i, seen[i]);
+      *err_no += 1;
+    }
+  }
+  if(count != 0 || ssfs_readdir("listed/file1", &cursor, entries, 7) != -1 ||
+     ssfs_readdir("missing", &cursor, entries, 7) != -1){
+    fprintf(stderr, "Error: Could not list a directory to its end\n");
+    *err_no += 1;
+  }
+  cursor = 0;
+  if(ssfs_readdir("/", &cursor, entries, 7) != 1 || strcmp(entries[0].name, "listed") != 0){
+    fprintf(stderr, "Error: Could not list the root directory\n");
+    *err_no += 1;
+  }
+  if(ssfs_stat("listed/file42", &stat) != 0 || stat.size != 42 || stat.directory ||
+     ssfs_stat("/", &stat) != 0 || stat.inode != 0 || !stat.directory || ssfs_stat("listed/nothing", &stat) != -1){
+    fprintf(stderr, "Error: Wrong description of a file\n");
+    *err_no += 1;
+  }
+  printf("\n-------------------------------\nReaddir: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_statfs(int *err_no){
+  ssfs_statfs_t before, after;
+  char *text = rand_text(10 * 1024);
+  mkssfs(1);
+  ssfs_statfs(&before);
+  if(before.block_size != 1024 || before.free_blocks <= 0 || before.free_blocks > before.num_blocks ||
+     before.free_files != before.num_files){
+    fprintf(stderr, "Error: Wrong capacity of a fresh file system\n");
+    *err_no += 1;
+  }
+  int fd = ssfs_fopen("counted.txt");
+  ssfs_fwrite(fd, text, 10 * 1024);
+  ssfs_statfs(&after); //Buffered data reserves its blocks
+  if(after.free_blocks != before.free_blocks - 10 || after.free_files != before.free_files - 1){
+    fprintf(stderr, "Error: %d free blocks and %d free files after a write, expected %d and %d\n", after.free_blocks,
+            after.free_files, before.free_blocks - 10, before.free_files - 1);
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  mkssfs(0); //The counts must be on the disk
+  ssfs_statfs(&after);
+  if(after.free_blocks != before.free_blocks - 10 || ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: %d free blocks after a remount, expected %d\n", after.free_blocks, before.free_blocks - 10);
+    *err_no += 1;
+  }
+  ssfs_remove("counted.txt");
+  ssfs_statfs(&after);
+  if(after.free_blocks != before.free_blocks || after.free_files != before.free_files){
+    fprintf(stderr, "Error: Removing a file did not free its blocks\n");
+    *err_no += 1;
+  }
+  free(text);
+  printf("\n-------------------------------\nStatfs: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_allocation_groups(int *err_no){
+  char *text = rand_text(16 * 2048);
+  mkssfs(1);
+  for(int i = 0; i < 8; i++){ //Two files growing at the same time, flushed in turn
+    int a = ssfs_fopen("group_a.txt");
+    ssfs_fwrite(a, text + i * 4096, 2048);
+    ssfs_fclose(a);
+    int b = ssfs_fopen("group_b.txt");
+    ssfs_fwrite(b, text + i * 4096 + 2048, 2048);
+    ssfs_fclose(b);
+  }
+  //Each file only has its blocks in its allocation group, cut once by its indirect block
+  if(ssfs_fragmentation("group_a.txt") > 2 || ssfs_fragmentation("group_b.txt") > 2){
+    fprintf(stderr, "Error: Files growing at the same time have %d and %d extents instead of 2\n",
+            ssfs_fragmentation("group_a.txt"), ssfs_fragmentation("group_b.txt"));
+    *err_no += 1;
+  }
+  free(text);
+  printf("\n-------------------------------\nAllocation groups: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_log_structured(int *err_no){
+  char *text = rand_text(32 * 1024);
+  char *buf = malloc(20 * 1024);
+  mkssfs(1);
+  ssfs_set_log_structured(1);
+  int fd = ssfs_fopen("log.txt");
+  ssfs_fwrite(fd, text, 20 * 1024);
+  ssfs_fclose(fd);
+  for(int i = 0; i < 12; i++){ //Small random overwrites, each appended to the log
+    int offset = (i * 7 % 20) * 1024 + 100;
+    memcpy(text + offset, text + 20 * 1024 + i * 1000, 500);
+    fd = ssfs_fopen("log.txt");
+    ssfs_fwseek(fd, offset);
+    ssfs_fwrite(fd, text + offset, 500);
+    ssfs_fclose(fd);
+  }
+  ssfs_statfs_t before, after;
+  ssfs_statfs(&before);
+  int moved = ssfs_clean(1000);
+  ssfs_statfs(&after);
+  if(moved <= 0 || after.free_blocks != before.free_blocks){
+    fprintf(stderr, "Error: Cleaning moved %d block(s), with %d free blocks instead of %d\n", moved,
+            after.free_blocks, before.free_blocks);
+    *err_no += 1;
+  }
+  mkssfs(0); //The mode is kept in the super block
+  fd = ssfs_fopen("log.txt");
+  if(ssfs_fread(fd, buf, 20 * 1024) != 20 * 1024 || memcmp(buf, text, 20 * 1024) != 0){
+    fprintf(stderr, "Error: Data overwritten in log-structured mode was not read back\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  if(ssfs_fsck(0) != 0){
+    fprintf(stderr, "Error: Log-structured file system fails its check\n");
+    *err_no += 1;
+  }
+  ssfs_set_log_structured(0);
+  free(buf);
+  free(text);
+  printf("\n-------------------------------\nLog-structured mode: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_flusher(int *err_no){
+  int size = 3000;
+  char *text = rand_text(2 * size);
+  char *read_buf = calloc(size + 1, sizeof(char));
+  ssfs_options_t fresh = {1, 1, 4, 0};
+  ssfs_t *volume = ssfs_mount("volume_f", &fresh);
+  int fd = ssfs_volume_fopen(volume, "flushed.txt");
+  ssfs_volume_fwrite(volume, fd, text, size);
+  if(ssfs_volume_fragmentation(volume, "flushed.txt") != 0){
+    fprintf(stderr, "Error: A small write went to the disk right away\n");
+    *err_no += 1;
+  }
+  int waited = 0;
+  for(; waited < 5000 && ssfs_volume_fragmentation(volume, "flushed.txt") != 1; waited += 50)
+    usleep(50 * 1000); //Written back by the flusher once old enough
+  if(waited >= 5000){
+    fprintf(stderr, "Error: The flusher did not write back the buffered data of an open file\n");
+    *err_no += 1;
+  }
+  int synced = ssfs_volume_fopen(volume, "synced.txt");
+  ssfs_volume_fwrite(volume, synced, text + size, size);
+  if(ssfs_volume_fsync(volume, synced) != 0 || ssfs_volume_fragmentation(volume, "synced.txt") != 1){
+    fprintf(stderr, "Error: Fsync did not write the data of an open file\n");
+    *err_no += 1;
+  }
+  int reread = ssfs_volume_fopen(volume, "reread.txt"); //Reads after a flush see the new data, not the old cache
+  ssfs_volume_fwrite(volume, reread, text, 2048);
+  ssfs_volume_fsync(volume, reread);
+  for(int pass = 0; pass < 2; pass++){
+    ssfs_volume_fwseek(volume, reread, 1024);
+    ssfs_volume_fwrite(volume, reread, text + 2048 + pass * 1024, 1024);
+    ssfs_volume_frseek(volume, reread, 0);
+    ssfs_volume_fread(volume, reread, read_buf, 2048); //Caches block 1 as it is on the disk
+    if(pass == 0){
+      ssfs_volume_fsync(volume, reread);
+    }else{
+      int marker = ssfs_volume_fopen(volume, "marker.txt");
+      ssfs_volume_fwrite(volume, marker, text, size);
+      for(waited = 0; waited < 5000 && ssfs_volume_fragmentation(volume, "marker.txt") != 1; waited += 50)
+        usleep(50 * 1000); //Both files written back by a flusher pass
+    }
+    memset(read_buf, 0, size + 1);
+    ssfs_volume_frseek(volume, reread, 1024);
+    if(ssfs_volume_fread(volume, reread, read_buf, 1024) != 1024 ||
+       strncmp(read_buf, text + 2048 + pass * 1024, 1024) != 0){
+      fprintf(stderr, "Error: Read stale data after %s\n", pass == 0 ? "fsync" : "a flusher pass");
+      *err_no += 1;
+    }
+  }
+  ssfs_unmount(volume);
+  volume = ssfs_mount("volume_f", NULL);
+  for(int i = 0; i < 2; i++){
+    fd = ssfs_volume_fopen(volume, i == 0 ? "flushed.txt" : "synced.txt");
+    memset(read_buf, 0, size + 1);
+    if(ssfs_volume_fread(volume, fd, read_buf, size) != size || strncmp(read_buf, text + i * size, size) != 0){
+      fprintf(stderr, "Error: Data written back in the background was not read back\n");
+      *err_no += 1;
+    }
+  }
+  if(ssfs_volume_fsck(volume, 0) != 0){
+    fprintf(stderr, "Error: Volume written back in the background fails its check\n");
+    *err_no += 1;
+  }
+  ssfs_unmount(volume);
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nFlusher: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/*
+Fills a log-structured volume block by block with two pairs of files in turn, then removes one file of each pair,
+which leaves every segment half used. The flusher should clean the segments in the background, moving the blocks of
+the first file together, and the files left should read back correctly.
+*/
+int test_background_clean(int *err_no){
+  int size = 225 * 1024;
+  char *names[4] = {"keep1.txt", "drop1.txt", "keep2.txt", "drop2.txt"};
+  char *text[4];
+  char *read_buf = calloc(size + 1, sizeof(char));
+  ssfs_options_t fresh = {1, 1, 4, 0};
+  for(int i = 0; i < 4; i++)
+    text[i] = rand_text(size); //Distinct blocks, so that none is deduplicated
+  ssfs_t *volume = ssfs_mount("volume_c", &fresh);
+  ssfs_volume_set_log_structured(volume, 1);
+  for(int pair = 0; pair < 2; pair++){
+    for(int j = 0; j < size; j += 1024){
+      for(int i = 2 * pair; i < 2 * pair + 2; i++){
+        int fd = ssfs_volume_fopen(volume, names[i]);
+        ssfs_volume_fwrite(volume, fd, text[i] + j, 1024);
+        ssfs_volume_fclose(volume, fd); //Appends the block to the log
+      }
+    }
+  }
+  int extents = ssfs_volume_fragmentation(volume, "keep1.txt");
+  ssfs_volume_remove(volume, "drop1.txt");
+  ssfs_volume_remove(volume, "drop2.txt");
+  int waited = 0;
+  for(; waited < 5000 && ssfs_volume_fragmentation(volume, "keep1.txt") >= extents; waited += 50)
+    usleep(50 * 1000); //Cleaned by the flusher once the log runs out of free segments
+  if(waited >= 5000){
+    fprintf(stderr, "Error: The flusher did not clean a log-structured volume with no free segments\n");
+    *err_no += 1;
+  }
+  for(int i = 0; i < 4; i += 2){
+    int fd = ssfs_volume_fopen(volume, names[i]);
+    memset(read_buf, 0, size + 1);
+    if(ssfs_volume_fread(volume, fd, read_buf, size) != size || strcmp(read_buf, text[i]) != 0){
+      fprintf(stderr, "Error: File %s was damaged by the background cleaner\n", names[i]);
+      *err_no += 1;
+    }
+    ssfs_volume_fclose(volume, fd);
+  }
+  if(ssfs_volume_fsck(volume, 0) != 0){
+    fprintf(stderr, "Error: Volume cleaned in the background fails its check\n");
+    *err_no += 1;
+  }
+  ssfs_unmount(volume);
+  for(int i = 0; i < 4; i++)
+    free(text[i]);
+  free(read_buf);
+  printf("\n-------------------------------\nBackground clean: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+int test_read_after_flush(int *err_no){
+  char *text = rand_text(72 * 1024);
+  char *read_buf = calloc(2048 + 1, sizeof(char));
+  mkssfs(1);
+  int fd = ssfs_fopen("stale.txt");
+  ssfs_fwrite(fd, text, 2048);
+  ssfs_fclose(fd);
+  fd = ssfs_fopen("stale.txt");
+  ssfs_fwseek(fd, 1024);
+  ssfs_fwrite(fd, text + 2048, 1024); //Buffered over block 1 on the disk
+  ssfs_frseek(fd, 0);
+  ssfs_fread(fd, read_buf, 2048); //Fills the read-ahead cache with the old block 1
+  ssfs_fwseek(fd, 4096);
+  ssfs_fwrite(fd, text + 4096, 64 * 1024); //Fills the write buffer, which is flushed
+  memset(read_buf, 0, 2048 + 1);
+  ssfs_frseek(fd, 1024);
+  if(ssfs_fread(fd, read_buf, 1024) != 1024 || strncmp(read_buf, text + 2048, 1024) != 0){
+    fprintf(stderr, "Error: Read the contents a flushed block had before it was overwritten\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  free(read_buf);
+  free(text);
+  printf("\n-------------------------------\nRead after flush: Current Error Num: %d\n--------------------------------\n\n", *err_no);
+  return 0;
+}
+
+/* The main testing program
+ */
+int main(){
+  int err_no = 0;
+  printf("\n-------------------------------\nInitializing Extensions test.\n--------------------------------\n\n");
+  test_journal_replay(&err_no);
+  test_fsck(&err_no);
+  test_defrag(&err_no);
+  test_delayed_allocation(&err_no);
+  test_read_ahead(&err_no);
+  test_sparse_file(&err_no);
+  test_truncate_fallocate(&err_no);
+  test_inline_data(&err_no);
+  test_directories(&err_no);
+  test_lookup_cache(&err_no);
+  test_compression(&err_no);
+  test_dedup(&err_no);
+  test_checksums(&err_no);
+  test_striping(&err_no);
+  test_mirroring(&err_no);
+  test_volumes(&err_no);
+  test_zero_copy(&err_no);
+  test_batch(&err_no);
+  test_readdir(&err_no);
+  test_statfs(&err_no);
+  test_allocation_groups(&err_no);
+  test_log_structured(&err_no);
+  test_flusher(&err_no);
+  test_background_clean(&err_no);
+  test_read_after_flush(&err_no);
+  printf("\n-------------------------------\nExtensions test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return err_no;
+}
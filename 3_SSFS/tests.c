@@ -171,9 +171,9 @@ int test_seek(int *file_id, int *file_size, int *write_ptr, char **write_buf, in
     res = ssfs_fwseek(file_id[i], -1);
     if(res >= 0)
       fprintf(stderr, "Warning: ssfs_frseek returned positive. Negative seek location attempted. Potential fwseek fail?\n");
-    res = ssfs_fwseek(file_id[i], file_size[i] + 100);
-    if(res >= 0)
-      fprintf(stderr, "Warning: ssfs_frseek returned positive. Seek location beyond file size attempted. Potential fwseek fail?\n");
+    res = ssfs_fwseek(file_id[i], file_size[i] + 100); //Allowed, writing there would leave a hole
+    if(res < 0)
+      fprintf(stderr, "Warning: ssfs_fwseek returned negative. Seek location beyond file size attempted. Potential fwseek fail?\n");
     res = ssfs_frseek(file_id[i], file_size[i] - offset);
     if(res < 0)
       fprintf(stderr, "Warning: ssfs_frseek returned negative. Potential frseek fail?\n");
@@ -209,7 +209,7 @@ int test_read_all_files(int *file_id, int *file_size, char **write_buf, int num_
     if(strcmp(buf, write_buf[i]) != 0){
       fprintf(stderr, "Error: \nRead failed.\n\n");
       *err_no += 1;
-      printf("%d %d %d\n", strlen(buf), strlen(write_buf[i]), file_size[i]);
+      printf("%zu %zu %d\n", strlen(buf), strlen(write_buf[i]), file_size[i]);
     }
   }
   free(buf);
@@ -442,11 +442,11 @@ int test_write_to_overflow(int *file_id, int *file_size, char **write_buf, int i
     if(res < 0)
           fprintf(stderr, "Warning: ssfs_frseek returned negative. Potential frseek fail?\n");
     read_length = strlen(buffer[i]);
-    if(ssfs_fread(index, read_buffer, read_length) < 0){
+    if(ssfs_fread(file_id[index], read_buffer, read_length) < 0){
         fprintf(stderr, "Error: Read Failed. \n");
         *err_no += 1;
     }else if(read_length != strlen(read_buffer)){
-        fprintf(stderr, "Error: Read length error. Expected %d but received %d\n", read_length, strlen(read_buffer));
+        fprintf(stderr, "Error: Read length error. Expected %d but received %zu\n", read_length, strlen(read_buffer));
         *err_no += 1;
     }else if(strcmp(buffer[i], read_buffer) != 0){
         fprintf(stderr, "Error: Invalid Content Read. Expected:\n%s\nReceived:\n %s\n", buffer[i], read_buffer);
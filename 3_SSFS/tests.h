@@ -33,10 +33,11 @@
 #define ABS_CAP_FD        4092
 #define ABS_CAP_FILE_SIZE 2000000
 
-static char test_str[] = "Graphic Card is life. I need a 1080 for Christmas. As a side note, it's quite obvious when people copy from github. Usually there's more than one guy copying for the same repository.\n";
+static char test_str[] __attribute__((unused)) = "Graphic Card is life. I need a 1080 for Christmas. As a side note, it's quite obvious when people copy from github. Usually there's more than one guy copying for the same repository.\n";
  
 //Random Text Generators
 char *rand_name();
+char *rand_text(int length);
 
 //Seek
 int test_seek(int *file_id, int *file_size, int *write_ptr, char **write_buf, int num_file, int offset, int *err_no);